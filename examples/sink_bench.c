@@ -0,0 +1,141 @@
+/**
+ * \file examples/sink_bench.c
+ * \brief file sink throughput benchmark
+ * \author glcs-packetstream contributors
+ * \date 2026
+ * For conditions of distribution and use, see copyright notice in packetstream.h
+ *
+ * One producer thread streams packets through a buffer while main thread
+ * drains them to a file with ps_sink_poll().
+ *
+ * usage: sink_bench file [direct] [packet size] [packet count] [io size] [depth]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <packetstream.h>
+#include "optimization.h"
+
+#define BUFFER_SIZE (64 * 1024 * 1024)
+#define PACKET_SIZE 4000
+#define PACKET_COUNT 250000
+
+static size_t packet_size = PACKET_SIZE;
+static long packet_count = PACKET_COUNT;
+static int done;
+
+void *writer_thread(void *addr)
+{
+	ps_buffer_t *buffer = (ps_buffer_t *) addr;
+	ps_packet_t packet;
+	char *temp = (char *) malloc(packet_size);
+	long i;
+
+	memset(temp, 'x', packet_size);
+	ps_packet_init(&packet, buffer);
+
+	for (i = 0; i < packet_count; i++) {
+		if (unlikely(ps_packet_open(&packet, PS_PACKET_WRITE)))
+			break;
+		if (unlikely(ps_packet_write(&packet, temp, packet_size)))
+			break;
+		if (unlikely(ps_packet_close(&packet)))
+			break;
+	}
+
+	ps_packet_destroy(&packet);
+	free(temp);
+	__atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	ps_buffer_t buffer;
+	ps_bufferattr_t bufferattr;
+	ps_sink_t sink;
+	pthread_t writer_thread_t;
+	struct timespec start, end;
+	size_t io_size = 0;
+	int fd, direct = 0, depth = 0, finished, ret;
+	double secs;
+
+	if (argc < 2) {
+		printf("usage: %s file [direct] [packet size] [packet count] [io size] [depth]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		direct = atoi(argv[2]);
+	if (argc > 3)
+		packet_size = strtoul(argv[3], NULL, 10);
+	if (argc > 4)
+		packet_count = strtol(argv[4], NULL, 10);
+	if (argc > 5)
+		io_size = strtoul(argv[5], NULL, 10);
+	if (argc > 6)
+		depth = atoi(argv[6]);
+
+	fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	if (fd == -1) {
+		printf("open(): %s\n", strerror(errno));
+		return 1;
+	}
+
+	ps_bufferattr_init(&bufferattr);
+	ps_bufferattr_setsize(&bufferattr, BUFFER_SIZE);
+
+	if (ps_buffer_init(&buffer, &bufferattr)) {
+		printf("ps_buffer_init() failed\n");
+		return 1;
+	}
+	ps_bufferattr_destroy(&bufferattr);
+
+	if ((ret = ps_sink_init(&sink, &buffer, fd, io_size, depth))) {
+		printf("ps_sink_init(): %s\n", strerror(ret));
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&writer_thread_t, NULL, writer_thread, &buffer);
+
+	/* stop only after an empty poll which started after producer was done */
+	do {
+		finished = __atomic_load_n(&done, __ATOMIC_SEQ_CST);
+		ret = ps_sink_poll(&sink, PS_PACKET_TRY);
+		if (ret == EBUSY)
+			sched_yield();
+		else if (ret) {
+			printf("ps_sink_poll(): %s\n", strerror(ret));
+			break;
+		}
+	} while (!finished || (ret != EBUSY));
+
+	if ((ret = ps_sink_flush(&sink)))
+		printf("ps_sink_flush(): %s\n", strerror(ret));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_join(writer_thread_t, NULL);
+
+	secs = (double) (end.tv_sec - start.tv_sec) +
+	       (double) (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	printf("written     : %llu bytes\n", (unsigned long long) sink.offset);
+	printf("time        : %.3f secs\n", secs);
+	printf("throughput  : %.2f MB/s\n", (double) sink.offset / secs / 1000000.0);
+
+	ps_sink_destroy(&sink);
+	ps_buffer_destroy(&buffer);
+	close(fd);
+
+	return 0;
+}
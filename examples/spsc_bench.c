@@ -0,0 +1,215 @@
+/**
+ * \file examples/spsc_bench.c
+ * \brief small packet throughput and cross-core cache miss benchmark
+ * \author glcs-packetstream contributors
+ * \date 2026
+ * For conditions of distribution and use, see copyright notice in packetstream.h
+ *
+ * One producer and one consumer thread, pinned on different cpus when
+ * possible, stream small packets through a buffer. Cache misses of both
+ * threads are counted with perf_event_open() so layout changes of buffer
+ * state can be compared.
+ *
+ * usage: spsc_bench [classic|spsc|mpmc] [packet size] [packet count]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <packetstream.h>
+#include "optimization.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+#define PACKET_SIZE 32
+#define PACKET_COUNT 10000000
+
+static size_t packet_size = PACKET_SIZE;
+static long packet_count = PACKET_COUNT;
+
+struct bench_thread_s {
+	ps_buffer_t *buffer;
+	int cpu;
+	int perf_fd;
+	int perf_errno;
+	unsigned long long misses;
+};
+
+static int perf_open(void)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CACHE_MISSES;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+
+	/* this thread only, any cpu */
+	return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void bench_start(struct bench_thread_s *t)
+{
+	cpu_set_t set;
+
+	if (t->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(t->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	t->perf_fd = perf_open();
+	if (t->perf_fd == -1)
+		t->perf_errno = errno;
+	else {
+		ioctl(t->perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(t->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static void bench_stop(struct bench_thread_s *t)
+{
+	if (t->perf_fd == -1)
+		return;
+
+	ioctl(t->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(t->perf_fd, &t->misses, sizeof(t->misses)) != sizeof(t->misses))
+		t->misses = 0;
+	close(t->perf_fd);
+}
+
+void *writer_thread(void *addr)
+{
+	struct bench_thread_s *t = (struct bench_thread_s *) addr;
+	ps_packet_t packet;
+	char *temp = (char *) calloc(1, packet_size);
+	long i;
+
+	ps_packet_init(&packet, t->buffer);
+	bench_start(t);
+
+	for (i = 0; i < packet_count; i++) {
+		if (unlikely(ps_packet_open(&packet, PS_PACKET_WRITE)))
+			break;
+		if (unlikely(ps_packet_write(&packet, temp, packet_size)))
+			break;
+		if (unlikely(ps_packet_close(&packet)))
+			break;
+	}
+
+	bench_stop(t);
+	ps_packet_destroy(&packet);
+	free(temp);
+
+	return NULL;
+}
+
+void *reader_thread(void *addr)
+{
+	struct bench_thread_s *t = (struct bench_thread_s *) addr;
+	ps_packet_t packet;
+	char *temp = (char *) malloc(packet_size);
+	long i;
+
+	ps_packet_init(&packet, t->buffer);
+	bench_start(t);
+
+	for (i = 0; i < packet_count; i++) {
+		if (unlikely(ps_packet_open(&packet, PS_PACKET_READ)))
+			break;
+		if (unlikely(ps_packet_read(&packet, temp, packet_size)))
+			break;
+		if (unlikely(ps_packet_close(&packet)))
+			break;
+	}
+
+	bench_stop(t);
+	ps_packet_destroy(&packet);
+	free(temp);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	ps_buffer_t buffer;
+	ps_bufferattr_t bufferattr;
+	ps_flags_t flags = 0;
+	struct bench_thread_s writer, reader;
+	pthread_t writer_thread_t, reader_thread_t;
+	struct timespec start, end;
+	double secs;
+
+	if (argc > 1) {
+		if (!strcmp(argv[1], "spsc"))
+			flags = PS_BUFFER_SPSC;
+		else if (!strcmp(argv[1], "mpmc"))
+			flags = PS_BUFFER_MPMC;
+		else if (strcmp(argv[1], "classic")) {
+			printf("usage: %s [classic|spsc|mpmc] [packet size] [packet count]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (argc > 2)
+		packet_size = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		packet_count = strtol(argv[3], NULL, 10);
+
+	ps_bufferattr_init(&bufferattr);
+	ps_bufferattr_setflags(&bufferattr, flags);
+	ps_bufferattr_setsize(&bufferattr, BUFFER_SIZE);
+
+	if (ps_buffer_init(&buffer, &bufferattr)) {
+		printf("ps_buffer_init() failed\n");
+		return 1;
+	}
+	ps_bufferattr_destroy(&bufferattr);
+
+	memset(&writer, 0, sizeof(writer));
+	memset(&reader, 0, sizeof(reader));
+	writer.buffer = reader.buffer = &buffer;
+	writer.cpu = reader.cpu = -1;
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+		writer.cpu = 0;
+		reader.cpu = 1;
+	} else
+		printf("warning: single cpu, producer and consumer share a core\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&reader_thread_t, NULL, reader_thread, &reader);
+	pthread_create(&writer_thread_t, NULL, writer_thread, &writer);
+	pthread_join(writer_thread_t, NULL);
+	pthread_join(reader_thread_t, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (double) (end.tv_sec - start.tv_sec) +
+	       (double) (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	printf("packets     : %ld x %zu bytes\n", packet_count, packet_size);
+	printf("time        : %.3f secs\n", secs);
+	printf("throughput  : %.2f Mpackets/s\n", (double) packet_count / secs / 1000000.0);
+	if ((writer.perf_fd == -1) || (reader.perf_fd == -1))
+		printf("cache misses: not available (%s)\n",
+		       strerror(writer.perf_errno ? writer.perf_errno : reader.perf_errno));
+	else
+		printf("cache misses: %.2f per packet (producer %llu, consumer %llu)\n",
+		       (double) (writer.misses + reader.misses) / (double) packet_count,
+		       writer.misses, reader.misses);
+
+	ps_buffer_destroy(&buffer);
+
+	return 0;
+}
@@ -17,6 +17,14 @@
 
 #include <packetstream.h>
 
+/* packet types, consumers route packets on header type alone */
+#define TEXEC_EXEC 0
+#define TEXEC_KILL 1
+
+/* handler return values, both stop ps_dispatch() */
+#define TEXEC_STOP -1
+#define TEXEC_RUN  -2
+
 struct texec_shared_s {
 	int buffer_shmid;
 	sem_t finished;
@@ -41,12 +49,11 @@ struct texec_shared_s *shm_get_shared(int *shmid)
 void send_kill(ps_buffer_t *buffer)
 {
 	ps_packet_t packet;
-	const char kill_cmd = 'k';
 
 	ps_packet_init(&packet, buffer);
 
 	ps_packet_open(&packet, PS_PACKET_WRITE);
-	ps_packet_write(&packet, (void *) &kill_cmd, 1);
+	ps_packet_settype(&packet, TEXEC_KILL);
 	ps_packet_close(&packet);
 
 	ps_packet_destroy(&packet);
@@ -55,47 +62,64 @@ void send_kill(ps_buffer_t *buffer)
 void send_command(ps_buffer_t *buffer, char *command)
 {
 	ps_packet_t packet;
-	const char exec_cmd = 'e';
 
 	ps_packet_init(&packet, buffer);
 
 	ps_packet_open(&packet, PS_PACKET_WRITE);
-	ps_packet_write(&packet, (void *) &exec_cmd, 1);
+	ps_packet_settype(&packet, TEXEC_EXEC);
 	ps_packet_write(&packet, command, strlen(command) + 1);
 	ps_packet_close(&packet);
 
 	ps_packet_destroy(&packet);
 }
 
+int handle_exec(ps_packet_t *packet, void *arg)
+{
+	char **command = (char **) arg;
+	size_t len;
+
+	ps_packet_getsize(packet, &len);
+
+	if (*command == NULL)
+		*command = (char *) malloc(len);
+	else
+		*command = (char *) realloc(*command, len);
+
+	ps_packet_read(packet, *command, len);
+
+	/* run it once the packet is closed, not while holding buffer space */
+	return TEXEC_RUN;
+}
+
+int handle_kill(ps_packet_t *packet, void *arg)
+{
+	(void) packet;
+	(void) arg;
+
+	/* kill is passed on once this packet is closed, writing while a
+	   read packet is open could wait on a full buffer forever */
+	return TEXEC_STOP;
+}
+
 void *exec_thread(void *addr)
 {
 	ps_buffer_t *buffer = (ps_buffer_t *) addr;
+	ps_handler_t handlers[] = { [TEXEC_EXEC] = handle_exec, [TEXEC_KILL] = handle_kill };
 	ps_packet_t packet;
-	ps_packet_init(&packet, buffer);
 	char *command = NULL;
-	size_t len;
-
-	while (1) {
-		ps_packet_open(&packet, PS_PACKET_READ);
-		ps_packet_getsize(&packet, &len);
+	int ret;
 
-		if (command == NULL)
-			command = (char *) malloc(len);
-		else
-			command = (char *) realloc(command, len);
+	ps_packet_init(&packet, buffer);
 
-		ps_packet_read(&packet, command, len);
-		ps_packet_close(&packet);
+	while ((ret = ps_dispatch(&packet, handlers, 2, &command, 0)) == TEXEC_RUN)
+		system(command);
 
-		if (command[0] == 'k') {
-			send_kill(buffer);
-			break;
-		}
-
-		system(&command[1]);
-	}
+	/* pass kill on to the next thread */
+	if (ret == TEXEC_STOP)
+		send_kill(buffer);
 
 	ps_packet_destroy(&packet);
+	free(command);
 
 	return NULL;
 }
@@ -23,6 +23,8 @@
 
  */
 
+#define _GNU_SOURCE
+
 #include "packetstream.h"
 #include "optimization.h"
 
@@ -30,8 +32,13 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #ifdef __PS_SHM
 #include <sys/time.h>
@@ -39,6 +46,29 @@
 #include <sys/shm.h>
 #endif
 
+#if defined(__PS_MIRROR) || defined(__PS_HUGEPAGES)
+#include <sys/mman.h>
+#endif
+
+#ifdef __PS_NUMA
+#include <linux/mempolicy.h>
+#endif
+
+#ifdef __PS_ROBUST
+#include <signal.h>
+#endif
+
+#ifdef __PS_SHMFD
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#endif
+
+#ifdef __PS_SINK
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#endif
+
 /**
  * \addtogroup packetstream
  *  \{
@@ -68,32 +98,197 @@
 	__PS_PACKET_CHECK(packet)
 #define __PS_CHECK_CANCEL_READ(state) \
 	if (unlikely(state->flags & PS_BUFFER_CANCELLED)) { \
-		pthread_mutex_unlock(&state->read_mutex); \
+		ps_buffer_unlock(buffer, &state->read_mutex); \
 		return EINTR; \
 	}
 #define __PS_CHECK_CANCEL_WRITE(state) \
 	if (unlikely(state->flags & PS_BUFFER_CANCELLED)) { \
-		pthread_mutex_unlock(&state->write_mutex); \
+		ps_buffer_unlock(buffer, &state->write_mutex); \
 		return EINTR; \
 	}
+#define __PS_LOAD_ACQUIRE(ptr) \
+	__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define __PS_STORE_RELEASE(ptr, val) \
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define __PS_CAS(ptr, expected, val) \
+	__atomic_compare_exchange_n(ptr, expected, val, 0, \
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define __PS_STATS_ADD(buffer, field, val) \
+	do { \
+		struct ps_stats_shard_s *__shard = ps_stats_begin(buffer); \
+		__atomic_add_fetch(&__shard->field, val, __ATOMIC_RELAXED); \
+		ps_stats_end(__shard); \
+	} while (0)
+/* packets and bytes are seen together by ps_buffer_stats() */
+#define __PS_STATS_ADD2(buffer, field1, val1, field2, val2) \
+	do { \
+		struct ps_stats_shard_s *__shard = ps_stats_begin(buffer); \
+		__atomic_add_fetch(&__shard->field1, val1, __ATOMIC_RELAXED); \
+		__atomic_add_fetch(&__shard->field2, val2, __ATOMIC_RELAXED); \
+		ps_stats_end(__shard); \
+	} while (0)
+/* PS_BUFFER_LATENCY histograms follow stats */
+#define __PS_HISTOGRAMS(buffer) \
+	((ps_histograms_t *) &(buffer)->stats[1])
+/* PS_BUFFER_OCCUPANCY samples follow stats and histograms */
+#define __PS_OCCUPANCY(buffer) \
+	((ps_occupancy_t *) ((unsigned char *) (buffer)->stats + \
+	 ps_stats_occupancy_offset(((struct ps_state_s *) (buffer)->state)->flags)))
+/* counter shards follow stats, histograms and samples */
+#define __PS_STATS_SHARDS(buffer) \
+	((struct ps_stats_shard_s *) ((unsigned char *) (buffer)->stats + \
+	 ps_stats_shards_offset(((struct ps_state_s *) (buffer)->state)->flags)))
+
+/** cache line size, ps_state_s sections never share one */
+#define PS_CACHELINE_SIZE 64
+#define __PS_CACHELINE_ALIGNED __attribute__ ((aligned (PS_CACHELINE_SIZE)))
+
+/** number of PS_BUFFER_STATS counter shards, threads are spread over them */
+#define PS_STATS_SHARDS 16
+
+/**
+ * PS_BUFFER_STATS counters bumped by a subset of threads. Updaters
+ * increment begin before and end after touching the counters, a reader
+ * which saw end equal to begin around its copy has a consistent one.
+ */
+struct ps_stats_shard_s {
+	/** updates started */
+	uint64_t begin;
+	/** updates done */
+	uint64_t end;
+	size_t read_packets;
+	size_t written_packets;
+	size_t read_bytes;
+	size_t written_bytes;
+	uint64_t read_wait_nsec;
+	uint64_t write_wait_nsec;
+	size_t padding_bytes;
+	size_t skipped_packets;
+} __PS_CACHELINE_ALIGNED;
+
+/* 1 + shard of calling thread, 0 until first update */
+static __thread unsigned int ps_stats_shard_id;
+static unsigned int ps_stats_shard_next;
+
+/** attached processes tracked by a PS_BUFFER_ROBUST buffer */
+#define PS_MAX_PEERS 32
+/** open packets tracked per process */
+#define PS_PEER_PACKETS 16
+/** peers active more recently than this are not checked for death */
+#define PS_PEER_TIMEOUT_NSEC 10000000
+
+/* open packet entry kinds */
+/** entry is unused */
+#define PS_PEER_FREE        0
+/** entry is taken, packet is not opened yet */
+#define PS_PEER_CLAIMED     1
+/** read_next is being moved past packet under read_mutex */
+#define PS_PEER_OPENING     2
+/** packet is open for reading */
+#define PS_PEER_READ        3
+/** packet is open for writing, write_mutex is held */
+#define PS_PEER_WRITE       4
+/** packet is open for writing and its size is set */
+#define PS_PEER_SIZED       5
+/** dead peer's read packet is being closed */
+#define PS_PEER_REAP_READ   6
+/** dead peer's write packet is being cancelled */
+#define PS_PEER_REAP_WRITE  7
+
+#define ps_peer_entry(state, entry) \
+	(&(state)->peers[(entry) / PS_PEER_PACKETS].packets[(entry) % PS_PEER_PACKETS])
+
+/**
+ * \ingroup buffer
+ * \brief process attached to a PS_BUFFER_ROBUST buffer
+ *
+ * Open packets are recorded so that the space or the packets held by a
+ * process which died can be given back by the survivors.
+ */
+struct ps_peer_s {
+	/** process id, 0 for a free slot */
+	int pid;
+	/** ps_buffer_utime() when process last opened a packet */
+	uint64_t heartbeat;
+	/** open packets */
+	struct {
+		/** packet position */
+		size_t pos;
+		/** PS_PEER_* */
+		int kind;
+	} packets[PS_PEER_PACKETS];
+};
+
+/**
+ * \ingroup buffer
+ * \brief consumer group of a PS_BUFFER_BROADCAST buffer
+ *
+ * Each group has its own cursors and sees every packet once.
+ */
+struct ps_group_s {
+	/** position of the first packet of group not closed yet */
+	size_t read_pos;
+	/** position of the next packet to be read by group */
+	size_t read_next;
+	/** group copy of write_pos */
+	size_t write_pos_cache;
+	/** mutex for claiming packets in group */
+	pthread_mutex_t read_mutex;
+	/** when read_mutex was taken, PS_BUFFER_LOCKSTATS only */
+	uint64_t read_mutex_since;
+} __PS_CACHELINE_ALIGNED;
 
 /**
  * \ingroup buffer
  * \brief internal buffer state
+ *
+ * State is split in cache line aligned sections so producers and
+ * consumers don't invalidate each other's lines on every packet.
+ * Offsets only depend on the structure, so PS_BUFFER_PSHARED
+ * processes attaching to the same segment agree on the layout.
+ *
+ * With PS_BUFFER_MPMC all positions are virtual: they only grow and
+ * the offset in buffer data area is position % size. read_first and
+ * free_bytes are not used since everything before read_pos is free.
  */
 struct ps_state_s {
+	/* read-mostly section */
+
 	/** flags */
 	ps_flags_t flags;
 	/** buffer size */
 	size_t size;
-	/** position of the first packet opened for reading or next
-	 *  packet to be read if there is no open (read) packets */
-	size_t read_pos;
+	/** packet header size */
+	size_t header_size;
+	/** packet payload alignment */
+	size_t align;
+	/** first position whose payload is aligned, used at start and wrap */
+	size_t first_pos;
+	/** PS_BACKING_* of data area */
+	int backing;
+	/** numa node of data area first page, -1 if unknown */
+	int numa_node;
+	/** node or policy requested with ps_bufferattr_setnumanode() */
+	int numa_request;
+	/** bumped by ps_buffer_resize() once data area is replaced */
+	int generation;
+	/** consumer groups with PS_BUFFER_BROADCAST */
+	int groups;
+	/** offset of data area from state in shared memory */
+	size_t data_offset;
+	/** nanoseconds between samples with PS_BUFFER_OCCUPANCY */
+	uint64_t sample_interval;
+#ifndef WIN32
+	/** absolute time (since EPOCH) when this buffer was created */
+	struct timespec create_time;
+#endif
+
+	/* producer section, read_first and free_bytes act as the producer
+	   view of read_pos which is only reloaded when buffer looks full */
+
 	/** position of the first packet opened for writing or next
 	 * packet to be written if there is no open (write) packets */
-	size_t write_pos;
-	/** position of the next packet to be read */
-	size_t read_next;
+	size_t write_pos __PS_CACHELINE_ALIGNED;
 	/** position of the next packet to be written */
 	size_t write_next;
 	/** the first written (possibly also read) packet that has
@@ -101,22 +296,73 @@ struct ps_state_s {
 	size_t read_first;
 	/** free bytes */
 	long free_bytes;
-	/** mutex for ps_buffer_openread() */
-	pthread_mutex_t read_mutex;
 	/** mutex for ps_buffer_openwrite()...ps_buffer_setsize() */
 	pthread_mutex_t write_mutex;
-	/** mutex for ps_buffer_closeread() */
-	pthread_mutex_t read_close_mutex;
 	/** mutex for ps_buffer_closewrite() */
 	pthread_mutex_t write_close_mutex;
-	/** number of consumed packets */
-	sem_t read_packets;
-	/** number of produced packets */
-	sem_t written_packets;
-#ifndef WIN32
-	/** absolute time (since EPOCH) when this buffer was created */
-	struct timespec create_time;
-#endif
+	/** when write_mutex was taken, PS_BUFFER_LOCKSTATS only */
+	uint64_t write_mutex_since;
+	/** when write_close_mutex was taken, PS_BUFFER_LOCKSTATS only */
+	uint64_t write_close_mutex_since;
+
+	/* consumer section */
+
+	/** position of the first packet opened for reading or next
+	 *  packet to be read if there is no open (read) packets */
+	size_t read_pos __PS_CACHELINE_ALIGNED;
+	/** position of the next packet to be read */
+	size_t read_next;
+	/** consumer copy of write_pos, only reloaded when buffer looks
+	 *  empty (not used with PS_BUFFER_MPMC) */
+	size_t write_pos_cache;
+	/** mutex for ps_buffer_openread() */
+	pthread_mutex_t read_mutex;
+	/** mutex for ps_buffer_closeread() */
+	pthread_mutex_t read_close_mutex;
+	/** when read_mutex was taken, PS_BUFFER_LOCKSTATS only */
+	uint64_t read_mutex_since;
+	/** when read_close_mutex was taken, PS_BUFFER_LOCKSTATS only */
+	uint64_t read_close_mutex_since;
+
+	/* wait section, written only when a thread goes to sleep */
+
+	/** futex consumers sleep on, bumped when write_pos moves */
+	int read_futex __PS_CACHELINE_ALIGNED;
+	/** futex producers sleep on, bumped when read_pos moves */
+	int write_futex;
+	/** consumers sleeping on read_futex */
+	int read_waiting;
+	/** producers sleeping on write_futex */
+	int write_waiting;
+	/** set while ps_buffer_resize() runs, consumers wait on it */
+	int resizing;
+
+	/* group section, PS_BUFFER_BROADCAST only, read_pos is then the
+	   read_pos of the slowest group and read_close_mutex protects all
+	   group read_pos */
+
+	/** consumer groups */
+	struct ps_group_s group[PS_MAX_GROUPS];
+
+	/* occupancy section, PS_BUFFER_OCCUPANCY only, last sample fields
+	   belong to the closer which claimed next_sample */
+
+	/** packets written and not yet released by readers */
+	long packets __PS_CACHELINE_ALIGNED;
+	/** ps_buffer_utime() when next sample is due, -1 while one is taken */
+	uint64_t next_sample;
+	/** ps_buffer_utime() of last sample */
+	uint64_t last_sample;
+	/** counters at last sample */
+	size_t last_written_packets;
+	size_t last_written_bytes;
+	size_t last_read_packets;
+	size_t last_read_bytes;
+
+	/* peer section, PS_BUFFER_ROBUST only */
+
+	/** attached processes */
+	struct ps_peer_s peers[PS_MAX_PEERS] __PS_CACHELINE_ALIGNED;
 };
 
 /**
@@ -126,17 +372,42 @@ struct ps_state_s {
 struct ps_packet_header_s {
 	/** flags */
 	ps_flags_t flags;
+	/** packet type, fills what would be padding before size */
+	int type;
 	/** packet size (excluding header) in bytes */
 	size_t size;
 };
 
+/**
+ * \ingroup packet
+ * \brief packet header used with PS_BUFFER_MPMC
+ *
+ * Space is claimed before the header is written, so a stale header left
+ * by an earlier lap can't be told apart from a fresh one by its flags.
+ * commit is the inverted virtual position of the packet once it has been
+ * written and, as positions never repeat, is not matched by stale headers.
+ */
+struct ps_mpmc_header_s {
+	/** common header */
+	struct ps_packet_header_s header;
+	/** ~(virtual position) when written, anything else otherwise */
+	size_t commit;
+};
+
 /**
  * \addtogroup packet
  *  \{
  */
 
+/** smallest fake dma size class is 1 << PS_FAKE_DMA_MIN_SHIFT bytes */
+#define PS_FAKE_DMA_MIN_SHIFT 8
+/** fake dma size classes, larger areas are allocated exactly and not cached */
+#define PS_FAKE_DMA_CLASSES   13
+
 /**
  * \brief fake dma object
+ *
+ * Object header and memory area are a single allocation.
  */
 struct ps_fake_dma_s {
 	/** temporary memory area */
@@ -147,19 +418,107 @@ struct ps_fake_dma_s {
 	size_t size;
 	/** position in packet */
 	size_t pos;
-	/** is this free */
-	int free;
-	/** next item in list */
+	/** size class, -1 if not cached */
+	int size_class;
+	/** next item in packet or free list */
 	struct ps_fake_dma_s *next;
 };
 
+/**
+ * \brief fake dma areas of a buffer in this process
+ */
+struct ps_fake_dma_arena_s {
+	/** protects arena */
+	pthread_mutex_t lock;
+	/** free areas by size class */
+	struct ps_fake_dma_s *free[PS_FAKE_DMA_CLASSES];
+	/** allocation alignment */
+	size_t align;
+	/** memory cap in bytes, 0 for none */
+	size_t limit;
+	/** memory held in areas, free or not */
+	size_t bytes;
+	/** largest bytes ever */
+	size_t peak;
+	/** number of areas allocated from heap */
+	size_t allocs;
+};
+
+/**
+ * \ingroup stats
+ * \brief ps_buffer_stats_delta() state of a process
+ */
+struct ps_stats_prev_s {
+	/** serializes callers */
+	pthread_mutex_t lock;
+	/** snapshot returned last */
+	ps_stats_t stats;
+};
+
 /** packet is written to buffer */
 #define PS_PACKET_HEADER_WRITTEN 1
 /** packet is read from buffer */
 #define PS_PACKET_HEADER_READ    2
+/** packet was left unfinished by a dead producer, consumers skip it */
+#define PS_PACKET_HEADER_CANCELLED 4
+/** packet is read by PS_BUFFER_BROADCAST consumer group */
+#define PS_PACKET_HEADER_GROUP(group) (256 << (group))
+
+/** PS_BUFFER_COMPACT header keeps flags in the two low bits, size above */
+#define PS_COMPACT_SIZE_SHIFT 2
+/** largest packet (and buffer) PS_BUFFER_COMPACT header can describe */
+#define PS_COMPACT_MAX_SIZE ((size_t) 1 << 30)
 
 /**  \} */
 
+/* header accessors, not used with PS_BUFFER_MPMC */
+static inline size_t ps_header_getsize(struct ps_state_s *state, void *header)
+{
+	if (state->flags & PS_BUFFER_COMPACT)
+		return *(uint32_t *) header >> PS_COMPACT_SIZE_SHIFT;
+	return ((struct ps_packet_header_s *) header)->size;
+}
+
+static inline void ps_header_setsize(struct ps_state_s *state, void *header, size_t size)
+{
+	uint32_t *word = (uint32_t *) header;
+
+	if (state->flags & PS_BUFFER_COMPACT)
+		*word = (uint32_t) (size << PS_COMPACT_SIZE_SHIFT) |
+			(*word & ((1 << PS_COMPACT_SIZE_SHIFT) - 1));
+	else
+		((struct ps_packet_header_s *) header)->size = size;
+}
+
+static inline ps_flags_t ps_header_getflags(struct ps_state_s *state, void *header)
+{
+	if (state->flags & PS_BUFFER_COMPACT)
+		return *(uint32_t *) header & ((1 << PS_COMPACT_SIZE_SHIFT) - 1);
+	return ((struct ps_packet_header_s *) header)->flags;
+}
+
+static inline void ps_header_addflags(struct ps_state_s *state, void *header, ps_flags_t flags)
+{
+	if (state->flags & PS_BUFFER_COMPACT)
+		*(uint32_t *) header |= flags;
+	else
+		((struct ps_packet_header_s *) header)->flags |= flags;
+}
+
+/* PS_BUFFER_COMPACT packets are all type 0 */
+static inline int ps_header_gettype(struct ps_state_s *state, void *header)
+{
+	if (state->flags & PS_BUFFER_COMPACT)
+		return 0;
+	return ((struct ps_packet_header_s *) header)->type;
+}
+
+static inline void ps_header_settype(struct ps_state_s *state, void *header, int type)
+{
+	if (!(state->flags & PS_BUFFER_COMPACT))
+		((struct ps_packet_header_s *) header)->type = type;
+}
+
 __inline__ static int ps_packet_check(ps_packet_t *packet);
 __inline__ static int ps_buffer_check(ps_buffer_t *buffer);
 
@@ -171,13 +530,148 @@ static int ps_packet_closewrite(ps_packet_t *packet);
 
 static int ps_packet_reserve(ps_packet_t *packet, size_t len);
 
+static int ps_packet_open_any(ps_packet_t *packet, ps_flags_t flags);
+static int ps_packet_close_any(ps_packet_t *packet);
+static int ps_packet_close_sampled(ps_packet_t *packet);
+static int ps_packet_openread_filter(ps_packet_t *packet, ps_flags_t flags);
+static int ps_packet_openread_spsc(ps_packet_t *packet, ps_flags_t flags);
+static int ps_packet_openread_group(ps_packet_t *packet, ps_flags_t flags);
+static int ps_packet_closeread_group(ps_packet_t *packet);
+static int ps_buffer_drain_group(ps_buffer_t *buffer);
+static int ps_packet_closeread_spsc(ps_packet_t *packet);
+static int ps_packet_closewrite_spsc(ps_packet_t *packet);
+static int ps_buffer_drain_spsc(ps_buffer_t *buffer);
+static void ps_buffer_free_first(ps_buffer_t *buffer);
+
+static int ps_packet_openread_mpmc(ps_packet_t *packet, ps_flags_t flags);
+static int ps_packet_setsize_mpmc(ps_packet_t *packet, size_t size);
+static int ps_packet_stage_mpmc(ps_packet_t *packet, void *src, void **mem, size_t size);
+static int ps_packet_closeread_mpmc(ps_packet_t *packet);
+static int ps_packet_closewrite_mpmc(ps_packet_t *packet);
+static int ps_buffer_drain_mpmc(ps_buffer_t *buffer);
+static int ps_packet_open_batch_mpmc(ps_packet_t *packets, size_t max, size_t *got, ps_flags_t flags);
+static void ps_buffer_publish_mpmc(ps_buffer_t *buffer);
+static void ps_buffer_release_mpmc(ps_buffer_t *buffer);
+static void ps_buffer_release_spsc(ps_buffer_t *buffer);
+
+static int ps_buffer_wait(ps_buffer_t *buffer, int *waiting, int *futex,
+			  size_t *cursor, size_t value);
+static void ps_buffer_repair(ps_buffer_t *buffer, pthread_mutex_t *mutex);
+
+static int ps_packet_open_robust(ps_packet_t *packet, ps_flags_t flags);
+static int ps_buffer_reap_peers(ps_buffer_t *buffer);
+static int ps_peer_attach(ps_buffer_t *buffer);
+static void ps_peer_detach(ps_buffer_t *buffer);
+static int ps_peer_claim(ps_packet_t *packet);
+static int ps_peer_dead(int pid);
+static void ps_buffer_wake(struct ps_state_s *state, int *waiting, int *futex);
+
 static int ps_packet_fakedma_alloc(ps_packet_t *packet, struct ps_fake_dma_s **fake_dma, size_t size);
 static int ps_packet_fakedma_free(ps_packet_t *packet, struct ps_fake_dma_s *fake_dma);
 static int ps_packet_fakedma_cut(ps_packet_t *packet, size_t size);
 static int ps_packet_fakedma_commitall(ps_packet_t *packet);
 static int ps_packet_fakedma_freeall(ps_packet_t *packet);
+static int ps_buffer_arena_init(ps_buffer_t *buffer, size_t align, size_t limit);
+static void ps_buffer_arena_destroy(ps_buffer_t *buffer);
+
+static int ps_buffer_map_mirror(ps_buffer_t *buffer, size_t size, size_t huge_size);
+static int ps_buffer_map_huge(ps_buffer_t *buffer, size_t size, size_t align,
+			      size_t huge_size, int *backing);
+static size_t ps_hugepage_size(void);
+static int ps_buffer_open_shmfd(ps_buffer_t *buffer, ps_bufferattr_t *attr,
+			       ps_flags_t *flags, size_t *size, size_t stats_size,
+			       size_t align, size_t huge_size, int *backing,
+			       size_t *data_offset);
+static int ps_buffer_alloc_data(ps_buffer_t *buffer, ps_flags_t flags, size_t size,
+			       size_t align, size_t huge_size, int *backing);
+static void ps_buffer_free_data(unsigned char *data, ps_flags_t flags, size_t size,
+				int backing);
+static int ps_buffer_map_shmfd_data(ps_buffer_t *buffer, int fd, size_t data_offset,
+				    size_t size, int mirror, size_t huge_size);
+static void ps_buffer_unmap_shmfd_data(unsigned char *data, size_t size, int mirror,
+				       int backing);
+static int ps_buffer_mbind_shmfd_data(unsigned char *data, size_t size, int mirror,
+				      int backing, int node);
+static int ps_buffer_remap(ps_buffer_t *buffer);
+static void ps_buffer_wait_resize(struct ps_state_s *state);
+static int ps_buffer_map_shmfd(ps_buffer_t *buffer, int fd, size_t data_offset,
+			       size_t size, int mirror, size_t huge_size);
+static int ps_buffer_mbind(void *addr, size_t len, int node);
+static int ps_buffer_numa_node(void *addr);
 
 static uint64_t ps_buffer_utime(ps_buffer_t *buffer);
+static void ps_histogram_add(ps_histogram_t *hist, uint64_t nsec);
+static int ps_buffer_lock_profiled(ps_buffer_t *buffer, pthread_mutex_t *mutex, int try);
+static void ps_buffer_unlock_profiled(ps_buffer_t *buffer, pthread_mutex_t *mutex);
+static void ps_buffer_occupancy_written(ps_buffer_t *buffer, size_t size);
+static void ps_buffer_occupancy_read(ps_buffer_t *buffer, size_t count);
+static void ps_histogram_summary(ps_histogram_t *hist, ps_latency_t *latency);
+static void ps_buffer_read_waited(ps_buffer_t *buffer, uint64_t start);
+static void ps_buffer_write_waited(ps_buffer_t *buffer, uint64_t start);
+
+/* stats and, with PS_BUFFER_LATENCY, histograms right after */
+static inline size_t ps_stats_occupancy_offset(ps_flags_t flags)
+{
+	if (flags & PS_BUFFER_LATENCY)
+		return sizeof(ps_stats_t) + sizeof(ps_histograms_t);
+	return sizeof(ps_stats_t);
+}
+
+/* then PS_BUFFER_OCCUPANCY samples */
+static inline size_t ps_stats_shards_offset(ps_flags_t flags)
+{
+	size_t size = ps_stats_occupancy_offset(flags);
+
+	if (flags & PS_BUFFER_OCCUPANCY)
+		size += sizeof(ps_occupancy_t);
+	return (size + PS_CACHELINE_SIZE - 1) & ~(PS_CACHELINE_SIZE - 1);
+}
+
+/* then counter shards, each on its own cache line */
+static inline size_t ps_stats_size(ps_flags_t flags)
+{
+	return ps_stats_shards_offset(flags) + PS_STATS_SHARDS * sizeof(struct ps_stats_shard_s);
+}
+
+/* threads take shards round robin, processes start at their pid */
+static inline struct ps_stats_shard_s *ps_stats_begin(ps_buffer_t *buffer)
+{
+	struct ps_stats_shard_s *shard;
+
+	if (unlikely(!ps_stats_shard_id))
+		ps_stats_shard_id = 1 + (getpid() + __atomic_fetch_add(&ps_stats_shard_next, 1,
+									__ATOMIC_RELAXED)) % PS_STATS_SHARDS;
+	shard = &__PS_STATS_SHARDS(buffer)[ps_stats_shard_id - 1];
+
+	__atomic_add_fetch(&shard->begin, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return shard;
+}
+
+static inline void ps_stats_end(struct ps_stats_shard_s *shard)
+{
+	__atomic_add_fetch(&shard->end, 1, __ATOMIC_RELEASE);
+}
+
+/* stamp is written before the packet is published, read after it is claimed */
+static inline void ps_header_stamp(ps_buffer_t *buffer, void *header)
+{
+	struct ps_state_s *state = (struct ps_state_s *) buffer->state;
+	uint64_t now = ps_buffer_utime(buffer);
+
+	memcpy((unsigned char *) header + state->header_size - sizeof(now), &now, sizeof(now));
+}
+
+static inline void ps_packet_residence(ps_packet_t *packet, uint64_t now)
+{
+	struct ps_state_s *state = (struct ps_state_s *) packet->buffer->state;
+	uint64_t stamp;
+
+	memcpy(&stamp, (unsigned char *) packet->header + state->header_size - sizeof(stamp),
+	       sizeof(stamp));
+	ps_histogram_add(&__PS_HISTOGRAMS(packet->buffer)->residence,
+			 now > stamp ? now - stamp : 0);
+}
 
 int ps_buffer_init(ps_buffer_t *buffer, ps_bufferattr_t *attr)
 {
@@ -186,73 +680,232 @@ int ps_buffer_init(ps_buffer_t *buffer, ps_bufferattr_t *attr)
 
 	struct ps_state_s *state;
 	size_t stats_size = 0;
-	int shared = 0;
+	size_t header_size = sizeof(struct ps_packet_header_s);
+	size_t size = attr->size;
+	size_t align = attr->align;
+	size_t data_offset = 0;
+	size_t huge_size = 0;
 	ps_flags_t flags = attr->flags;
 	int shmid = attr->shmid;
+	int backing = PS_BACKING_PAGES;
+	size_t heap_align = PS_CACHELINE_SIZE;
 	pthread_mutexattr_t mutexattr;
+	int ret;
 
 	if (unlikely(buffer == NULL))
 		return EINVAL;
 
+	if (flags & PS_BUFFER_MPMC) {
+		header_size = sizeof(struct ps_mpmc_header_s);
+		if (unlikely(attr->size < header_size * 3))
+			return EINVAL;
+		/* lock-free mode keeps headers aligned for atomic access */
+		if (align < sizeof(size_t))
+			align = sizeof(size_t);
+	}
+
+	if (flags & PS_BUFFER_COMPACT) {
+		header_size = sizeof(uint32_t);
+		if (unlikely(attr->size > PS_COMPACT_MAX_SIZE))
+			return EINVAL;
+	}
+
+	/* time stamp of write close takes the last 8 bytes of header */
+	if (flags & PS_BUFFER_LATENCY)
+		header_size += sizeof(uint64_t);
+
+#ifdef __PS_HUGEPAGES
+	if (attr->hugepages)
+		huge_size = ps_hugepage_size();
+#endif
+
+#ifdef __PS_MIRROR
+	/* both mappings of data area must start on a (huge) page boundary */
+	if (flags & PS_BUFFER_MIRROR) {
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		if (unlikely(align > page_size))
+			return EINVAL;
+		if (huge_size)
+			page_size = huge_size;
+		size = (size + page_size - 1) & ~(page_size - 1);
+	}
+#endif
+
+	/* positions stay aligned across wrap only if size is a multiple */
+	size &= ~(align - 1);
+	if (unlikely(size < header_size * 2 + align))
+		return EINVAL;
+
 	memset(buffer, 0, sizeof(ps_buffer_t));
+	buffer->shmfd = -1;
+	buffer->peer = -1;
 
 	pthread_mutexattr_init(&mutexattr);
+#ifdef __PS_ROBUST
+	/* next locker repairs state if owner dies, see ps_buffer_repair() */
+	if (flags & PS_BUFFER_ROBUST)
+		pthread_mutexattr_setrobust(&mutexattr, PTHREAD_MUTEX_ROBUST);
+#endif
+
+	if (unlikely((ret = ps_buffer_arena_init(buffer, align, attr->fake_dma_limit))))
+		goto err;
+
+	if (flags & PS_BUFFER_STATS) {
+		struct ps_stats_prev_s *prev;
+		if (unlikely(!(prev = calloc(1, sizeof(struct ps_stats_prev_s))))) {
+			ret = ENOMEM;
+			goto err;
+		}
+		pthread_mutex_init(&prev->lock, NULL);
+		buffer->stats_prev = prev;
+	}
 
 #ifdef __PS_SHM
 	if (flags & PS_BUFFER_PSHARED) {
-		shared = 1;
 		pthread_mutexattr_setpshared(&mutexattr, PTHREAD_PROCESS_SHARED);
 
 		if (flags & PS_BUFFER_STATS)
-			stats_size = sizeof(ps_stats_t);
-
-		if (attr->shmid == PS_SHM_CREATE)
-			shmid = shmget(IPC_PRIVATE, attr->size + sizeof(struct ps_state_s) +
-					stats_size, IPC_CREAT | IPC_EXCL | attr->shmmode);
-		else
-			flags |= PS_BUFFER_READY;
-
-		if (shmid == -1)
-			return errno;
+			stats_size = ps_stats_size(flags);
+
+#ifdef __PS_SHMFD
+		if (flags & PS_BUFFER_SHMFD) {
+			shmid = -1;
+			if (unlikely((ret = ps_buffer_open_shmfd(buffer, attr, &flags, &size,
+								 stats_size, align, huge_size,
+								 &backing, &data_offset))))
+				goto err;
+		} else {
+#endif
+			data_offset = (sizeof(struct ps_state_s) + stats_size + align - 1) & ~(align - 1);
+
+			if (attr->shmid == PS_SHM_CREATE) {
+				shmid = -1;
+#ifdef __PS_HUGEPAGES
+				/* segment size must be a multiple of huge page size */
+				if (huge_size &&
+				    ((shmid = shmget(IPC_PRIVATE,
+						     (attr->size + data_offset + huge_size - 1) & ~(huge_size - 1),
+						     IPC_CREAT | IPC_EXCL | SHM_HUGETLB | attr->shmmode)) != -1))
+					backing = PS_BACKING_HUGETLB;
+#endif
+				if (shmid == -1)
+					shmid = shmget(IPC_PRIVATE, attr->size + data_offset,
+						       IPC_CREAT | IPC_EXCL | attr->shmmode);
+			} else
+				flags |= PS_BUFFER_READY;
+
+			if (shmid == -1) {
+				ret = errno;
+				goto err;
+			}
 
-		buffer->state = shmat(shmid, NULL, 0);
+			buffer->state = shmat(shmid, NULL, 0);
 
-		if (buffer->state == (void *) (-1))
-			return errno;
+			if (buffer->state == (void *) (-1)) {
+				ret = errno;
+				buffer->state = NULL;
+				goto err;
+			}
 
-		buffer->buffer = &((unsigned char *) buffer->state)[sizeof(struct ps_state_s) + stats_size];
-		if (flags & PS_BUFFER_STATS)
-			buffer->stats = (ps_stats_t *) &((unsigned char *) buffer->state)[sizeof(struct ps_state_s)];
+			buffer->buffer = &((unsigned char *) buffer->state)[data_offset];
+			if (flags & PS_BUFFER_STATS)
+				buffer->stats = (ps_stats_t *) &((unsigned char *) buffer->state)[sizeof(struct ps_state_s)];
+#ifdef __PS_SHMFD
+		}
+#endif
 	} else {
 #endif
-		buffer->state = malloc(sizeof(struct ps_state_s));
-		buffer->buffer = malloc(attr->size);
-		if (flags & PS_BUFFER_STATS)
-			buffer->stats = (ps_stats_t *) malloc(sizeof(ps_stats_t));
+#ifdef __PS_NUMA
+		/* mbind() works on whole pages, don't share them with other heap objects */
+		if (attr->numa_node != PS_NUMA_DEFAULT)
+			heap_align = sysconf(_SC_PAGESIZE);
+#endif
+		if (unlikely(posix_memalign(&buffer->state, heap_align,
+					    (sizeof(struct ps_state_s) + heap_align - 1) & ~(heap_align - 1))))
+			buffer->state = NULL;
+		if (unlikely((ret = ps_buffer_alloc_data(buffer, flags, size, align,
+							 huge_size, &backing))))
+			goto err;
+		if ((flags & PS_BUFFER_STATS) &&
+		    unlikely(posix_memalign((void **) &buffer->stats, heap_align,
+					    (ps_stats_size(flags) + heap_align - 1) & ~(heap_align - 1))))
+			buffer->stats = NULL;
 #ifdef __PS_SHM
 	}
 #endif
 
-	if (unlikely((buffer->buffer == NULL) || (buffer->state == NULL)))
-		return ENOMEM;
-
-	if (unlikely((flags & PS_BUFFER_STATS) && (buffer->stats == NULL)))
-		return ENOMEM;
+	if (unlikely((buffer->buffer == NULL) || (buffer->state == NULL) ||
+		     ((flags & PS_BUFFER_STATS) && (buffer->stats == NULL)))) {
+		ret = ENOMEM;
+		goto err;
+	}
 
-	if (flags & PS_BUFFER_READY)
+	if (flags & PS_BUFFER_READY) {
+		if ((((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_ROBUST) &&
+		    unlikely((ret = ps_peer_attach(buffer))))
+			goto err;
+		pthread_mutexattr_destroy(&mutexattr);
 		return 0;
+	}
+
+#ifdef __PS_NUMA
+	/* place pages before they are first touched below */
+	if (attr->numa_node != PS_NUMA_DEFAULT) {
+#ifdef __PS_SHM
+		if (flags & PS_BUFFER_PSHARED) {
+#ifdef __PS_SHMFD
+			/* state and data area are mapped apart */
+			if (flags & PS_BUFFER_SHMFD) {
+				if (!(ret = ps_buffer_mbind(buffer->state, data_offset, attr->numa_node)))
+					ret = ps_buffer_mbind_shmfd_data(buffer->buffer, size,
+									 flags & PS_BUFFER_MIRROR,
+									 backing, attr->numa_node);
+			} else
+#endif
+			ret = ps_buffer_mbind(buffer->state, data_offset + size, attr->numa_node);
+		} else
+#endif
+		if (!(ret = ps_buffer_mbind(buffer->state, sizeof(struct ps_state_s), attr->numa_node)) &&
+		    !(ret = ps_buffer_mbind(buffer->buffer, size, attr->numa_node)) &&
+		    (flags & PS_BUFFER_STATS))
+			ret = ps_buffer_mbind(buffer->stats, ps_stats_size(flags), attr->numa_node);
+		if (unlikely(ret))
+			goto err;
+	}
+#endif
 
-	memset(buffer->buffer, 0, attr->size);
+	memset(buffer->buffer, 0, size);
 	memset(buffer->state, 0, sizeof(struct ps_state_s));
 	if (flags & PS_BUFFER_STATS)
-		memset(buffer->stats, 0, sizeof(ps_stats_t));
+		memset(buffer->stats, 0, ps_stats_size(flags));
 
 	state = (struct ps_state_s *) buffer->state;
 
-	state->size = attr->size;
+	state->size = size;
+	state->header_size = header_size;
+	state->align = align;
+	state->backing = backing;
+#ifdef __PS_NUMA
+	state->numa_node = ps_buffer_numa_node(buffer->buffer);
+#else
+	state->numa_node = -1;
+#endif
+	state->numa_request = attr->numa_node;
+	state->data_offset = data_offset;
 	state->flags = flags;
-	state->free_bytes = attr->size - sizeof(struct ps_packet_header_s);
+
+	/* header sits right before payload, so it starts header_size before
+	   an align boundary. Bytes in front of first_pos are only used as
+	   wrap padding */
+	state->first_pos = (align - header_size % align) % align;
+	state->read_pos = state->read_next = state->read_first = state->first_pos;
+	state->write_pos = state->write_next = state->first_pos;
+	state->write_pos_cache = state->first_pos;
+	state->free_bytes = state->size - header_size - state->first_pos;
+	state->groups = attr->groups;
+	state->sample_interval = attr->sample_interval;
 	buffer->shmid = shmid;
+	buffer->size = size;
 
 	/* TODO should we check for errors? */
 	pthread_mutex_init(&state->read_mutex, &mutexattr);
@@ -261,8 +914,14 @@ int ps_buffer_init(ps_buffer_t *buffer, ps_bufferattr_t *attr)
 	pthread_mutex_init(&state->read_close_mutex, &mutexattr);
 	pthread_mutex_init(&state->write_close_mutex, &mutexattr);
 
-	sem_init(&state->read_packets, shared, 0);
-	sem_init(&state->written_packets, shared, 0);
+	if (flags & PS_BUFFER_BROADCAST) {
+		int i;
+		for (i = 0; i < state->groups; i++) {
+			state->group[i].read_pos = state->group[i].read_next = state->first_pos;
+			state->group[i].write_pos_cache = state->first_pos;
+			pthread_mutex_init(&state->group[i].read_mutex, &mutexattr);
+		}
+	}
 
 	pthread_mutexattr_destroy(&mutexattr);
 
@@ -270,7 +929,52 @@ int ps_buffer_init(ps_buffer_t *buffer, ps_bufferattr_t *attr)
 
 	state->flags |= PS_BUFFER_READY;
 
+	if (flags & PS_BUFFER_ROBUST)
+		return ps_peer_attach(buffer);
+
 	return 0;
+
+err:
+	/* give back whatever was set up, in reverse */
+#ifdef __PS_SHM
+	if (flags & PS_BUFFER_PSHARED) {
+#ifdef __PS_SHMFD
+		if (buffer->shmfd != -1) {
+			ps_buffer_unmap_shmfd_data(buffer->buffer, size, flags & PS_BUFFER_MIRROR,
+						   backing);
+			munmap(buffer->state, data_offset);
+			close(buffer->shmfd);
+			if (buffer->shmname) {
+				shm_unlink(buffer->shmname);
+				free(buffer->shmname);
+			}
+		} else
+#endif
+		{
+			if (buffer->state)
+				shmdt(buffer->state);
+			/* only remove a segment created here */
+			if ((attr->shmid == PS_SHM_CREATE) && (shmid != -1))
+				shmctl(shmid, IPC_RMID, 0);
+		}
+	} else {
+#endif
+		free(buffer->stats);
+		if (buffer->buffer)
+			ps_buffer_free_data(buffer->buffer, flags, size, backing);
+		free(buffer->state);
+#ifdef __PS_SHM
+	}
+#endif
+	if (buffer->stats_prev) {
+		pthread_mutex_destroy(&((struct ps_stats_prev_s *) buffer->stats_prev)->lock);
+		free(buffer->stats_prev);
+	}
+	if (buffer->fake_dma)
+		ps_buffer_arena_destroy(buffer);
+	pthread_mutexattr_destroy(&mutexattr);
+	memset(buffer, 0, sizeof(ps_buffer_t));
+	return ret;
 }
 
 int ps_buffer_destroy(ps_buffer_t *buffer)
@@ -281,890 +985,4273 @@ int ps_buffer_destroy(ps_buffer_t *buffer)
 	        and free stuff only if there is 0 active
 	        progs/threads using this buffer */
 
+	if (buffer->peer >= 0)
+		ps_peer_detach(buffer);
+
+	ps_buffer_arena_destroy(buffer);
+
+	if (buffer->stats_prev) {
+		pthread_mutex_destroy(&((struct ps_stats_prev_s *) buffer->stats_prev)->lock);
+		free(buffer->stats_prev);
+		buffer->stats_prev = NULL;
+	}
+
 	pthread_mutex_destroy(&state->read_mutex);
 	pthread_mutex_destroy(&state->write_mutex);
 
 	pthread_mutex_destroy(&state->read_close_mutex);
 	pthread_mutex_destroy(&state->write_close_mutex);
 
-	sem_destroy(&state->read_packets);
-	sem_destroy(&state->written_packets);
+	if (state->flags & PS_BUFFER_BROADCAST) {
+		int i;
+		for (i = 0; i < state->groups; i++)
+			pthread_mutex_destroy(&state->group[i].read_mutex);
+	}
 
+#ifdef __PS_SHMFD
+	if (state->flags & PS_BUFFER_SHMFD) {
+		ps_buffer_unmap_shmfd_data(buffer->buffer, buffer->size,
+					   state->flags & PS_BUFFER_MIRROR, state->backing);
+		munmap(buffer->state, state->data_offset);
+		close(buffer->shmfd);
+		/* only creator owns the name */
+		if (buffer->shmname) {
+			shm_unlink(buffer->shmname);
+			free(buffer->shmname);
+		}
+	} else
+#endif
 	if (state->flags & PS_BUFFER_PSHARED) {
 		shmdt(buffer->state);
 		shmctl(buffer->shmid, IPC_RMID, 0);
 	} else {
 		if (state->flags & PS_BUFFER_STATS)
 			free(buffer->stats);
-		free(buffer->buffer);
+		ps_buffer_free_data(buffer->buffer, state->flags, state->size, state->backing);
 		free(state);
 	}
 
 	return 0;
 }
 
-static inline int move_pos(size_t pos, size_t buf_size, size_t packet_size)
+/* allocate private data area, backing is left alone on regular pages */
+int ps_buffer_alloc_data(ps_buffer_t *buffer, ps_flags_t flags, size_t size,
+			 size_t align, size_t huge_size, int *backing)
 {
-	pos = (sizeof(struct ps_packet_header_s) +
-			    pos + packet_size) % buf_size;
-	if (unlikely(pos + sizeof(struct ps_packet_header_s) > buf_size))
-		pos = 0;
-	return pos;
+#ifdef __PS_MIRROR
+	if (flags & PS_BUFFER_MIRROR) {
+		int ret = EINVAL;
+#ifdef __PS_HUGEPAGES
+		if (huge_size && !(ret = ps_buffer_map_mirror(buffer, size, huge_size)))
+			*backing = PS_BACKING_HUGETLB;
+#endif
+		if (ret)
+			ret = ps_buffer_map_mirror(buffer, size, 0);
+		return ret;
+	}
+#endif
+#ifdef __PS_HUGEPAGES
+	if (huge_size)
+		return ps_buffer_map_huge(buffer, size, align, huge_size, backing);
+#endif
+	if (unlikely(posix_memalign((void **) &buffer->buffer,
+				    align > PS_CACHELINE_SIZE ? align : PS_CACHELINE_SIZE,
+				    size)))
+		return ENOMEM;
+	return 0;
 }
 
-int ps_buffer_state_text(ps_buffer_t *buffer, FILE *stream)
+void ps_buffer_free_data(unsigned char *data, ps_flags_t flags, size_t size, int backing)
 {
-	size_t pos;
-	int num_pkts, i;
-	int num_bytes;
-	struct ps_packet_header_s *header;
-	__PS_BUFFER_VARS(buffer)
-	if (!buffer || !stream)
-		return EINVAL;
+#ifdef __PS_MIRROR
+	if (flags & PS_BUFFER_MIRROR)
+		munmap(data, size * 2);
+	else
+#endif
+#ifdef __PS_HUGEPAGES
+	if (backing == PS_BACKING_HUGETLB) {
+		size_t huge_size = ps_hugepage_size();
+		munmap(data, (size + huge_size - 1) & ~(huge_size - 1));
+	} else
+#endif
+		free(data);
+}
 
-	fprintf(stream, "size: %zd, read_pos: %zd, write_pos: %zd\n"
-			"read_next: %zd, write_next: %zd, read_first: %zd\n"
-			"free_bytes: %ld\n",
-		state->size, state->read_pos, state->write_pos,
-		state->read_next, state->write_next, state->read_first,
-		state->free_bytes);
+#ifdef __PS_MIRROR
+/*
+ * Map the same pages twice back-to-back, so any range starting inside
+ * data area and no longer than its size is contiguous in memory. With
+ * huge_size, pages come from hugetlbfs and size must be a multiple of it.
+ */
+int ps_buffer_map_mirror(ps_buffer_t *buffer, size_t size, size_t huge_size)
+{
+	unsigned char *area, *base;
+	int fd, ret = 0;
 
-	sem_getvalue(&state->written_packets, &num_pkts);
-	pos = state->read_next;
-	num_bytes = 0;
-	for (i = 0; i < num_pkts; ++i) {
-		header = (struct ps_packet_header_s *)&buffer->buffer[pos];
-		num_bytes += header->size;
-		pos = move_pos(pos, state->size, header->size);
+	if (unlikely((fd = memfd_create("packetstream", MFD_CLOEXEC |
+					(huge_size ? MFD_HUGETLB : 0))) == -1))
+		return errno;
+
+	if (unlikely(ftruncate(fd, size))) {
+		ret = errno;
+		goto out;
 	}
-	fprintf(stream, "unread packets: %d, num_bytes: %d\n",
-		num_pkts, num_bytes);
 
-	sem_getvalue(&state->read_packets, &num_pkts);
-	pos = state->read_first;
-	num_bytes = 0;
-	for (i = 0; i < num_pkts; ++i) {
-		header = (struct ps_packet_header_s *)&buffer->buffer[pos];
-		num_bytes += header->size;
-		pos = move_pos(pos, state->size, header->size);
+	/* reserve address space for both views, huge page aligned if needed */
+	area = mmap(NULL, size * 2 + huge_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (unlikely(area == MAP_FAILED)) {
+		ret = errno;
+		goto out;
+	}
+	if (huge_size) {
+		base = (unsigned char *) (((uintptr_t) area + huge_size - 1) & ~(huge_size - 1));
+		if (base != area)
+			munmap(area, base - area);
+		munmap(base + size * 2, area + huge_size - base);
+		area = base;
 	}
-	fprintf(stream, "pending free packets: %d, num_bytes: %d\n",
-		num_pkts, num_bytes);
 
-	return 0;
+	if (unlikely((mmap(area, size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) ||
+		     (mmap(area + size, size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))) {
+		ret = errno;
+		munmap(area, size * 2);
+		goto out;
+	}
+
+	buffer->buffer = area;
+out:
+	close(fd);
+	return ret;
 }
+#endif
 
-int ps_buffer_drain(ps_buffer_t *buffer)
+#ifdef __PS_SHMFD
+/*
+ * Create or attach to a shared buffer living in a memfd, a named POSIX
+ * shm object or a file descriptor received from another process. Layout
+ * is state, stats and data area at data_offset, which is page aligned so
+ * data area can be mapped a second time for PS_BUFFER_MIRROR.
+ */
+int ps_buffer_open_shmfd(ps_buffer_t *buffer, ps_bufferattr_t *attr,
+			 ps_flags_t *flags, size_t *size, size_t stats_size,
+			 size_t align, size_t huge_size, int *backing,
+			 size_t *data_offset)
 {
-	int res = 0;
-	__PS_BUFFER_VARS(buffer)
-	struct ps_packet_header_s *header;
-
-	if (pthread_mutex_lock(&state->read_mutex))
-		return -EINVAL;
+	struct ps_state_s *peek;
+	size_t unit, len;
+	int fd, ret;
 
-	if (pthread_mutex_lock(&state->read_close_mutex)) {
-		res = -EINVAL;
-		goto err;
+	if (attr->shmfd != -1) {
+		if (unlikely((fd = fcntl(attr->shmfd, F_DUPFD_CLOEXEC, 0)) == -1))
+			return errno;
+		goto attach;
 	}
 
-	while (!sem_trywait(&state->written_packets)) {
-		size_t pos = state->read_next;
-		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
-		header->flags |= PS_PACKET_HEADER_READ;
-		state->read_next = move_pos(state->read_next, state->size, header->size);
-		if (state->read_pos == pos) {
-			if (unlikely(sem_post(&state->read_packets)))
-				abort();
-			state->read_pos = state->read_next;
-			++res;
+	if (attr->shmname) {
+		fd = shm_open(attr->shmname, O_RDWR | O_CREAT | O_EXCL, attr->shmmode);
+		if ((fd == -1) && (errno == EEXIST)) {
+			if (unlikely((fd = shm_open(attr->shmname, O_RDWR, 0)) == -1))
+				return errno;
+			goto attach;
 		}
+		if (unlikely(fd == -1))
+			return errno;
+		if (unlikely(!(buffer->shmname = strdup(attr->shmname)))) {
+			ret = ENOMEM;
+			goto err;
+		}
+	} else {
+		fd = -1;
+		if (huge_size &&
+		    ((fd = memfd_create("packetstream", MFD_CLOEXEC | MFD_HUGETLB)) != -1))
+			*backing = PS_BACKING_HUGETLB;
+		if ((fd == -1) &&
+		    unlikely((fd = memfd_create("packetstream", MFD_CLOEXEC)) == -1))
+			return errno;
 	}
-	pthread_mutex_unlock(&state->read_close_mutex);
-err:
-	pthread_mutex_unlock(&state->read_mutex);
 
-	return res;
-}
+create:
+	unit = (*backing == PS_BACKING_HUGETLB) ? huge_size : (size_t) sysconf(_SC_PAGESIZE);
+	if (unit < align)
+		unit = align;
+	*data_offset = (sizeof(struct ps_state_s) + stats_size + unit - 1) & ~(unit - 1);
+	len = (*data_offset + *size + unit - 1) & ~(unit - 1);
 
-int ps_packet_init(ps_packet_t *packet, ps_buffer_t *buffer)
-{
-	__PS_BUFFER_CHECK(buffer)
-	packet->buffer = buffer;
-	packet->fake_dma = NULL;
+	if (unlikely(ftruncate(fd, len))) {
+		ret = errno;
+		goto err;
+	}
+
+	ret = ps_buffer_map_shmfd(buffer, fd, *data_offset, *size, *flags & PS_BUFFER_MIRROR,
+				  (*backing == PS_BACKING_HUGETLB) ? huge_size : 0);
+	if (ret && (*backing == PS_BACKING_HUGETLB)) {
+		/* hugetlbfs pages are reserved at mmap() time */
+		close(fd);
+		*backing = PS_BACKING_PAGES;
+		if (unlikely((fd = memfd_create("packetstream", MFD_CLOEXEC)) == -1))
+			return errno;
+		goto create;
+	}
+	if (unlikely(ret))
+		goto err;
+
+	if (huge_size && (*backing == PS_BACKING_PAGES) &&
+	    !madvise(buffer->buffer, *size, MADV_HUGEPAGE))
+		*backing = PS_BACKING_THP;
+	goto out;
+
+attach:
+	/* learn layout from creator's state */
+	peek = mmap(NULL, sizeof(struct ps_state_s), PROT_READ, MAP_SHARED, fd, 0);
+	if (unlikely(peek == MAP_FAILED)) {
+		ret = errno;
+		goto err;
+	}
+	if (__PS_LOAD_ACQUIRE(&peek->flags) & PS_BUFFER_READY) {
+		/* a resize racing with us is caught by the generation check */
+		buffer->generation = __PS_LOAD_ACQUIRE(&peek->generation);
+		*flags = peek->flags;
+		*size = peek->size;
+		*data_offset = peek->data_offset;
+		*backing = peek->backing;
+		ret = 0;
+	} else
+		ret = EAGAIN; /* creator is not done yet */
+	munmap(peek, sizeof(struct ps_state_s));
+	if (unlikely(ret))
+		goto err;
+
+	if (unlikely((ret = ps_buffer_map_shmfd(buffer, fd, *data_offset, *size,
+						*flags & PS_BUFFER_MIRROR,
+						(*backing == PS_BACKING_HUGETLB) ?
+						ps_hugepage_size() : 0))))
+		goto err;
+
+out:
+	if (*flags & PS_BUFFER_STATS)
+		buffer->stats = (ps_stats_t *) &((unsigned char *) buffer->state)[sizeof(struct ps_state_s)];
+	buffer->shmfd = fd;
 	return 0;
+err:
+	if (buffer->shmname) {
+		shm_unlink(buffer->shmname);
+		free(buffer->shmname);
+		buffer->shmname = NULL;
+	}
+	close(fd);
+	return ret;
 }
 
-int ps_packet_destroy(ps_packet_t *packet)
+/* map state, stats and data area, and data area again right after it with mirror */
+int ps_buffer_map_shmfd(ps_buffer_t *buffer, int fd, size_t data_offset,
+			size_t size, int mirror, size_t huge_size)
 {
-	struct ps_fake_dma_s *fake_dma, *del;
+	int ret;
 
-	fake_dma = (struct ps_fake_dma_s *) packet->fake_dma;
-	while (fake_dma != NULL) {
-		del = fake_dma;
-		fake_dma = (struct ps_fake_dma_s *) fake_dma->next;
-		if (del->mem)
-			free(del->mem);
-		free(del);
+	/* state and data area are mapped apart, so data area alone can be
+	   mapped again after ps_buffer_resize() */
+	buffer->state = mmap(NULL, data_offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (unlikely(buffer->state == MAP_FAILED)) {
+		buffer->state = NULL;
+		return errno;
 	}
-	packet->fake_dma = NULL;
-	packet->buffer   = NULL;
-	return 0;
+
+	if (unlikely((ret = ps_buffer_map_shmfd_data(buffer, fd, data_offset, size,
+						     mirror, huge_size)))) {
+		munmap(buffer->state, data_offset);
+		buffer->state = NULL;
+	}
+	return ret;
 }
 
-int ps_buffer_stats(ps_buffer_t *buffer, ps_stats_t *stats)
+/* map data area, twice back-to-back with mirror */
+int ps_buffer_map_shmfd_data(ps_buffer_t *buffer, int fd, size_t data_offset,
+			     size_t size, int mirror, size_t huge_size)
 {
-	__PS_BUFFER_VARS(buffer)
+	size_t len = size * (mirror ? 2 : 1);
+	unsigned char *area, *base;
+	int ret;
 
-	if (unlikely(!(state->flags & PS_BUFFER_STATS)))
-		return ENOTSUP;
+	if (huge_size)
+		len = (len + huge_size - 1) & ~(huge_size - 1);
+
+	area = mmap(NULL, len + huge_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (unlikely(area == MAP_FAILED))
+		return errno;
+	base = area;
+	if (huge_size) {
+		base = (unsigned char *) (((uintptr_t) area + huge_size - 1) & ~(huge_size - 1));
+		if (base != area)
+			munmap(area, base - area);
+		munmap(base + len, area + huge_size - base);
+	}
 
-	memcpy(stats, buffer->stats, sizeof(ps_stats_t));
-	stats->utime = ps_buffer_utime(buffer);
+	if (unlikely((mmap(base, mirror ? size : len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_FIXED, fd, data_offset) == MAP_FAILED) ||
+		     (mirror && (mmap(base + size, size, PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_FIXED, fd, data_offset) == MAP_FAILED)))) {
+		ret = errno;
+		munmap(base, len);
+		return ret;
+	}
 
+	buffer->buffer = base;
+	buffer->size = size;
 	return 0;
 }
 
-int ps_packet_open(ps_packet_t *packet, ps_flags_t flags)
+void ps_buffer_unmap_shmfd_data(unsigned char *data, size_t size, int mirror, int backing)
 {
-	__PS_BUFFER_CHECK(packet->buffer)
+	size_t len = size * (mirror ? 2 : 1);
 
-	if (unlikely(!(flags & PS_PACKET_READ || flags & PS_PACKET_WRITE)))
-		return EINVAL;
-
-	if (flags & PS_PACKET_READ)
-		return ps_packet_openread(packet, flags);
-	else
-		return ps_packet_openwrite(packet, flags);
+	if (backing == PS_BACKING_HUGETLB) {
+		size_t huge_size = ps_hugepage_size();
+		len = (len + huge_size - 1) & ~(huge_size - 1);
+	}
+	munmap(data, len);
 }
 
-#define MAX_SEM_WAIT_TRIES 6
-
-int ps_packet_openread(ps_packet_t *packet, ps_flags_t flags)
+#ifdef __PS_NUMA
+/* ps_buffer_mbind() whole data area mapping, both views with mirror */
+int ps_buffer_mbind_shmfd_data(unsigned char *data, size_t size, int mirror, int backing,
+			       int node)
 {
-	__PS_BUFFER_VARS(packet->buffer)
-	ps_buffer_t *buffer = packet->buffer;
-	struct ps_packet_header_s *header;
-	unsigned int tries = 0;
+	size_t len = size * (mirror ? 2 : 1);
 
-	if (flags & PS_PACKET_TRY) {
-		if (unlikely(pthread_mutex_trylock(&state->read_mutex)))
-			return EBUSY;
-	} else if (unlikely(pthread_mutex_lock(&state->read_mutex)))
-		return EINVAL;
-	__PS_CHECK_CANCEL_READ(state)
+	if (backing == PS_BACKING_HUGETLB) {
+		size_t huge_size = ps_hugepage_size();
+		len = (len + huge_size - 1) & ~(huge_size - 1);
+	}
+	return ps_buffer_mbind(data, len, node);
+}
+#endif
+#endif
 
-	if (state->flags & PS_BUFFER_STATS)
-		buffer->read_wait_start = ps_buffer_utime(buffer);
+#ifdef __PS_HUGEPAGES
+/* default huge page size, 2 MiB if /proc/meminfo can't tell */
+size_t ps_hugepage_size(void)
+{
+	FILE *meminfo;
+	char line[128];
+	size_t kb, size = 2 * 1024 * 1024;
 
-	if (flags & PS_PACKET_TRY) {
-		if (sem_trywait(&state->written_packets)) {
-			pthread_mutex_unlock(&state->read_mutex);
-			return EBUSY;
-		}
-	} else {
-retry:
-		tries++;
-		if (sem_wait(&state->written_packets)) {
-			if (tries < MAX_SEM_WAIT_TRIES)
-				goto retry;
-			else {
-				pthread_mutex_unlock(&state->read_mutex);
-				return EINVAL;
-			}
+	if (!(meminfo = fopen("/proc/meminfo", "r")))
+		return size;
+
+	while (fgets(line, sizeof(line), meminfo)) {
+		if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1) {
+			size = kb * 1024;
+			break;
 		}
 	}
-	__PS_CHECK_CANCEL_READ(state)
+	fclose(meminfo);
 
-	if (state->flags & PS_BUFFER_STATS)
-		buffer->stats->read_wait_nsec += ps_buffer_utime(buffer) - buffer->read_wait_start;
+	return size;
+}
 
-	packet->flags = flags & ~PS_PACKET_TRY;
-	packet->buffer_pos = state->read_next;
-	packet->header = &buffer->buffer[packet->buffer_pos];
-	packet->pos = 0;
+#ifdef __PS_NUMA
+/* 1024 nodes, like the kernel default MAX_NUMNODES of large configs */
+#define PS_NUMA_MASK_LONGS (1024 / (8 * sizeof(unsigned long)))
 
-	header = (struct ps_packet_header_s *) packet->header;
-	state->read_next = move_pos(state->read_next, state->size, header->size);
+/*
+ * Prefer node for pages covering addr..addr+len, or spread them over
+ * every node with PS_NUMA_INTERLEAVE. Pages already touched are moved.
+ */
+int ps_buffer_mbind(void *addr, size_t len, int node)
+{
+	unsigned long nodemask[PS_NUMA_MASK_LONGS];
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) addr & ~(page_size - 1);
+	int mode = MPOL_PREFERRED;
+
+	len = ((uintptr_t) addr + len - start + page_size - 1) & ~(page_size - 1);
+
+	if (node == PS_NUMA_INTERLEAVE) {
+		/* kernel restricts the mask to nodes allowed to this task */
+		memset(nodemask, 0xff, sizeof(nodemask));
+		mode = MPOL_INTERLEAVE;
+	} else {
+		memset(nodemask, 0, sizeof(nodemask));
+		nodemask[node / (8 * sizeof(unsigned long))] |=
+			1UL << (node % (8 * sizeof(unsigned long)));
+	}
 
-	pthread_mutex_unlock(&state->read_mutex);
+	if (syscall(SYS_mbind, start, len, mode, nodemask,
+		    sizeof(nodemask) * 8 + 1, MPOL_MF_MOVE))
+		return errno;
 
 	return 0;
 }
 
-int ps_packet_openwrite(ps_packet_t *packet, ps_flags_t flags)
+/* node holding the page at addr, -1 if it can't be told */
+int ps_buffer_numa_node(void *addr)
 {
-	__PS_BUFFER_VARS(packet->buffer)
-	ps_buffer_t *buffer = packet->buffer;
-	struct ps_packet_header_s *header;
+	int node = -1;
 
-	if (flags & PS_PACKET_TRY) {
-		if (pthread_mutex_trylock(&state->write_mutex))
-			return EBUSY;
-	} else if (unlikely(pthread_mutex_lock(&state->write_mutex)))
-		return EINVAL;
-	__PS_CHECK_CANCEL_WRITE(state)
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR))
+		return -1;
 
-	/* next header is already free, NULL & reserved */
-	packet->reserved = 0;
+	return node;
+}
+#endif
 
-	packet->flags = flags;
-	packet->buffer_pos = state->write_next;
-	packet->header = &buffer->buffer[packet->buffer_pos];
-	packet->pos = 0;
+/*
+ * Private data area on hugetlbfs pages, or on transparent huge pages
+ * when none is reserved, or on regular pages if THP is disabled.
+ */
+int ps_buffer_map_huge(ps_buffer_t *buffer, size_t size, size_t align,
+		       size_t huge_size, int *backing)
+{
+	size_t map_size = (size + huge_size - 1) & ~(huge_size - 1);
+	void *area;
+
+	if (align <= huge_size) {
+		area = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (area != MAP_FAILED) {
+			buffer->buffer = area;
+			*backing = PS_BACKING_HUGETLB;
+			return 0;
+		}
+	}
 
-	header = (struct ps_packet_header_s *) packet->header;
-	header->flags = 0;
-	header->size = 0;
+	if (unlikely(posix_memalign(&area, align > huge_size ? align : huge_size, map_size)))
+		return ENOMEM;
+	if (!madvise(area, map_size, MADV_HUGEPAGE))
+		*backing = PS_BACKING_THP;
+	buffer->buffer = area;
 
 	return 0;
 }
+#endif
 
-int ps_packet_setsize(ps_packet_t *packet, size_t size)
+/* round pos up so that a header at pos is followed by an aligned payload */
+static inline size_t align_pos(struct ps_state_s *state, size_t pos)
 {
-	int ret;
-	size_t res = 0;
-	size_t write_next;
-	__PS_PACKET(packet)
+	return ((pos + state->header_size + state->align - 1) & ~(state->align - 1)) -
+		state->header_size;
+}
 
-	if (unlikely((!(packet->flags & PS_PACKET_WRITE)) || (packet->flags & PS_PACKET_SIZE_SET)))
-		return EINVAL;
+static inline size_t move_pos(struct ps_state_s *state, size_t pos, size_t packet_size)
+{
+	pos = align_pos(state, state->header_size + pos + packet_size) % state->size;
+	if (unlikely(pos + state->header_size > state->size))
+		pos = state->first_pos;
+	return pos;
+}
 
-	if (unlikely(size + sizeof(struct ps_packet_header_s) * 2 > state->size))
-		return ENOBUFS;
+/* move_pos() for PS_BUFFER_MPMC virtual positions */
+static inline size_t move_vpos(struct ps_state_s *state, size_t pos, size_t packet_size)
+{
+	size_t offs;
 
-	if ((ret = ps_packet_reserve(packet, size)))
-		return ret;
+	pos = align_pos(state, pos + state->header_size + packet_size);
+	offs = pos % state->size;
+	if (unlikely(offs + state->header_size > state->size))
+		pos += state->size - offs + state->first_pos;
+	return pos;
+}
 
-	write_next = (sizeof(struct ps_packet_header_s) + state->write_next + size) % state->size;
-	if (write_next + sizeof(struct ps_packet_header_s) > state->size) {
-		res = state->size - write_next;
-		write_next = 0;
-	}
+/*
+ * Tell if there is an unread packet at read_next. write_pos is only
+ * loaded when the consumer copy says buffer is empty (classic and SPSC).
+ */
+static inline int ps_buffer_readable(struct ps_state_s *state)
+{
+	if (state->write_pos_cache == state->read_next)
+		state->write_pos_cache = __PS_LOAD_ACQUIRE(&state->write_pos);
+	return state->write_pos_cache != state->read_next;
+}
 
-	/* we must set next header NULL */
-	packet->flags &= ~PS_PACKET_TRY;
-	if ((ret = ps_packet_reserve(packet, sizeof(struct ps_packet_header_s) + size + res)))
-		return ret;
+/* futexes in PS_BUFFER_PSHARED buffers must be visible to other processes */
+static inline long ps_buffer_futex(struct ps_state_s *state, int *futex, int op, int val,
+				   const struct timespec *timeout)
+{
+	if (!(state->flags & PS_BUFFER_PSHARED))
+		op |= FUTEX_PRIVATE_FLAG;
+	return syscall(SYS_futex, futex, op, val, timeout, NULL, 0);
+}
 
-	/*
-	 * free unused reserved bytes.
-	 */
-	state->free_bytes += packet->reserved - (size + sizeof(struct ps_packet_header_s) + res);
-	header->size = size;
-	packet->flags |= PS_PACKET_SIZE_SET;
-	state->write_next = write_next;
+/* lock a state mutex, repairing state if its owner died while holding it */
+static inline int ps_buffer_lock(ps_buffer_t *buffer, pthread_mutex_t *mutex, int try)
+{
+	int ret;
 
-	memset(&buffer->buffer[state->write_next], 0, sizeof(struct ps_packet_header_s));
+	if (unlikely(((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_LOCKSTATS))
+		return ps_buffer_lock_profiled(buffer, mutex, try);
 
-	pthread_mutex_unlock(&state->write_mutex);
+	ret = try ? pthread_mutex_trylock(mutex) : pthread_mutex_lock(mutex);
 
-	/* cut fakedma */
-	return ps_packet_fakedma_cut(packet, size);
+#ifdef __PS_ROBUST
+	if (unlikely(ret == EOWNERDEAD)) {
+		ps_buffer_repair(buffer, mutex);
+		pthread_mutex_consistent(mutex);
+		ret = 0;
+	}
+#endif
+	return ret;
 }
 
-int ps_packet_close(ps_packet_t *packet)
+static inline void ps_buffer_unlock(ps_buffer_t *buffer, pthread_mutex_t *mutex)
 {
-	__PS_PACKET_CHECK(packet)
-
-	packet->flags &= ~PS_PACKET_TRY; /* too late to cancel */
-
-	if (packet->flags & PS_PACKET_READ)
-		return ps_packet_closeread(packet);
+	if (unlikely(((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_LOCKSTATS))
+		ps_buffer_unlock_profiled(buffer, mutex);
 	else
-		return ps_packet_closewrite(packet);
+		pthread_mutex_unlock(mutex);
 }
 
-int ps_packet_cancel(ps_packet_t *packet)
+/* map data area again if another process has resized it */
+static inline int ps_buffer_current(ps_buffer_t *buffer)
 {
-	__PS_PACKET(packet)
+	if (likely(__PS_LOAD_ACQUIRE(&buffer->generation) ==
+		   ((struct ps_state_s *) buffer->state)->generation))
+		return 0;
+	return ps_buffer_remap(buffer);
+}
 
-	if (unlikely(!(packet->flags & PS_PACKET_WRITE)))
-		return EINVAL;
-	if (unlikely(packet->flags & PS_PACKET_SIZE_SET))
-		return EINVAL;
+/* publish what the packet tracked by entry is doing */
+static inline void ps_peer_set(struct ps_state_s *state, int entry, size_t pos, int kind)
+{
+	ps_peer_entry(state, entry)->pos = pos;
+	__PS_STORE_RELEASE(&ps_peer_entry(state, entry)->kind, kind);
+}
 
-	state->free_bytes += packet->reserved; /* correct? */
-	memset(header, 0, sizeof(struct ps_packet_header_s));
-	pthread_mutex_unlock(&state->write_mutex);
+static inline void ps_peer_untrack(ps_packet_t *packet)
+{
+	__PS_STORE_RELEASE(&ps_peer_entry((struct ps_state_s *) packet->buffer->state,
+					  packet->peer_entry)->kind, PS_PEER_FREE);
+	packet->peer_entry = -1;
+}
 
-	ps_packet_fakedma_freeall(packet);
+/* count packets and their bytes from pos up to end */
+static int ps_buffer_count(ps_buffer_t *buffer, size_t pos, size_t end, int *num_bytes)
+{
+	struct ps_packet_header_s *header;
+	int num_pkts = 0;
+	__PS_BUFFER_VARS(buffer)
 
-	packet->header = NULL;
-	packet->flags = 0;
+	*num_bytes = 0;
+	while (pos != end) {
+		header = (struct ps_packet_header_s *)&buffer->buffer[pos % state->size];
+		*num_bytes += ps_header_getsize(state, header);
+		if (state->flags & PS_BUFFER_MPMC)
+			pos = move_vpos(state, pos, ps_header_getsize(state, header));
+		else
+			pos = move_pos(state, pos, ps_header_getsize(state, header));
+		++num_pkts;
+	}
 
-	return 0;
+	return num_pkts;
 }
 
-/* NOTE len is absolute packet size, not added to current reserved */
-int ps_packet_reserve(ps_packet_t *packet, size_t len)
+int ps_buffer_state_text(ps_buffer_t *buffer, FILE *stream)
 {
-	unsigned int tries;
-	__PS_PACKET_VARS(packet)
+	int num_pkts;
+	int num_bytes;
+	long free_bytes;
+	__PS_BUFFER_VARS(buffer)
+	if (!buffer || !stream)
+		return EINVAL;
 
-	if (len <= packet->reserved)
-		return 0;
+	free_bytes = state->free_bytes;
+	if (state->flags & PS_BUFFER_MPMC)
+		free_bytes = state->size - state->header_size -
+			     (state->write_next - state->read_pos);
 
-	state->free_bytes -= len - packet->reserved;
-	while (state->free_bytes < 0) {
-		tries = 0;
-		/* "consume" next free (=read) packet */
-		if (state->flags & PS_BUFFER_STATS)
-			buffer->write_wait_start = ps_buffer_utime(buffer);
+	fprintf(stream, "size: %zd, read_pos: %zd, write_pos: %zd\n"
+			"read_next: %zd, write_next: %zd, read_first: %zd\n"
+			"free_bytes: %ld, backing: %s, numa node: %d\n",
+		state->size, state->read_pos, state->write_pos,
+		state->read_next, state->write_next, state->read_first,
+		free_bytes,
+		state->backing == PS_BACKING_HUGETLB ? "hugetlb" :
+		state->backing == PS_BACKING_THP ? "thp" : "pages",
+		state->numa_node);
+
+	/* groups read on their own, count what the slowest has not released */
+	num_pkts = ps_buffer_count(buffer, (state->flags & PS_BUFFER_BROADCAST) ?
+				   state->read_pos : state->read_next,
+				   __PS_LOAD_ACQUIRE(&state->write_pos), &num_bytes);
+	fprintf(stream, "unread packets: %d, num_bytes: %d\n",
+		num_pkts, num_bytes);
 
-		if (packet->flags & PS_PACKET_TRY) {
-			if (sem_trywait(&state->read_packets)) {
-				state->free_bytes += len - packet->reserved;
-				return EBUSY;
-			}
-		} else {
-retry:
-			tries++;
-			if (sem_wait(&state->read_packets)) {
-				if (tries < MAX_SEM_WAIT_TRIES)
-					goto retry;
-				else {
-					state->free_bytes += len - packet->reserved;
-					return EINVAL;
-				}
-			}
+	if (state->flags & PS_BUFFER_BROADCAST) {
+		int i;
+		for (i = 0; i < state->groups; i++) {
+			num_pkts = ps_buffer_count(buffer, state->group[i].read_next,
+						   __PS_LOAD_ACQUIRE(&state->write_pos), &num_bytes);
+			fprintf(stream, "group %d read_pos: %zd, read_next: %zd, "
+					"unread packets: %d, num_bytes: %d\n",
+				i, state->group[i].read_pos, state->group[i].read_next,
+				num_pkts, num_bytes);
 		}
+	}
 
-		if (state->flags & PS_BUFFER_STATS)
-			buffer->stats->write_wait_nsec +=
-				ps_buffer_utime(buffer) - buffer->write_wait_start;
+	if (state->flags & PS_BUFFER_MPMC)
+		num_pkts = num_bytes = 0;
+	else
+		num_pkts = ps_buffer_count(buffer, state->read_first,
+					   __PS_LOAD_ACQUIRE(&state->read_pos), &num_bytes);
+	fprintf(stream, "pending free packets: %d, num_bytes: %d\n",
+		num_pkts, num_bytes);
 
-		do {
-			header = (struct ps_packet_header_s *) &buffer->buffer[state->read_first];
-
-			state->free_bytes += sizeof(struct ps_packet_header_s) + header->size;
-			state->read_first = (state->read_first +
-					     sizeof(struct ps_packet_header_s) +
-					     header->size) % state->size;
-			if (state->read_first + sizeof(struct ps_packet_header_s) > state->size) {
-				state->free_bytes += state->size - state->read_first;
-				state->read_first = 0;
-			}
-			/*
-			 * Once read_packets semaphore decremented, you need to process it
-			 * before cancelling the write to not lose buffer space
-			 */
-			__PS_CHECK_CANCEL_WRITE(state)
-		} while (!sem_trywait(&state->read_packets));
+	if (state->flags & PS_BUFFER_ROBUST) {
+		int i, j, open_pkts = 0;
+		num_pkts = 0;
+		for (i = 0; i < PS_MAX_PEERS; i++) {
+			if (!state->peers[i].pid)
+				continue;
+			num_pkts++;
+			for (j = 0; j < PS_PEER_PACKETS; j++)
+				open_pkts += state->peers[i].packets[j].kind != PS_PEER_FREE;
+		}
+		fprintf(stream, "peers: %d, open packets: %d\n", num_pkts, open_pkts);
 	}
 
-	packet->reserved = len;
 	return 0;
 }
 
-int ps_packet_closeread(ps_packet_t *packet)
+int ps_buffer_drain(ps_buffer_t *buffer)
 {
-	__PS_PACKET_VARS(packet)
-	int ret;
-	size_t pos;
+	int res = 0;
+	size_t write_pos;
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
 
-	if ((ret = pthread_mutex_lock(&state->read_close_mutex)))
-		return ret;
+	if (state->flags & PS_BUFFER_SPSC)
+		return ps_buffer_drain_spsc(buffer);
+	if (state->flags & PS_BUFFER_MPMC)
+		return ps_buffer_drain_mpmc(buffer);
+	if (state->flags & PS_BUFFER_BROADCAST)
+		return ps_buffer_drain_group(buffer);
+
+	if (ps_buffer_lock(buffer, &state->read_mutex, 0))
+		return -EINVAL;
 
-	if (state->flags & PS_BUFFER_STATS) {
-		buffer->stats->read_packets++;
-		buffer->stats->read_bytes += header->size;
+	if (ps_buffer_lock(buffer, &state->read_close_mutex, 0)) {
+		res = -EINVAL;
+		goto err;
+	}
+	if (unlikely(ps_buffer_current(buffer))) {
+		ps_buffer_unlock(buffer, &state->read_close_mutex);
+		res = -ENOMEM;
+		goto err;
 	}
 
-	header->flags |= PS_PACKET_HEADER_READ;
+	write_pos = __PS_LOAD_ACQUIRE(&state->write_pos);
+	state->write_pos_cache = write_pos;
+	while (state->read_next != write_pos) {
+		size_t pos = state->read_next;
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		ps_header_addflags(state, header, PS_PACKET_HEADER_READ);
+		state->read_next = move_pos(state, state->read_next, ps_header_getsize(state, header));
+		if (state->read_pos == pos) {
+			__PS_STORE_RELEASE(&state->read_pos, state->read_next);
+			++res;
+		}
+	}
+	ps_buffer_unlock(buffer, &state->read_close_mutex);
 
-	if (state->read_pos == packet->buffer_pos) {
-		pos = packet->buffer_pos;
+	if (res)
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+err:
+	ps_buffer_unlock(buffer, &state->read_mutex);
 
-		do {
-			pos = move_pos(pos, state->size, header->size);
+	return res;
+}
 
-			if (unlikely(sem_post(&state->read_packets)))
-				abort();
+int ps_buffer_drain_spsc(ps_buffer_t *buffer)
+{
+	int res = 0;
+	size_t write_pos;
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
 
-			header = (struct ps_packet_header_s *) &buffer->buffer[pos];
-		} while (header->flags & PS_PACKET_HEADER_READ);
+	/* must be called from the consumer side */
+	write_pos = __PS_LOAD_ACQUIRE(&state->write_pos);
+	state->write_pos_cache = write_pos;
+	while (state->read_next != write_pos) {
+		header = (struct ps_packet_header_s *) &buffer->buffer[state->read_next];
+		ps_header_addflags(state, header, PS_PACKET_HEADER_READ);
+		state->read_next = move_pos(state, state->read_next, ps_header_getsize(state, header));
+		++res;
+	}
 
-		state->read_pos = pos;
+	if (res) {
+		__PS_STORE_RELEASE(&state->read_pos, state->read_next);
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
 	}
 
-	pthread_mutex_unlock(&state->read_close_mutex);
+	return res;
+}
 
-	ps_packet_fakedma_freeall(packet);
+int ps_buffer_drain_mpmc(ps_buffer_t *buffer)
+{
+	int res = 0;
+	size_t read_next, next;
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
 
-	packet->header = NULL;
-	packet->flags  = 0;
+	read_next = __atomic_load_n(&state->read_next, __ATOMIC_SEQ_CST);
+	while (read_next != __PS_LOAD_ACQUIRE(&state->write_pos)) {
+		header = (struct ps_packet_header_s *) &buffer->buffer[read_next % state->size];
+		next = move_vpos(state, read_next, header->size);
+		if (!__PS_CAS(&state->read_next, &read_next, next))
+			continue;
+		__atomic_or_fetch(&header->flags, PS_PACKET_HEADER_READ, __ATOMIC_SEQ_CST);
+		read_next = next;
+		++res;
+	}
 
-	return 0;
-}
+	if (res)
+		ps_buffer_release_mpmc(buffer);
 
-int ps_packet_closewrite(ps_packet_t *packet)
+	return res;
+}
+
+int ps_packet_init(ps_packet_t *packet, ps_buffer_t *buffer)
 {
-	__PS_PACKET_VARS(packet)
-	size_t pos;
-	int ret;
+	__PS_BUFFER_CHECK(buffer)
+	packet->flags = 0;
+	packet->buffer = buffer;
+	packet->header = NULL;
+	packet->fake_dma = NULL;
+	packet->peer_entry = -1;
+	packet->group = 0;
+	packet->type = 0;
+	packet->type_mask = PS_TYPE_ALL;
+	return 0;
+}
 
-	if (!(packet->flags & PS_PACKET_SIZE_SET)) {
-		if ((ret = ps_packet_setsize(packet, header->size)))
-			return ret;
+int ps_packet_setgroup(ps_packet_t *packet, int group)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+
+	if (unlikely(packet->flags & (PS_PACKET_READ | PS_PACKET_WRITE)))
+		return EBUSY;
+
+	if (unlikely((group < 0) || (group >= ((state->flags & PS_BUFFER_BROADCAST) ? state->groups : 1))))
+		return EINVAL;
+
+	packet->group = group;
+	return 0;
+}
+
+int ps_packet_settypemask(ps_packet_t *packet, uint32_t mask)
+{
+	__PS_BUFFER_CHECK(packet->buffer)
+
+	if (unlikely(packet->flags & (PS_PACKET_READ | PS_PACKET_WRITE)))
+		return EBUSY;
+
+	if (unlikely(!mask))
+		return EINVAL;
+
+	packet->type_mask = mask;
+	return 0;
+}
+
+int ps_packet_destroy(ps_packet_t *packet)
+{
+	/* areas of an open packet go back to buffer */
+	ps_packet_fakedma_freeall(packet);
+	packet->buffer   = NULL;
+	return 0;
+}
+
+/*
+ * Sum counter shards. A shard is copied again while an update is in
+ * progress so its packets always match its bytes. After 1000 tries, e.g.
+ * behind an updater which died halfway with PS_BUFFER_ROBUST, the last
+ * copy is taken.
+ */
+static void ps_stats_collect(ps_buffer_t *buffer, ps_stats_t *stats)
+{
+	struct ps_stats_shard_s *shard = __PS_STATS_SHARDS(buffer), copy;
+	uint64_t end;
+	int i, try;
+
+	stats->read_packets = stats->written_packets = 0;
+	stats->read_bytes = stats->written_bytes = 0;
+	stats->read_wait_nsec = stats->write_wait_nsec = 0;
+	stats->padding_bytes = stats->skipped_packets = 0;
+
+	for (i = 0; i < PS_STATS_SHARDS; i++, shard++) {
+		for (try = 0; try < 1000; try++) {
+			end = __atomic_load_n(&shard->end, __ATOMIC_ACQUIRE);
+			copy.read_packets = __atomic_load_n(&shard->read_packets, __ATOMIC_RELAXED);
+			copy.written_packets = __atomic_load_n(&shard->written_packets, __ATOMIC_RELAXED);
+			copy.read_bytes = __atomic_load_n(&shard->read_bytes, __ATOMIC_RELAXED);
+			copy.written_bytes = __atomic_load_n(&shard->written_bytes, __ATOMIC_RELAXED);
+			copy.read_wait_nsec = __atomic_load_n(&shard->read_wait_nsec, __ATOMIC_RELAXED);
+			copy.write_wait_nsec = __atomic_load_n(&shard->write_wait_nsec, __ATOMIC_RELAXED);
+			copy.padding_bytes = __atomic_load_n(&shard->padding_bytes, __ATOMIC_RELAXED);
+			copy.skipped_packets = __atomic_load_n(&shard->skipped_packets, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&shard->begin, __ATOMIC_RELAXED) == end)
+				break;
+			sched_yield();
+		}
+
+		stats->read_packets += copy.read_packets;
+		stats->written_packets += copy.written_packets;
+		stats->read_bytes += copy.read_bytes;
+		stats->written_bytes += copy.written_bytes;
+		stats->read_wait_nsec += copy.read_wait_nsec;
+		stats->write_wait_nsec += copy.write_wait_nsec;
+		stats->padding_bytes += copy.padding_bytes;
+		stats->skipped_packets += copy.skipped_packets;
 	}
+}
 
-	if (unlikely((ret = ps_packet_fakedma_commitall(packet))))
-		return ret;
+int ps_buffer_stats(ps_buffer_t *buffer, ps_stats_t *stats)
+{
+	struct ps_fake_dma_arena_s *arena = buffer->fake_dma;
+	__PS_BUFFER_VARS(buffer)
 
-	if (unlikely((ret = pthread_mutex_lock(&state->write_close_mutex))))
-		return ret;
+	if (unlikely(!(state->flags & PS_BUFFER_STATS)))
+		return ENOTSUP;
+
+	memcpy(stats, buffer->stats, sizeof(ps_stats_t));
+	ps_stats_collect(buffer, stats);
+	stats->utime = ps_buffer_utime(buffer);
 
-	if (state->flags & PS_BUFFER_STATS) {
-		buffer->stats->written_packets++;
-		buffer->stats->written_bytes += header->size;
+	/* fake dma arena is private to this process */
+	pthread_mutex_lock(&arena->lock);
+	stats->fake_dma_bytes = arena->bytes;
+	stats->fake_dma_peak = arena->peak;
+	stats->fake_dma_allocs = arena->allocs;
+	pthread_mutex_unlock(&arena->lock);
+
+	if (state->flags & PS_BUFFER_LATENCY) {
+		ps_histogram_summary(&__PS_HISTOGRAMS(buffer)->residence, &stats->residence);
+		ps_histogram_summary(&__PS_HISTOGRAMS(buffer)->open_wait, &stats->open_wait);
+		ps_histogram_summary(&__PS_HISTOGRAMS(buffer)->reserve_wait, &stats->reserve_wait);
 	}
 
-	header->flags |= PS_PACKET_HEADER_WRITTEN;
+	if (state->flags & PS_BUFFER_OCCUPANCY) {
+		ps_occupancy_t *occupancy = __PS_OCCUPANCY(buffer);
+		uint64_t samples = __atomic_load_n(&occupancy->samples, __ATOMIC_ACQUIRE);
 
-	if (state->write_pos == packet->buffer_pos) {
-		pos = packet->buffer_pos;
+		if (samples) {
+			ps_sample_t *sample = &occupancy->sample[(samples - 1) % PS_SAMPLES];
+			stats->written_packets_rate = sample->written_packets_rate;
+			stats->written_bytes_rate = sample->written_bytes_rate;
+			stats->read_packets_rate = sample->read_packets_rate;
+			stats->read_bytes_rate = sample->read_bytes_rate;
+		}
+	}
 
-		do {
-			pos = move_pos(pos, state->size, header->size);
+	return 0;
+}
 
-			if (unlikely(sem_post(&state->written_packets)))
-				abort();
+static void ps_lockstats_delta(ps_lockstats_t *cur, ps_lockstats_t *prev, ps_lockstats_t *delta)
+{
+	delta->acquisitions = cur->acquisitions - prev->acquisitions;
+	delta->contended = cur->contended - prev->contended;
+	delta->wait_nsec = cur->wait_nsec - prev->wait_nsec;
+	delta->max_hold_nsec = cur->max_hold_nsec;
+}
 
-			header = (struct ps_packet_header_s *) &buffer->buffer[pos];
-		} while (header->flags & PS_PACKET_HEADER_WRITTEN);
+int ps_buffer_stats_delta(ps_buffer_t *buffer, ps_stats_t *delta)
+{
+	struct ps_stats_prev_s *prev = buffer->stats_prev;
+	ps_stats_t stats;
+	int ret;
+
+	if (unlikely(delta == NULL))
+		return EINVAL;
 
-		state->write_pos = pos;
+	if (unlikely(prev == NULL))
+		return ENOTSUP;
+
+	/* snapshot under lock, concurrent callers must not go backwards */
+	pthread_mutex_lock(&prev->lock);
+	if (unlikely((ret = ps_buffer_stats(buffer, &stats)))) {
+		pthread_mutex_unlock(&prev->lock);
+		return ret;
 	}
 
-	pthread_mutex_unlock(&state->write_close_mutex);
+	/* gauges, high-water marks and summaries as is */
+	*delta = stats;
+	delta->read_packets -= prev->stats.read_packets;
+	delta->written_packets -= prev->stats.written_packets;
+	delta->read_bytes -= prev->stats.read_bytes;
+	delta->written_bytes -= prev->stats.written_bytes;
+	delta->read_wait_nsec -= prev->stats.read_wait_nsec;
+	delta->write_wait_nsec -= prev->stats.write_wait_nsec;
+	delta->utime -= prev->stats.utime;
+	delta->padding_bytes -= prev->stats.padding_bytes;
+	delta->skipped_packets -= prev->stats.skipped_packets;
+	delta->fake_dma_allocs -= prev->stats.fake_dma_allocs;
+	ps_lockstats_delta(&stats.read_mutex, &prev->stats.read_mutex, &delta->read_mutex);
+	ps_lockstats_delta(&stats.write_mutex, &prev->stats.write_mutex, &delta->write_mutex);
+	ps_lockstats_delta(&stats.read_close_mutex, &prev->stats.read_close_mutex,
+			   &delta->read_close_mutex);
+	ps_lockstats_delta(&stats.write_close_mutex, &prev->stats.write_close_mutex,
+			   &delta->write_close_mutex);
+
+	prev->stats = stats;
+	pthread_mutex_unlock(&prev->lock);
 
-	packet->header = NULL;
-	packet->flags = 0;
 	return 0;
 }
 
-int ps_packet_getsize(ps_packet_t *packet, size_t *size)
+int ps_packet_open(ps_packet_t *packet, ps_flags_t flags)
 {
-	__PS_PACKET_CHECK(packet)
-	*size = ((struct ps_packet_header_s *) packet->header)->size;
-	return 0;
+	__PS_BUFFER_CHECK(packet->buffer)
+
+	if (unlikely(!(flags & PS_PACKET_READ || flags & PS_PACKET_WRITE)))
+		return EINVAL;
+
+	if (flags & PS_PACKET_READ) {
+		int ret;
+
+		if (unlikely(packet->type_mask != PS_TYPE_ALL))
+			ret = ps_packet_openread_filter(packet, flags);
+		else
+			ret = ps_packet_open_any(packet, flags);
+
+		if (unlikely(((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_LATENCY) &&
+		    !ret)
+			ps_packet_residence(packet, ps_buffer_utime(packet->buffer));
+		return ret;
+	}
+
+	packet->type = 0;
+	return ps_packet_open_any(packet, flags);
 }
 
-int ps_packet_read(ps_packet_t *packet, void *dest, size_t size)
+int ps_packet_open_any(ps_packet_t *packet, ps_flags_t flags)
 {
-	size_t offs, rlen = size;
-	__PS_PACKET(packet)
+	if (unlikely(((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_ROBUST))
+		return ps_packet_open_robust(packet, flags);
+
+	if (flags & PS_PACKET_READ) {
+		if (((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_SPSC)
+			return ps_packet_openread_spsc(packet, flags);
+		if (((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_BROADCAST)
+			return ps_packet_openread_group(packet, flags);
+		if (((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_MPMC)
+			return ps_packet_openread_mpmc(packet, flags);
+		return ps_packet_openread(packet, flags);
+	} else
+		return ps_packet_openwrite(packet, flags);
+}
+
+/* close packets of other types unread until one in type mask is open */
+int ps_packet_openread_filter(ps_packet_t *packet, ps_flags_t flags)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	int ret;
+
+	while (!(ret = ps_packet_open_any(packet, flags))) {
+		if (likely(packet->type_mask & PS_TYPE_MASK(ps_header_gettype(state, packet->header))))
+			return 0;
+
+		if (unlikely((ret = ps_packet_close(packet))))
+			return ret;
+		if (state->flags & PS_BUFFER_STATS)
+			__PS_STATS_ADD(buffer, skipped_packets, 1);
+	}
+
+	return ret;
+}
+
+int ps_packet_openread(ps_packet_t *packet, ps_flags_t flags)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_packet_header_s *header;
+	int ret;
+	uint64_t wait_start = 0;
 
-	if (unlikely(packet->pos + size > header->size))
+retry:
+	if (flags & PS_PACKET_TRY) {
+		if (unlikely(ps_buffer_lock(buffer, &state->read_mutex, 1)))
+			return EBUSY;
+	} else if (unlikely(ps_buffer_lock(buffer, &state->read_mutex, 0)))
 		return EINVAL;
+	__PS_CHECK_CANCEL_READ(state)
+	if (unlikely((ret = ps_buffer_current(buffer)))) {
+		ps_buffer_unlock(buffer, &state->read_mutex);
+		return ret;
+	}
 
-	offs = (packet->buffer_pos + sizeof(struct ps_packet_header_s) +
-		packet->pos) % state->size;
-	if (offs + size > state->size) {
-		memcpy(dest, &buffer->buffer[offs], state->size - offs);
+	/* write_pos == read_next means there is no unread packet */
+	if (!ps_buffer_readable(state)) {
+		if (flags & PS_PACKET_TRY) {
+			ps_buffer_unlock(buffer, &state->read_mutex);
+			return EBUSY;
+		}
 
-		rlen -= state->size - offs;
-		offs = 0;
-		dest = (void *) &((unsigned char *) dest)[size - rlen];
+		if (state->flags & PS_BUFFER_STATS)
+			wait_start = ps_buffer_utime(buffer);
+
+		if (unlikely(ps_buffer_wait(buffer, &state->read_waiting, &state->read_futex,
+					    &state->write_pos, state->read_next) == EAGAIN)) {
+			/* let ps_buffer_resize() have read_mutex */
+			ps_buffer_unlock(buffer, &state->read_mutex);
+			ps_buffer_wait_resize(state);
+			goto retry;
+		}
+		__PS_CHECK_CANCEL_READ(state)
+		ps_buffer_readable(state);
+
+		if (state->flags & PS_BUFFER_STATS)
+			ps_buffer_read_waited(buffer, wait_start);
 	}
 
-	memcpy(dest, &buffer->buffer[offs], rlen);
-	packet->pos += size;
+	packet->flags = flags & ~PS_PACKET_TRY;
+	packet->buffer_pos = state->read_next;
+	packet->header = &buffer->buffer[packet->buffer_pos];
+	packet->pos = 0;
+
+	header = (struct ps_packet_header_s *) packet->header;
+	if (unlikely(packet->peer_entry >= 0))
+		ps_peer_set(state, packet->peer_entry, packet->buffer_pos, PS_PEER_OPENING);
+	state->read_next = move_pos(state, state->read_next, ps_header_getsize(state, header));
+	if (unlikely(packet->peer_entry >= 0))
+		ps_peer_set(state, packet->peer_entry, packet->buffer_pos, PS_PEER_READ);
+
+	ps_buffer_unlock(buffer, &state->read_mutex);
 
 	return 0;
 }
 
-int ps_packet_write(ps_packet_t *packet, void *src, size_t size)
+/*
+ * The consumer owns read_next and read_pos, the producer owns write_next,
+ * write_pos, read_first and free_bytes. Each side only publishes its
+ * cursor with a release store and the futexes are only woken when the
+ * other side has announced it is sleeping.
+ */
+int ps_packet_openread_spsc(ps_packet_t *packet, ps_flags_t flags)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_packet_header_s *header;
+	size_t read_next = state->read_next;
+	uint64_t wait_start = 0;
+
+	if (!ps_buffer_readable(state)) {
+		if (flags & PS_PACKET_TRY)
+			return EBUSY;
+
+		if (state->flags & PS_BUFFER_STATS)
+			wait_start = ps_buffer_utime(buffer);
+
+		if (unlikely(ps_buffer_wait(buffer, &state->read_waiting, &state->read_futex,
+					    &state->write_pos, read_next)))
+			return EINTR;
+		ps_buffer_readable(state);
+
+		if (state->flags & PS_BUFFER_STATS)
+			ps_buffer_read_waited(buffer, wait_start);
+	}
+
+	packet->flags = flags & ~PS_PACKET_TRY;
+	packet->buffer_pos = read_next;
+	packet->header = &buffer->buffer[packet->buffer_pos];
+	packet->pos = 0;
+
+	header = (struct ps_packet_header_s *) packet->header;
+	state->read_next = move_pos(state, read_next, ps_header_getsize(state, header));
+
+	return 0;
+}
+
+int ps_packet_openwrite(ps_packet_t *packet, ps_flags_t flags)
 {
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_packet_header_s *header;
 	int ret;
-	size_t offs, rlen = size;
-	__PS_PACKET(packet)
 
-	if (packet->flags & PS_PACKET_SIZE_SET) {
-		if (unlikely(packet->pos + size > header->size))
-			return EINVAL;
-	} else {
-		if (unlikely(packet->pos + size + sizeof(struct ps_packet_header_s)*2 >
-			     state->size))
-			return ENOBUFS;
+	if (state->flags & PS_BUFFER_MPMC) {
+		/* space is claimed by ps_packet_setsize(), data is staged until then */
+		packet->reserved = 0;
+		packet->flags = flags;
+		packet->buffer_pos = 0;
+		packet->header = NULL;
+		packet->pos = 0;
+		return 0;
+	}
 
-		if ((ret = ps_packet_reserve(packet, packet->pos + size)))
+	/* with PS_BUFFER_SPSC write_next is owned by the only producer */
+	if (!(state->flags & PS_BUFFER_SPSC)) {
+		if (flags & PS_PACKET_TRY) {
+			if (ps_buffer_lock(buffer, &state->write_mutex, 1))
+				return EBUSY;
+		} else if (unlikely(ps_buffer_lock(buffer, &state->write_mutex, 0)))
+			return EINVAL;
+		__PS_CHECK_CANCEL_WRITE(state)
+		if (unlikely((ret = ps_buffer_current(buffer)))) {
+			ps_buffer_unlock(buffer, &state->write_mutex);
 			return ret;
+		}
 	}
 
-	offs = (packet->buffer_pos + sizeof(struct ps_packet_header_s) +
-		packet->pos) % state->size;
-	if (offs + size > state->size) {
-		memcpy(&buffer->buffer[offs], src, state->size - offs);
+	/* next header is already free, NULL & reserved */
+	packet->reserved = 0;
 
-		rlen -= state->size - offs;
-		offs = 0;
-		src = (void *) &((unsigned char *) src)[size - rlen];
-	}
+	packet->flags = flags;
+	packet->buffer_pos = state->write_next;
+	packet->header = &buffer->buffer[packet->buffer_pos];
+	packet->pos = 0;
 
-	memcpy(&buffer->buffer[offs], src, rlen);
+	header = (struct ps_packet_header_s *) packet->header;
+	memset(header, 0, state->header_size);
 
-	packet->pos += size;
-	if (packet->pos > header->size)
-		header->size = packet->pos;
+	if (unlikely(packet->peer_entry >= 0))
+		ps_peer_set(state, packet->peer_entry, packet->buffer_pos, PS_PEER_WRITE);
 
 	return 0;
 }
 
-int ps_packet_dma(ps_packet_t *packet, void **mem, size_t size, ps_flags_t flags)
+int ps_packet_setsize(ps_packet_t *packet, size_t size)
 {
 	int ret;
-	struct ps_fake_dma_s *fake_dma;
-	size_t offs;
+	size_t res = 0;
+	size_t pad;
+	size_t write_next;
 	__PS_PACKET(packet)
 
-	if ((packet->flags & PS_PACKET_SIZE_SET) || (packet->flags & PS_PACKET_READ)) {
-		if (unlikely(packet->pos + size > header->size))
-			return EINVAL;
-	} else if (unlikely(packet->pos + size + sizeof(struct ps_packet_header_s)*2 >
-			    state->size))
+	if (unlikely((!(packet->flags & PS_PACKET_WRITE)) || (packet->flags & PS_PACKET_SIZE_SET)))
+		return EINVAL;
+
+	if (state->flags & PS_BUFFER_MPMC)
+		return ps_packet_setsize_mpmc(packet, size);
+
+	if (unlikely(size + state->header_size * 2 + state->align - 1 > state->size))
 		return ENOBUFS;
 
-	offs = (packet->buffer_pos + sizeof(struct ps_packet_header_s) +
-		packet->pos) % state->size;
+	if ((ret = ps_packet_reserve(packet, size)))
+		return ret;
+
+	write_next = state->header_size + state->write_next + size;
+	pad = align_pos(state, write_next) - write_next;
+	write_next = (write_next + pad) % state->size;
+	if (write_next + state->header_size > state->size) {
+		res = state->size - write_next + state->first_pos;
+		write_next = state->first_pos;
+	}
+
+	/* we must set next header NULL */
+	packet->flags &= ~PS_PACKET_TRY;
+	if ((ret = ps_packet_reserve(packet, state->header_size + size + pad + res)))
+		return ret;
+
+	/*
+	 * free unused reserved bytes.
+	 */
+	state->free_bytes += packet->reserved - (size + state->header_size + pad + res);
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD(buffer, padding_bytes, pad + res);
+	ps_header_setsize(state, header, size);
+	ps_header_settype(state, header, packet->type);
+	packet->flags |= PS_PACKET_SIZE_SET;
+	state->write_next = write_next;
+	if (unlikely(packet->peer_entry >= 0))
+		ps_peer_set(state, packet->peer_entry, packet->buffer_pos, PS_PEER_SIZED);
+
+	memset(&buffer->buffer[state->write_next], 0, state->header_size);
+
+	if (!(state->flags & PS_BUFFER_SPSC))
+		ps_buffer_unlock(buffer, &state->write_mutex);
+
+	/* cut fakedma */
+	return ps_packet_fakedma_cut(packet, size);
+}
+
+int ps_packet_close(ps_packet_t *packet)
+{
+	__PS_PACKET_CHECK(packet)
+
+	packet->flags &= ~PS_PACKET_TRY; /* too late to cancel */
+
+	if (unlikely(((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_OCCUPANCY))
+		return ps_packet_close_sampled(packet);
+
+	return ps_packet_close_any(packet);
+}
+
+/* size is read before close, header may be reused right after */
+int ps_packet_close_sampled(ps_packet_t *packet)
+{
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_state_s *state = (struct ps_state_s *) buffer->state;
+	int ret, read = packet->flags & PS_PACKET_READ;
+	size_t size;
+
+	/* unsized PS_BUFFER_MPMC packets are staged, without a header yet */
+	if ((state->flags & PS_BUFFER_MPMC) && !(packet->flags & PS_PACKET_SIZE_SET))
+		size = packet->reserved;
+	else
+		size = ps_header_getsize(state, packet->header);
+
+	if (unlikely((ret = ps_packet_close_any(packet))))
+		return ret;
+
+	/* broadcast packets are released when the slowest group is done */
+	if (read)
+		ps_buffer_occupancy_read(buffer, (state->flags & PS_BUFFER_BROADCAST) ? 0 : 1);
+	else
+		ps_buffer_occupancy_written(buffer, size);
+
+	return 0;
+}
+
+int ps_packet_close_any(ps_packet_t *packet)
+{
+	if (((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_SPSC) {
+		if (packet->flags & PS_PACKET_READ)
+			return ps_packet_closeread_spsc(packet);
+		else
+			return ps_packet_closewrite_spsc(packet);
+	}
+
+	if (((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_MPMC) {
+		if (packet->flags & PS_PACKET_READ)
+			return ps_packet_closeread_mpmc(packet);
+		else
+			return ps_packet_closewrite_mpmc(packet);
+	}
+
+	if (packet->flags & PS_PACKET_READ) {
+		if (((struct ps_state_s *) packet->buffer->state)->flags & PS_BUFFER_BROADCAST)
+			return ps_packet_closeread_group(packet);
+		return ps_packet_closeread(packet);
+	} else
+		return ps_packet_closewrite(packet);
+}
+
+int ps_packet_open_batch(ps_packet_t *packets, size_t max, size_t *got, ps_flags_t flags)
+{
+	ps_buffer_t *buffer;
+	struct ps_packet_header_s *header;
+	size_t pos, write_pos, i;
+	int ret = 0;
+	uint64_t wait_start = 0;
+
+	if (unlikely((packets == NULL) || (got == NULL) || (!max)))
+		return EINVAL;
+	if (unlikely((!(flags & PS_PACKET_READ)) || (flags & PS_PACKET_WRITE)))
+		return EINVAL;
+
+	*got = 0;
+	buffer = packets[0].buffer;
+	__PS_BUFFER(buffer)
+
+	/* the batch is filtered as a whole, see ps_packet_settypemask() */
+	for (i = 1; i < max; i++) {
+		if (unlikely(packets[i].type_mask != packets[0].type_mask))
+			return EINVAL;
+	}
+
+	/* every packet needs a peer entry, hand them out one at a time */
+	if (state->flags & PS_BUFFER_ROBUST) {
+		if (!(ret = ps_packet_open(&packets[0], flags)))
+			*got = 1;
+		return ret;
+	}
+
+	/* group cursors and type filters, block for the first packet only */
+	if ((state->flags & PS_BUFFER_BROADCAST) || (packets[0].type_mask != PS_TYPE_ALL)) {
+		for (i = 0; i < max; i++) {
+			if ((ret = ps_packet_open(&packets[i], i ? flags | PS_PACKET_TRY : flags)))
+				break;
+		}
+		*got = i;
+		return i ? 0 : ret;
+	}
+
+	if (state->flags & PS_BUFFER_MPMC) {
+		ret = ps_packet_open_batch_mpmc(packets, max, got, flags);
+		goto latency;
+	}
+
+retry:
+	if (!(state->flags & PS_BUFFER_SPSC)) {
+		if (flags & PS_PACKET_TRY) {
+			if (unlikely(ps_buffer_lock(buffer, &state->read_mutex, 1)))
+				return EBUSY;
+		} else if (unlikely(ps_buffer_lock(buffer, &state->read_mutex, 0)))
+			return EINVAL;
+		__PS_CHECK_CANCEL_READ(state)
+		if (unlikely((ret = ps_buffer_current(buffer))))
+			goto out;
+	}
+
+	if (!ps_buffer_readable(state)) {
+		if (flags & PS_PACKET_TRY) {
+			ret = EBUSY;
+			goto out;
+		}
+
+		if (state->flags & PS_BUFFER_STATS)
+			wait_start = ps_buffer_utime(buffer);
+
+		if (unlikely((ret = ps_buffer_wait(buffer, &state->read_waiting, &state->read_futex,
+						   &state->write_pos, state->read_next)))) {
+			if (ret == EAGAIN) {
+				/* let ps_buffer_resize() have read_mutex */
+				ps_buffer_unlock(buffer, &state->read_mutex);
+				ps_buffer_wait_resize(state);
+				goto retry;
+			}
+			ret = EINTR;
+			goto out;
+		}
+
+		if (state->flags & PS_BUFFER_STATS)
+			ps_buffer_read_waited(buffer, wait_start);
+
+		ps_buffer_readable(state);
+	}
+
+	/* take every ready packet up to max in one go */
+	write_pos = state->write_pos_cache;
+	pos = state->read_next;
+	for (i = 0; (i < max) && (pos != write_pos); i++) {
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		packets[i].flags = flags & ~PS_PACKET_TRY;
+		packets[i].buffer_pos = pos;
+		packets[i].header = header;
+		packets[i].pos = 0;
+		pos = move_pos(state, pos, ps_header_getsize(state, header));
+	}
+	state->read_next = pos;
+	*got = i;
+out:
+	if (!(state->flags & PS_BUFFER_SPSC))
+		ps_buffer_unlock(buffer, &state->read_mutex);
+latency:
+	if (unlikely(state->flags & PS_BUFFER_LATENCY) && *got) {
+		uint64_t now = ps_buffer_utime(buffer);
+		for (i = 0; i < *got; i++)
+			ps_packet_residence(&packets[i], now);
+	}
+
+	return ret;
+}
+
+int ps_packet_open_batch_mpmc(ps_packet_t *packets, size_t max, size_t *got, ps_flags_t flags)
+{
+	ps_buffer_t *buffer = packets[0].buffer;
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
+	size_t read_next, write_pos, pos, i;
+	uint64_t wait_start = 0;
+
+	read_next = __atomic_load_n(&state->read_next, __ATOMIC_SEQ_CST);
+	for (;;) {
+		write_pos = __PS_LOAD_ACQUIRE(&state->write_pos);
+		if (write_pos != read_next) {
+			/* claim the whole run with a single CAS */
+			pos = read_next;
+			for (i = 0; (i < max) && (pos != write_pos); i++) {
+				header = (struct ps_packet_header_s *) &buffer->buffer[pos % state->size];
+				packets[i].buffer_pos = pos;
+				packets[i].header = header;
+				pos = move_vpos(state, pos, header->size);
+			}
+			if (__PS_CAS(&state->read_next, &read_next, pos))
+				break;
+			continue;
+		}
+
+		if (flags & PS_PACKET_TRY)
+			return EBUSY;
+
+		if (state->flags & PS_BUFFER_STATS)
+			wait_start = ps_buffer_utime(buffer);
+
+		if (unlikely(ps_buffer_wait(buffer, &state->read_waiting, &state->read_futex,
+					    &state->write_pos, write_pos)))
+			return EINTR;
+
+		if (state->flags & PS_BUFFER_STATS)
+			ps_buffer_read_waited(buffer, wait_start);
+
+		read_next = __atomic_load_n(&state->read_next, __ATOMIC_SEQ_CST);
+	}
+
+	*got = i;
+	while (i--) {
+		packets[i].flags = flags & ~PS_PACKET_TRY;
+		packets[i].pos = 0;
+	}
+
+	return 0;
+}
+
+int ps_packet_close_batch(ps_packet_t *packets, size_t count)
+{
+	ps_buffer_t *buffer;
+	struct ps_packet_header_s *header;
+	size_t i, pos, bytes = 0;
+	int ret, released = 0;
+
+	if (unlikely((packets == NULL) || (!count)))
+		return EINVAL;
+
+	__PS_PACKET_CHECK(&packets[0])
+	buffer = packets[0].buffer;
+	__PS_BUFFER_VARS(buffer)
+
+	for (i = 0; i < count; i++) {
+		__PS_PACKET_CHECK(&packets[i])
+		if (unlikely(!(packets[i].flags & PS_PACKET_READ)))
+			return EINVAL;
+		bytes += ps_header_getsize(state, packets[i].header);
+	}
+
+	if (state->flags & (PS_BUFFER_ROBUST | PS_BUFFER_BROADCAST)) {
+		for (i = 0; i < count; i++) {
+			if (unlikely((ret = ps_packet_close(&packets[i]))))
+				return ret;
+		}
+		return 0;
+	}
+
+	if (state->flags & PS_BUFFER_MPMC) {
+		if (state->flags & PS_BUFFER_STATS)
+			__PS_STATS_ADD2(buffer, read_packets, count, read_bytes, bytes);
+		for (i = 0; i < count; i++)
+			__atomic_or_fetch(&((struct ps_packet_header_s *) packets[i].header)->flags,
+					  PS_PACKET_HEADER_READ, __ATOMIC_SEQ_CST);
+		ps_buffer_release_mpmc(buffer);
+	} else if (state->flags & PS_BUFFER_SPSC) {
+		if (state->flags & PS_BUFFER_STATS)
+			__PS_STATS_ADD2(buffer, read_packets, count, read_bytes, bytes);
+		for (i = 0; i < count; i++)
+			ps_header_addflags(state, packets[i].header, PS_PACKET_HEADER_READ);
+		ps_buffer_release_spsc(buffer);
+	} else {
+		if ((ret = ps_buffer_lock(buffer, &state->read_close_mutex, 0)))
+			return ret;
+
+		if (state->flags & PS_BUFFER_STATS)
+			__PS_STATS_ADD2(buffer, read_packets, count, read_bytes, bytes);
+
+		for (i = 0; i < count; i++)
+			ps_header_addflags(state, packets[i].header, PS_PACKET_HEADER_READ);
+
+		/* one walk frees the whole batch and anything read after it */
+		if (state->read_pos == packets[0].buffer_pos) {
+			pos = packets[0].buffer_pos;
+			header = (struct ps_packet_header_s *) packets[0].header;
+
+			do {
+				pos = move_pos(state, pos, ps_header_getsize(state, header));
+				header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+			} while (ps_header_getflags(state, header) & PS_PACKET_HEADER_READ);
+
+			__PS_STORE_RELEASE(&state->read_pos, pos);
+			released = 1;
+		}
+
+		ps_buffer_unlock(buffer, &state->read_close_mutex);
+
+		if (released)
+			ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+	}
+
+	for (i = 0; i < count; i++) {
+		ps_packet_fakedma_freeall(&packets[i]);
+		packets[i].header = NULL;
+		packets[i].flags = 0;
+	}
+
+	if (unlikely(state->flags & PS_BUFFER_OCCUPANCY))
+		ps_buffer_occupancy_read(buffer, count);
+
+	return 0;
+}
+
+int ps_dispatch(ps_packet_t *packet, ps_handler_t *handlers, int count,
+		void *arg, ps_flags_t flags)
+{
+	uint32_t mask = 0, type_mask;
+	int i, ret, close_ret;
+
+	__PS_BUFFER_CHECK(packet->buffer)
+
+	if (unlikely((handlers == NULL) || (count < 1) || (count > PS_PACKET_TYPES)))
+		return EINVAL;
+	if (unlikely(flags & ~PS_PACKET_TRY))
+		return EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (handlers[i])
+			mask |= PS_TYPE_MASK(i);
+	}
+	if (unlikely(!(mask & packet->type_mask)))
+		return EINVAL;
+
+	/* packets without a handler are skipped like any filtered type */
+	type_mask = packet->type_mask;
+	packet->type_mask &= mask;
+
+	while (!(ret = ps_packet_open(packet, PS_PACKET_READ | flags))) {
+		ret = handlers[ps_header_gettype((struct ps_state_s *) packet->buffer->state,
+						 packet->header)](packet, arg);
+		close_ret = ps_packet_close(packet);
+		if (unlikely(ret))
+			break;
+		if (unlikely((ret = close_ret)))
+			break;
+	}
+
+	packet->type_mask = type_mask;
+	return ret;
+}
+
+int ps_packet_cancel(ps_packet_t *packet)
+{
+	__PS_PACKET(packet)
+
+	if (unlikely(!(packet->flags & PS_PACKET_WRITE)))
+		return EINVAL;
+	if (unlikely(packet->flags & PS_PACKET_SIZE_SET))
+		return EINVAL;
+
+	if (state->flags & PS_BUFFER_MPMC) {
+		/* nothing has been claimed from buffer yet */
+	} else {
+		state->free_bytes += packet->reserved; /* correct? */
+		memset(header, 0, state->header_size);
+		if (unlikely(packet->peer_entry >= 0))
+			ps_peer_untrack(packet);
+		if (!(state->flags & PS_BUFFER_SPSC))
+			ps_buffer_unlock(buffer, &state->write_mutex);
+	}
+
+	ps_packet_fakedma_freeall(packet);
+
+	packet->header = NULL;
+	packet->flags = 0;
+
+	return 0;
+}
+
+/* NOTE len is absolute packet size, not added to current reserved */
+int ps_packet_reserve(ps_packet_t *packet, size_t len)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	size_t read_pos;
+	uint64_t wait_start = 0;
+
+	if (len <= packet->reserved)
+		return 0;
+
+	state->free_bytes -= len - packet->reserved;
+	while (state->free_bytes < 0) {
+		read_pos = __PS_LOAD_ACQUIRE(&state->read_pos);
+
+		if (state->read_first == read_pos) {
+			/* nothing to reclaim, wait for consumers */
+			if (packet->flags & PS_PACKET_TRY) {
+				state->free_bytes += len - packet->reserved;
+				return EBUSY;
+			}
+
+			if (state->flags & PS_BUFFER_STATS)
+				wait_start = ps_buffer_utime(buffer);
+
+			if (unlikely(ps_buffer_wait(buffer, &state->write_waiting, &state->write_futex,
+						    &state->read_pos, read_pos))) {
+				state->free_bytes += len - packet->reserved;
+				if (unlikely(packet->peer_entry >= 0))
+					ps_peer_untrack(packet);
+				if (!(state->flags & PS_BUFFER_SPSC))
+					ps_buffer_unlock(buffer, &state->write_mutex);
+				return EINTR;
+			}
+
+			if (state->flags & PS_BUFFER_STATS)
+				ps_buffer_write_waited(buffer, wait_start);
+			continue;
+		}
+
+		/* reclaim every packet consumers are done with in one go */
+		do
+			ps_buffer_free_first(buffer);
+		while (state->read_first != read_pos);
+	}
+
+	packet->reserved = len;
+	return 0;
+}
+
+/*
+ * Sleep on futex until *cursor moves away from value. Waking side must
+ * publish its cursor and then call ps_buffer_wake().
+ */
+int ps_buffer_wait(ps_buffer_t *buffer, int *waiting, int *futex,
+		   size_t *cursor, size_t value)
+{
+	__PS_BUFFER_VARS(buffer)
+	/* a dead peer may be what we are waiting for */
+	struct timespec timeout = {0, PS_PEER_TIMEOUT_NSEC};
+	int ret = 0;
+	int seq;
+
+	__atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		/* sample futex first, so a wake after the checks isn't lost */
+		seq = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(cursor, __ATOMIC_SEQ_CST) != value)
+			break;
+		if (unlikely(__atomic_load_n(&state->flags, __ATOMIC_SEQ_CST) & PS_BUFFER_CANCELLED)) {
+			ret = EINTR;
+			break;
+		}
+		if (unlikely(__atomic_load_n(&state->resizing, __ATOMIC_SEQ_CST))) {
+			ret = EAGAIN;
+			break;
+		}
+		if ((ps_buffer_futex(state, futex, FUTEX_WAIT, seq,
+				     (state->flags & PS_BUFFER_ROBUST) ? &timeout : NULL) == -1) &&
+		    (errno == ETIMEDOUT))
+			ps_buffer_reap(buffer);
+	}
+	__atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+
+	return ret;
+}
+
+/* wake every thread sleeping in ps_buffer_wait(), no syscall if there is none */
+void ps_buffer_wake(struct ps_state_s *state, int *waiting, int *futex)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+		ps_buffer_futex(state, futex, FUTEX_WAKE, INT_MAX, NULL);
+	}
+}
+
+/* give back the space of the packet at read_first */
+void ps_buffer_free_first(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
+	size_t pos;
+
+	header = (struct ps_packet_header_s *) &buffer->buffer[state->read_first];
+
+	pos = align_pos(state, state->read_first + state->header_size +
+			ps_header_getsize(state, header));
+	state->free_bytes += pos - state->read_first;
+	state->read_first = pos % state->size;
+	if (state->read_first + state->header_size > state->size) {
+		state->free_bytes += state->size - state->read_first + state->first_pos;
+		state->read_first = state->first_pos;
+	}
+}
+
+int ps_packet_closeread(ps_packet_t *packet)
+{
+	__PS_PACKET_VARS(packet)
+	int ret, released = 0;
+	size_t pos;
+
+	if ((ret = ps_buffer_lock(buffer, &state->read_close_mutex, 0)))
+		return ret;
+
+	/* a reaper lost the race against repair of a dead closer */
+	if (unlikely(packet->peer_entry >= 0) &&
+	    (ps_peer_entry(state, packet->peer_entry)->kind == PS_PEER_FREE))
+		goto out;
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD2(buffer, read_packets, 1, read_bytes, ps_header_getsize(state, header));
+
+	ps_header_addflags(state, header, PS_PACKET_HEADER_READ);
+
+	if (state->read_pos == packet->buffer_pos) {
+		pos = packet->buffer_pos;
+
+		do {
+			pos = move_pos(state, pos, ps_header_getsize(state, header));
+			header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		} while (ps_header_getflags(state, header) & PS_PACKET_HEADER_READ);
+
+		__PS_STORE_RELEASE(&state->read_pos, pos);
+		released = 1;
+	}
+
+	/* untrack before unlock, so a dead owner's entry is never stale */
+	if (unlikely(packet->peer_entry >= 0))
+		ps_peer_untrack(packet);
+out:
+	ps_buffer_unlock(buffer, &state->read_close_mutex);
+
+	if (released)
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+
+	ps_packet_fakedma_freeall(packet);
+
+	packet->header = NULL;
+	packet->flags  = 0;
+
+	return 0;
+}
+
+/*
+ * PS_BUFFER_BROADCAST consumers claim packets with their group cursors.
+ * Closing marks the packet read by group and moves group read_pos;
+ * space is given back to producers once the slowest group moved.
+ */
+int ps_packet_openread_group(ps_packet_t *packet, ps_flags_t flags)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_group_s *group = &state->group[packet->group];
+	struct ps_packet_header_s *header;
+	uint64_t wait_start = 0;
+
+	if (flags & PS_PACKET_TRY) {
+		if (unlikely(ps_buffer_lock(buffer, &group->read_mutex, 1)))
+			return EBUSY;
+	} else if (unlikely(ps_buffer_lock(buffer, &group->read_mutex, 0)))
+		return EINVAL;
+
+	if (group->write_pos_cache == group->read_next)
+		group->write_pos_cache = __PS_LOAD_ACQUIRE(&state->write_pos);
+	while (group->write_pos_cache == group->read_next) {
+		if (flags & PS_PACKET_TRY) {
+			ps_buffer_unlock(buffer, &group->read_mutex);
+			return EBUSY;
+		}
+
+		if (state->flags & PS_BUFFER_STATS)
+			wait_start = ps_buffer_utime(buffer);
+
+		/* other groups share read_futex, ps_buffer_resize() is not supported */
+		if (unlikely(ps_buffer_wait(buffer, &state->read_waiting, &state->read_futex,
+					    &state->write_pos, group->read_next))) {
+			ps_buffer_unlock(buffer, &group->read_mutex);
+			return EINTR;
+		}
+		group->write_pos_cache = __PS_LOAD_ACQUIRE(&state->write_pos);
+
+		if (state->flags & PS_BUFFER_STATS)
+			ps_buffer_read_waited(buffer, wait_start);
+	}
+
+	if (unlikely(state->flags & PS_BUFFER_CANCELLED)) {
+		ps_buffer_unlock(buffer, &group->read_mutex);
+		return EINTR;
+	}
+
+	packet->flags = flags & ~PS_PACKET_TRY;
+	packet->buffer_pos = group->read_next;
+	packet->header = &buffer->buffer[packet->buffer_pos];
+	packet->pos = 0;
+
+	header = (struct ps_packet_header_s *) packet->header;
+	group->read_next = move_pos(state, group->read_next, ps_header_getsize(state, header));
+
+	ps_buffer_unlock(buffer, &group->read_mutex);
+
+	return 0;
+}
+
+/* move read_pos to slowest group, called with read_close_mutex held */
+static int ps_buffer_release_groups(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	size_t dist, min = state->size, pos = state->read_pos;
+	int i;
+
+	/* every group is at or past read_pos, the nearest one is slowest */
+	for (i = 0; i < state->groups; i++) {
+		dist = (state->group[i].read_pos + state->size - state->read_pos) % state->size;
+		if (dist < min) {
+			min = dist;
+			pos = state->group[i].read_pos;
+		}
+	}
+
+	if (pos == state->read_pos)
+		return 0;
+
+	if (unlikely(state->flags & PS_BUFFER_OCCUPANCY)) {
+		int bytes;
+		__atomic_sub_fetch(&state->packets, ps_buffer_count(buffer, state->read_pos, pos, &bytes),
+				   __ATOMIC_RELAXED);
+	}
+
+	__PS_STORE_RELEASE(&state->read_pos, pos);
+	return 1;
+}
+
+int ps_packet_closeread_group(ps_packet_t *packet)
+{
+	__PS_PACKET_VARS(packet)
+	struct ps_group_s *group = &state->group[packet->group];
+	ps_flags_t mark = PS_PACKET_HEADER_GROUP(packet->group);
+	int ret, released = 0;
+	size_t pos;
+
+	if ((ret = ps_buffer_lock(buffer, &state->read_close_mutex, 0)))
+		return ret;
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD2(buffer, read_packets, 1, read_bytes, ps_header_getsize(state, header));
+
+	ps_header_addflags(state, header, mark);
+
+	if (group->read_pos == packet->buffer_pos) {
+		pos = packet->buffer_pos;
+
+		do {
+			pos = move_pos(state, pos, ps_header_getsize(state, header));
+			header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		} while (ps_header_getflags(state, header) & mark);
+
+		group->read_pos = pos;
+		released = ps_buffer_release_groups(buffer);
+	}
+
+	ps_buffer_unlock(buffer, &state->read_close_mutex);
+
+	if (released)
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+
+	ps_packet_fakedma_freeall(packet);
+
+	packet->header = NULL;
+	packet->flags  = 0;
+
+	return 0;
+}
+
+int ps_buffer_drain_group(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
+	struct ps_group_s *group;
+	size_t write_pos, read_pos;
+	int i, num_bytes, res = 0;
+
+	for (i = 0; i < state->groups; i++) {
+		if (ps_buffer_lock(buffer, &state->group[i].read_mutex, 0)) {
+			while (i--)
+				ps_buffer_unlock(buffer, &state->group[i].read_mutex);
+			return -EINVAL;
+		}
+	}
+	if (ps_buffer_lock(buffer, &state->read_close_mutex, 0)) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	/* like ps_buffer_drain() in every group */
+	write_pos = __PS_LOAD_ACQUIRE(&state->write_pos);
+	read_pos = state->read_pos;
+	for (i = 0; i < state->groups; i++) {
+		group = &state->group[i];
+		group->write_pos_cache = write_pos;
+		while (group->read_next != write_pos) {
+			header = (struct ps_packet_header_s *) &buffer->buffer[group->read_next];
+			ps_header_addflags(state, header, PS_PACKET_HEADER_GROUP(i));
+			if (group->read_pos == group->read_next)
+				group->read_pos = move_pos(state, group->read_pos,
+							   ps_header_getsize(state, header));
+			group->read_next = move_pos(state, group->read_next,
+						    ps_header_getsize(state, header));
+		}
+	}
+	if (ps_buffer_release_groups(buffer))
+		res = ps_buffer_count(buffer, read_pos, state->read_pos, &num_bytes);
+	ps_buffer_unlock(buffer, &state->read_close_mutex);
+
+	if (res)
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+out:
+	for (i = 0; i < state->groups; i++)
+		ps_buffer_unlock(buffer, &state->group[i].read_mutex);
+	return res;
+}
+
+int ps_packet_closeread_spsc(ps_packet_t *packet)
+{
+	__PS_PACKET_VARS(packet)
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD2(buffer, read_packets, 1, read_bytes, ps_header_getsize(state, header));
+
+	ps_header_addflags(state, header, PS_PACKET_HEADER_READ);
+
+	/* older packets still open keep their space and everything after it */
+	if (state->read_pos == packet->buffer_pos)
+		ps_buffer_release_spsc(buffer);
+
+	ps_packet_fakedma_freeall(packet);
+
+	packet->header = NULL;
+	packet->flags  = 0;
+
+	return 0;
+}
+
+int ps_packet_closewrite(ps_packet_t *packet)
+{
+	__PS_PACKET_VARS(packet)
+	size_t pos;
+	int ret, published = 0;
+
+	if (!(packet->flags & PS_PACKET_SIZE_SET)) {
+		if ((ret = ps_packet_setsize(packet, ps_header_getsize(state, header))))
+			return ret;
+	}
+
+	if (unlikely((ret = ps_packet_fakedma_commitall(packet))))
+		return ret;
+
+	if (unlikely(state->flags & PS_BUFFER_LATENCY))
+		ps_header_stamp(buffer, header);
+
+	if (unlikely((ret = ps_buffer_lock(buffer, &state->write_close_mutex, 0))))
+		return ret;
+
+	if (unlikely(packet->peer_entry >= 0)) {
+		switch (ps_peer_entry(state, packet->peer_entry)->kind) {
+		case PS_PEER_FREE:
+			/* a reaper lost the race against repair of a dead closer */
+			goto out;
+		case PS_PEER_REAP_WRITE:
+			/* data of a dead producer may be incomplete */
+			ps_header_addflags(state, header, PS_PACKET_HEADER_CANCELLED);
+			break;
+		}
+	}
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD2(buffer, written_packets, 1, written_bytes, ps_header_getsize(state, header));
+
+	ps_header_addflags(state, header, PS_PACKET_HEADER_WRITTEN);
+
+	if (state->write_pos == packet->buffer_pos) {
+		pos = packet->buffer_pos;
+
+		do {
+			pos = move_pos(state, pos, ps_header_getsize(state, header));
+			header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		} while (ps_header_getflags(state, header) & PS_PACKET_HEADER_WRITTEN);
+
+		__PS_STORE_RELEASE(&state->write_pos, pos);
+		published = 1;
+	}
+
+	if (unlikely(packet->peer_entry >= 0))
+		ps_peer_untrack(packet);
+out:
+	ps_buffer_unlock(buffer, &state->write_close_mutex);
+
+	/* one wake covers every packet published above */
+	if (published)
+		ps_buffer_wake(state, &state->read_waiting, &state->read_futex);
+
+	packet->header = NULL;
+	packet->flags = 0;
+	return 0;
+}
+
+int ps_packet_closewrite_spsc(ps_packet_t *packet)
+{
+	__PS_PACKET_VARS(packet)
+	int ret;
+
+	if (!(packet->flags & PS_PACKET_SIZE_SET)) {
+		if ((ret = ps_packet_setsize(packet, ps_header_getsize(state, header))))
+			return ret;
+	}
+
+	if (unlikely((ret = ps_packet_fakedma_commitall(packet))))
+		return ret;
+
+	if (unlikely(state->flags & PS_BUFFER_LATENCY))
+		ps_header_stamp(buffer, header);
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD2(buffer, written_packets, 1, written_bytes, ps_header_getsize(state, header));
+
+	ps_header_addflags(state, header, PS_PACKET_HEADER_WRITTEN);
+
+	/* ps_packet_setsize() has already moved write_next past this packet */
+	__PS_STORE_RELEASE(&state->write_pos, state->write_next);
+
+	ps_buffer_wake(state, &state->read_waiting, &state->read_futex);
+
+	packet->header = NULL;
+	packet->flags = 0;
+	return 0;
+}
+
+/*
+ * With PS_BUFFER_MPMC producers claim space by moving write_next with a CAS
+ * once the packet size is known and consumers claim packets by moving
+ * read_next with a CAS. write_pos and read_pos are then pushed over every
+ * finished packet by whichever thread closes a packet, so packets can be
+ * closed in any order without any lock.
+ */
+int ps_packet_openread_mpmc(ps_packet_t *packet, ps_flags_t flags)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_packet_header_s *header;
+	size_t read_next, write_pos, next;
+	uint64_t wait_start = 0;
+
+	read_next = __atomic_load_n(&state->read_next, __ATOMIC_SEQ_CST);
+	for (;;) {
+		write_pos = __PS_LOAD_ACQUIRE(&state->write_pos);
+		if (write_pos != read_next) {
+			/* a stale size only leads to a failing CAS */
+			header = (struct ps_packet_header_s *) &buffer->buffer[read_next % state->size];
+			next = move_vpos(state, read_next, header->size);
+			if (__PS_CAS(&state->read_next, &read_next, next))
+				break;
+			continue;
+		}
+
+		if (flags & PS_PACKET_TRY)
+			return EBUSY;
+
+		if (state->flags & PS_BUFFER_STATS)
+			wait_start = ps_buffer_utime(buffer);
+
+		if (unlikely(ps_buffer_wait(buffer, &state->read_waiting, &state->read_futex,
+					    &state->write_pos, write_pos)))
+			return EINTR;
+
+		if (state->flags & PS_BUFFER_STATS)
+			ps_buffer_read_waited(buffer, wait_start);
+
+		read_next = __atomic_load_n(&state->read_next, __ATOMIC_SEQ_CST);
+	}
+
+	packet->flags = flags & ~PS_PACKET_TRY;
+	packet->buffer_pos = read_next;
+	packet->header = header;
+	packet->pos = 0;
+
+	return 0;
+}
+
+int ps_packet_setsize_mpmc(ps_packet_t *packet, size_t size)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_mpmc_header_s *header;
+	size_t read_pos, write_next, end;
+	uint64_t wait_start = 0;
+
+	if (unlikely(size + state->header_size * 2 + state->align - 1 > state->size))
+		return ENOBUFS;
+
+	for (;;) {
+		/* read_pos first so it can't be ahead of write_next */
+		read_pos = __PS_LOAD_ACQUIRE(&state->read_pos);
+		write_next = __atomic_load_n(&state->write_next, __ATOMIC_SEQ_CST);
+		end = move_vpos(state, write_next, size);
+
+		if (end - read_pos <= state->size) {
+			if (__PS_CAS(&state->write_next, &write_next, end))
+				break;
+			continue;
+		}
+
+		if (packet->flags & PS_PACKET_TRY)
+			return EBUSY;
+
+		if (state->flags & PS_BUFFER_STATS)
+			wait_start = ps_buffer_utime(buffer);
+
+		if (unlikely(ps_buffer_wait(buffer, &state->write_waiting, &state->write_futex,
+					    &state->read_pos, read_pos)))
+			return EINTR;
+
+		if (state->flags & PS_BUFFER_STATS)
+			ps_buffer_write_waited(buffer, wait_start);
+	}
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD(buffer, padding_bytes, end - write_next - state->header_size - size);
+
+	header = (struct ps_mpmc_header_s *) &buffer->buffer[write_next % state->size];
+	header->header.flags = 0;
+	header->header.type = packet->type;
+	header->header.size = size;
+
+	packet->buffer_pos = write_next;
+	packet->header = header;
+	packet->reserved = size;
+	packet->flags &= ~PS_PACKET_TRY;
+	packet->flags |= PS_PACKET_SIZE_SET;
+
+	/* staged data is written to buffer when packet is closed */
+	return ps_packet_fakedma_cut(packet, size);
+}
+
+/* keep data written before ps_packet_setsize() aside until space is claimed */
+int ps_packet_stage_mpmc(ps_packet_t *packet, void *src, void **mem, size_t size)
+{
+	struct ps_fake_dma_s *fake_dma;
+	int ret;
+
+	if (mem)
+		*mem = NULL;
+
+	if (unlikely(!size))
+		return 0;
+
+	if ((ret = ps_packet_fakedma_alloc(packet, &fake_dma, size)))
+		return ret;
+
+	fake_dma->pos = packet->pos;
+	if (src)
+		memcpy(fake_dma->mem, src, size);
+	if (mem)
+		*mem = fake_dma->mem;
+
+	/* packet->reserved holds packet size until space is claimed */
+	packet->pos += size;
+	if (packet->pos > packet->reserved)
+		packet->reserved = packet->pos;
+
+	return 0;
+}
+
+int ps_packet_closeread_mpmc(ps_packet_t *packet)
+{
+	__PS_PACKET_VARS(packet)
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD2(buffer, read_packets, 1, read_bytes, header->size);
+
+	__atomic_or_fetch(&header->flags, PS_PACKET_HEADER_READ, __ATOMIC_SEQ_CST);
+	ps_buffer_release_mpmc(buffer);
+
+	ps_packet_fakedma_freeall(packet);
+
+	packet->header = NULL;
+	packet->flags  = 0;
+
+	return 0;
+}
+
+int ps_packet_closewrite_mpmc(ps_packet_t *packet)
+{
+	__PS_PACKET_VARS(packet)
+	int ret;
+
+	if (!(packet->flags & PS_PACKET_SIZE_SET)) {
+		if ((ret = ps_packet_setsize_mpmc(packet, packet->reserved)))
+			return ret;
+		header = (struct ps_packet_header_s *) packet->header;
+	}
+
+	if (unlikely((ret = ps_packet_fakedma_commitall(packet))))
+		return ret;
+
+	if (unlikely(state->flags & PS_BUFFER_LATENCY))
+		ps_header_stamp(buffer, header);
+
+	if (state->flags & PS_BUFFER_STATS)
+		__PS_STATS_ADD2(buffer, written_packets, 1, written_bytes, header->size);
+
+	__atomic_store_n(&((struct ps_mpmc_header_s *) header)->commit,
+			 ~packet->buffer_pos, __ATOMIC_SEQ_CST);
+	ps_buffer_publish_mpmc(buffer);
+
+	packet->header = NULL;
+	packet->flags = 0;
+	return 0;
+}
+
+/* push write_pos over every committed packet */
+void ps_buffer_publish_mpmc(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_mpmc_header_s *header;
+	size_t pos, next;
+	int published = 0;
+
+	pos = __atomic_load_n(&state->write_pos, __ATOMIC_SEQ_CST);
+	while (pos != __atomic_load_n(&state->write_next, __ATOMIC_SEQ_CST)) {
+		header = (struct ps_mpmc_header_s *) &buffer->buffer[pos % state->size];
+		if (__atomic_load_n(&header->commit, __ATOMIC_SEQ_CST) != ~pos)
+			break;
+		next = move_vpos(state, pos, header->header.size);
+		/* on failure someone else moved write_pos and pos is reloaded */
+		if (__PS_CAS(&state->write_pos, &pos, next)) {
+			pos = next;
+			published = 1;
+		}
+	}
+
+	if (published)
+		ps_buffer_wake(state, &state->read_waiting, &state->read_futex);
+}
+
+/* push read_pos over every read packet, this frees their space */
+void ps_buffer_release_mpmc(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
+	size_t pos, next;
+	int released = 0;
+
+	pos = __atomic_load_n(&state->read_pos, __ATOMIC_SEQ_CST);
+	while (pos != __atomic_load_n(&state->read_next, __ATOMIC_SEQ_CST)) {
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos % state->size];
+		if (!(__atomic_load_n(&header->flags, __ATOMIC_SEQ_CST) & PS_PACKET_HEADER_READ))
+			break;
+		next = move_vpos(state, pos, header->size);
+		if (__PS_CAS(&state->read_pos, &pos, next)) {
+			pos = next;
+			released = 1;
+		}
+	}
+
+	if (released)
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+}
+
+/* push read_pos over read packets, consumer may close them in any order */
+void ps_buffer_release_spsc(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
+	size_t pos = state->read_pos;
+
+	/* read_next bounds the walk, header past it may be stale */
+	while (pos != state->read_next) {
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		if (!(ps_header_getflags(state, header) & PS_PACKET_HEADER_READ))
+			break;
+		pos = move_pos(state, pos, ps_header_getsize(state, header));
+	}
+
+	if (pos != state->read_pos) {
+		__PS_STORE_RELEASE(&state->read_pos, pos);
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+	}
+}
+
+int ps_packet_getsize(ps_packet_t *packet, size_t *size)
+{
+	__PS_PACKET_CHECK(packet)
+	if (unlikely(!packet->header)) /* PS_BUFFER_MPMC, space not claimed yet */
+		*size = packet->reserved;
+	else
+		*size = ps_header_getsize((struct ps_state_s *) packet->buffer->state,
+					  packet->header);
+	return 0;
+}
+
+int ps_packet_settype(ps_packet_t *packet, int type)
+{
+	__PS_PACKET_CHECK(packet)
+	__PS_BUFFER_VARS(packet->buffer)
+
+	if (unlikely(!(packet->flags & PS_PACKET_WRITE)))
+		return EINVAL;
+	if (unlikely((type < 0) || (type >= PS_PACKET_TYPES)))
+		return EINVAL;
+	if (unlikely(type && (state->flags & PS_BUFFER_COMPACT)))
+		return ENOTSUP;
+
+	/* header gets type with size, PS_BUFFER_MPMC has no header before */
+	packet->type = type;
+	if (packet->flags & PS_PACKET_SIZE_SET)
+		ps_header_settype(state, packet->header, type);
+	return 0;
+}
+
+int ps_packet_gettype(ps_packet_t *packet, int *type)
+{
+	__PS_PACKET_CHECK(packet)
+
+	if (packet->flags & PS_PACKET_WRITE)
+		*type = packet->type;
+	else
+		*type = ps_header_gettype((struct ps_state_s *) packet->buffer->state,
+					  packet->header);
+	return 0;
+}
+
+int ps_packet_read(ps_packet_t *packet, void *dest, size_t size)
+{
+	size_t offs, rlen = size;
+	__PS_PACKET(packet)
+
+	if (unlikely(!header)) /* PS_BUFFER_MPMC, space not claimed yet */
+		return EINVAL;
+
+	if (unlikely(packet->pos + size > ps_header_getsize(state, header)))
+		return EINVAL;
+
+	offs = (packet->buffer_pos + state->header_size +
+		packet->pos) % state->size;
+	if ((offs + size > state->size) && !(state->flags & PS_BUFFER_MIRROR)) {
+		memcpy(dest, &buffer->buffer[offs], state->size - offs);
+
+		rlen -= state->size - offs;
+		offs = 0;
+		dest = (void *) &((unsigned char *) dest)[size - rlen];
+	}
+
+	memcpy(dest, &buffer->buffer[offs], rlen);
+	packet->pos += size;
+
+	return 0;
+}
+
+int ps_packet_write(ps_packet_t *packet, void *src, size_t size)
+{
+	int ret;
+	size_t offs, rlen = size;
+	__PS_PACKET(packet)
+
+	if (packet->flags & PS_PACKET_SIZE_SET) {
+		if (unlikely(packet->pos + size > ps_header_getsize(state, header)))
+			return EINVAL;
+	} else {
+		if (unlikely(packet->pos + size + state->header_size*2 >
+			     state->size))
+			return ENOBUFS;
+
+		if (state->flags & PS_BUFFER_MPMC)
+			return ps_packet_stage_mpmc(packet, src, NULL, size);
+
+		if ((ret = ps_packet_reserve(packet, packet->pos + size)))
+			return ret;
+	}
+
+	offs = (packet->buffer_pos + state->header_size +
+		packet->pos) % state->size;
+	if ((offs + size > state->size) && !(state->flags & PS_BUFFER_MIRROR)) {
+		memcpy(&buffer->buffer[offs], src, state->size - offs);
+
+		rlen -= state->size - offs;
+		offs = 0;
+		src = (void *) &((unsigned char *) src)[size - rlen];
+	}
+
+	memcpy(&buffer->buffer[offs], src, rlen);
+
+	packet->pos += size;
+	if (packet->pos > ps_header_getsize(state, header))
+		ps_header_setsize(state, header, packet->pos);
+
+	return 0;
+}
+
+#ifdef __PS_IOVEC
+int ps_packet_readv(ps_packet_t *packet, const struct iovec *iov, int iovcnt)
+{
+	size_t offs, rlen, size = 0;
+	unsigned char *dest;
+	int i;
+	__PS_PACKET(packet)
+
+	if (unlikely(!header)) /* PS_BUFFER_MPMC, space not claimed yet */
+		return EINVAL;
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	if (unlikely(packet->pos + size > ps_header_getsize(state, header)))
+		return EINVAL;
+
+	offs = (packet->buffer_pos + state->header_size +
+		packet->pos) % state->size;
+	for (i = 0; i < iovcnt; i++) {
+		dest = (unsigned char *) iov[i].iov_base;
+		rlen = iov[i].iov_len;
+
+		if ((offs + rlen > state->size) && !(state->flags & PS_BUFFER_MIRROR)) {
+			memcpy(dest, &buffer->buffer[offs], state->size - offs);
+
+			dest += state->size - offs;
+			rlen -= state->size - offs;
+			offs = 0;
+		}
+
+		memcpy(dest, &buffer->buffer[offs], rlen);
+		offs += rlen;
+		if (offs >= state->size)
+			offs -= state->size;
+	}
+	packet->pos += size;
+
+	return 0;
+}
+
+int ps_packet_writev(ps_packet_t *packet, const struct iovec *iov, int iovcnt)
+{
+	int i, ret;
+	size_t offs, rlen, size = 0;
+	unsigned char *src, *mem;
+	__PS_PACKET(packet)
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	if (packet->flags & PS_PACKET_SIZE_SET) {
+		if (unlikely(packet->pos + size > ps_header_getsize(state, header)))
+			return EINVAL;
+	} else {
+		if (unlikely(packet->pos + size + state->header_size*2 >
+			     state->size))
+			return ENOBUFS;
+
+		if (state->flags & PS_BUFFER_MPMC) {
+			/* gather all segments into a single staging area */
+			if ((ret = ps_packet_stage_mpmc(packet, NULL, (void **) &mem, size)))
+				return ret;
+			for (i = 0; i < iovcnt; i++) {
+				memcpy(mem, iov[i].iov_base, iov[i].iov_len);
+				mem += iov[i].iov_len;
+			}
+			return 0;
+		}
+
+		/* reserve once for all segments */
+		if ((ret = ps_packet_reserve(packet, packet->pos + size)))
+			return ret;
+	}
+
+	offs = (packet->buffer_pos + state->header_size +
+		packet->pos) % state->size;
+	for (i = 0; i < iovcnt; i++) {
+		src = (unsigned char *) iov[i].iov_base;
+		rlen = iov[i].iov_len;
+
+		if ((offs + rlen > state->size) && !(state->flags & PS_BUFFER_MIRROR)) {
+			memcpy(&buffer->buffer[offs], src, state->size - offs);
+
+			src += state->size - offs;
+			rlen -= state->size - offs;
+			offs = 0;
+		}
+
+		memcpy(&buffer->buffer[offs], src, rlen);
+		offs += rlen;
+		if (offs >= state->size)
+			offs -= state->size;
+	}
+
+	packet->pos += size;
+	if (packet->pos > ps_header_getsize(state, header))
+		ps_header_setsize(state, header, packet->pos);
+
+	return 0;
+}
+
+/* size bytes of packet data area at current position, split at buffer end */
+static inline int ps_packet_segments(ps_packet_t *packet, size_t size, struct iovec iov[2])
+{
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_state_s *state = (struct ps_state_s *) buffer->state;
+	size_t offs;
+
+	if (!size)
+		return 0;
+
+	offs = (packet->buffer_pos + state->header_size +
+		packet->pos) % state->size;
+	iov[0].iov_base = &buffer->buffer[offs];
+	if ((offs + size > state->size) && !(state->flags & PS_BUFFER_MIRROR)) {
+		iov[0].iov_len = state->size - offs;
+		iov[1].iov_base = buffer->buffer;
+		iov[1].iov_len = size - iov[0].iov_len;
+		return 2;
+	}
+	iov[0].iov_len = size;
+	return 1;
+}
+
+int ps_packet_view(ps_packet_t *packet, struct iovec iov[2], int *cnt)
+{
+	size_t size;
+	__PS_PACKET(packet)
+
+	if (unlikely(!header)) /* PS_BUFFER_MPMC, space not claimed yet */
+		return EINVAL;
+
+	if (unlikely(!(packet->flags & (PS_PACKET_READ | PS_PACKET_SIZE_SET))))
+		return EINVAL;
+
+	size = ps_header_getsize(state, header) - packet->pos;
+	*cnt = ps_packet_segments(packet, size, iov);
+	packet->pos += size;
+
+	return 0;
+}
+
+int ps_packet_write_to_fd(ps_packet_t *packet, int fd, size_t *written)
+{
+	struct iovec iov[2];
+	ssize_t len;
+	int cnt;
+	__PS_PACKET(packet)
+
+	if (unlikely(!header)) /* PS_BUFFER_MPMC, space not claimed yet */
+		return EINVAL;
+
+	if (unlikely(!(packet->flags & (PS_PACKET_READ | PS_PACKET_SIZE_SET))))
+		return EINVAL;
+
+	*written = 0;
+	while (packet->pos < ps_header_getsize(state, header)) {
+		cnt = ps_packet_segments(packet, ps_header_getsize(state, header) - packet->pos, iov);
+		if (unlikely((len = writev(fd, iov, cnt)) < 0)) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		packet->pos += len;
+		*written += len;
+	}
+
+	return 0;
+}
+
+int ps_packet_fill_from_fd(ps_packet_t *packet, int fd, size_t size, size_t *got)
+{
+	struct ps_fake_dma_s *fake_dma = NULL;
+	struct iovec iov[2];
+	ssize_t len;
+	int cnt, ret;
+	__PS_PACKET(packet)
+
+	if (unlikely(!(packet->flags & PS_PACKET_WRITE)))
+		return EINVAL;
+
+	if (packet->flags & PS_PACKET_SIZE_SET) {
+		if (unlikely(packet->pos + size > ps_header_getsize(state, header)))
+			return EINVAL;
+	} else {
+		if (unlikely(packet->pos + size + state->header_size*2 >
+			     state->size))
+			return ENOBUFS;
+
+		if (state->flags & PS_BUFFER_MPMC) {
+			/* no space is claimed before ps_packet_setsize(), read aside */
+			if ((ret = ps_packet_fakedma_alloc(packet, &fake_dma, size)))
+				return ret;
+		} else if ((ret = ps_packet_reserve(packet, packet->pos + size)))
+			return ret;
+	}
+
+	if (fake_dma) {
+		iov[0].iov_base = fake_dma->mem;
+		iov[0].iov_len = size;
+		cnt = 1;
+	} else
+		cnt = ps_packet_segments(packet, size, iov);
+
+	do
+		len = readv(fd, iov, cnt);
+	while ((len < 0) && (errno == EINTR));
+
+	if (unlikely(len < 0)) {
+		ret = errno;
+		if (fake_dma)
+			ps_packet_fakedma_free(packet, fake_dma);
+		return ret;
+	}
+
+	packet->pos += len;
+	if (fake_dma) {
+		fake_dma->size = len;
+		/* packet->reserved holds packet size until space is claimed */
+		if (packet->pos > packet->reserved)
+			packet->reserved = packet->pos;
+	} else if (!(packet->flags & PS_PACKET_SIZE_SET) &&
+		   (packet->pos > ps_header_getsize(state, header)))
+		ps_header_setsize(state, header, packet->pos);
+
+	*got = len;
+	return 0;
+}
+#endif
+
+int ps_packet_dma(ps_packet_t *packet, void **mem, size_t size, ps_flags_t flags)
+{
+	int ret;
+	struct ps_fake_dma_s *fake_dma;
+	size_t offs;
+	__PS_PACKET(packet)
+
+	if ((packet->flags & PS_PACKET_SIZE_SET) || (packet->flags & PS_PACKET_READ)) {
+		if (unlikely(packet->pos + size > ps_header_getsize(state, header)))
+			return EINVAL;
+	} else if (unlikely(packet->pos + size + state->header_size*2 >
+			    state->size))
+		return ENOBUFS;
+	else if (state->flags & PS_BUFFER_MPMC) {
+		/* no space is claimed before ps_packet_setsize() */
+		if (!(flags & PS_ACCEPT_FAKE_DMA))
+			return EAGAIN;
+		return ps_packet_stage_mpmc(packet, NULL, mem, size);
+	}
+
+	offs = (packet->buffer_pos + state->header_size +
+		packet->pos) % state->size;
+
+	/* mirrored data area is never split */
+	if ((offs + size <= state->size) || (state->flags & PS_BUFFER_MIRROR)) {
+		/* real stuff */
+		if ((!(packet->flags & PS_PACKET_SIZE_SET)) && (packet->flags & PS_PACKET_WRITE)) {
+			if ((ret = ps_packet_reserve(packet, packet->pos + size)))
+				return ret;
+		}
+		*mem = &buffer->buffer[offs];
+
+		packet->pos += size;
+		if ((!(packet->flags & PS_PACKET_SIZE_SET)) &&
+		    (packet->flags & PS_PACKET_WRITE) && (packet->pos > ps_header_getsize(state, header)))
+			ps_header_setsize(state, header, packet->pos);
+
+		return 0;
+	}
+
+	if (!(flags & PS_ACCEPT_FAKE_DMA))
+		return EAGAIN;
+
+	/* we can't give real so lets fake it */
+	if ((!(packet->flags & PS_PACKET_SIZE_SET)) && (packet->flags & PS_PACKET_WRITE)) {
+		if ((ret = ps_packet_reserve(packet, packet->pos + size)))
+			return ret;
+	}
+
+	if ((ret = ps_packet_fakedma_alloc(packet, &fake_dma, size)))
+		return ret;
+
+	fake_dma->size = size;
+	fake_dma->pos = packet->pos;
+
+	if (packet->flags & PS_PACKET_READ) {
+		if ((ret = ps_packet_read(packet, fake_dma->mem, size))) {
+			ps_packet_fakedma_free(packet, fake_dma);
+			return ret;
+		}
+	}
+
+	*mem = fake_dma->mem;
+
+	packet->pos += size;
+	if ((!(packet->flags & PS_PACKET_SIZE_SET)) &&
+	    (packet->flags & PS_PACKET_WRITE) && (packet->pos > ps_header_getsize(state, header)))
+		ps_header_setsize(state, header, packet->pos);
+
+	return 0;
+}
+
+int ps_packet_tell(ps_packet_t *packet, size_t *pos)
+{
+	__PS_PACKET_CHECK(packet)
+	return packet->pos;
+}
+
+int ps_packet_seek(ps_packet_t *packet, size_t pos)
+{
+	int ret;
+	__PS_PACKET(packet)
+
+	if ((packet->flags & PS_PACKET_SIZE_SET) || (packet->flags & PS_PACKET_READ)) {
+		if (unlikely(pos > ps_header_getsize(state, header)))
+			return EINVAL;
+	}
+
+	if ((!(packet->flags & PS_PACKET_SIZE_SET)) && (packet->flags & PS_PACKET_WRITE)) {
+		if (unlikely(pos + state->header_size > state->size))
+			return EINVAL;
+
+		if (state->flags & PS_BUFFER_MPMC) {
+			/* only track packet size until space is claimed */
+			packet->pos = pos;
+			if (pos > packet->reserved)
+				packet->reserved = pos;
+			return 0;
+		}
+
+		if ((ret = ps_packet_reserve(packet, pos)))
+			return ret;
+	}
+
+	packet->pos = pos;
+	if ((!(packet->flags & PS_PACKET_SIZE_SET)) &&
+	    (packet->flags & PS_PACKET_WRITE) && (packet->pos > ps_header_getsize(state, header)))
+		ps_header_setsize(state, header, packet->pos);
+
+	return 0;
+}
+
+int ps_buffer_arena_init(ps_buffer_t *buffer, size_t align, size_t limit)
+{
+	struct ps_fake_dma_arena_s *arena;
+
+	if (unlikely(!(arena = calloc(1, sizeof(struct ps_fake_dma_arena_s)))))
+		return ENOMEM;
+
+	pthread_mutex_init(&arena->lock, NULL);
+	/* stand-in for buffer memory, keep payload alignment */
+	arena->align = align > PS_CACHELINE_SIZE ? align : PS_CACHELINE_SIZE;
+	arena->limit = limit;
+	buffer->fake_dma = arena;
+
+	return 0;
+}
+
+void ps_buffer_arena_destroy(ps_buffer_t *buffer)
+{
+	struct ps_fake_dma_arena_s *arena = buffer->fake_dma;
+	struct ps_fake_dma_s *fake_dma;
+	int i;
+
+	for (i = 0; i < PS_FAKE_DMA_CLASSES; i++) {
+		while ((fake_dma = arena->free[i])) {
+			arena->free[i] = fake_dma->next;
+			free(fake_dma);
+		}
+	}
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+	buffer->fake_dma = NULL;
+}
+
+/* drop cached areas until size more bytes fit under limit, called locked */
+static int ps_buffer_arena_trim(struct ps_fake_dma_arena_s *arena, size_t size)
+{
+	struct ps_fake_dma_s *fake_dma;
+	int i;
+
+	for (i = PS_FAKE_DMA_CLASSES - 1; i >= 0; i--) {
+		while ((arena->bytes + size > arena->limit) && (fake_dma = arena->free[i])) {
+			arena->free[i] = fake_dma->next;
+			arena->bytes -= fake_dma->mem_size;
+			free(fake_dma);
+		}
+	}
+
+	return arena->bytes + size > arena->limit ? ENOMEM : 0;
+}
+
+int ps_packet_fakedma_alloc(ps_packet_t *packet, struct ps_fake_dma_s **fake_dma, size_t size)
+{
+	struct ps_fake_dma_arena_s *arena = packet->buffer->fake_dma;
+	struct ps_fake_dma_s *find = NULL, **tail;
+	size_t mem_size = (size_t) 1 << PS_FAKE_DMA_MIN_SHIFT;
+	size_t header_size;
+	int size_class = 0;
+
+	while ((mem_size < size) && (size_class < PS_FAKE_DMA_CLASSES)) {
+		mem_size <<= 1;
+		size_class++;
+	}
+	if (size_class == PS_FAKE_DMA_CLASSES) {
+		mem_size = size;
+		size_class = -1;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	if ((size_class >= 0) && (find = arena->free[size_class]))
+		arena->free[size_class] = find->next;
+	else {
+		if (arena->limit && (arena->bytes + mem_size > arena->limit) &&
+		    unlikely(ps_buffer_arena_trim(arena, mem_size))) {
+			pthread_mutex_unlock(&arena->lock);
+			return ENOMEM;
+		}
+		/* account before allocating so concurrent allocations see the cap */
+		arena->bytes += mem_size;
+		if (arena->bytes > arena->peak)
+			arena->peak = arena->bytes;
+		arena->allocs++;
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	if (!find) {
+		header_size = (sizeof(struct ps_fake_dma_s) + arena->align - 1) & ~(arena->align - 1);
+		if (unlikely(posix_memalign((void **) &find, arena->align, header_size + mem_size))) {
+			pthread_mutex_lock(&arena->lock);
+			arena->bytes -= mem_size;
+			pthread_mutex_unlock(&arena->lock);
+			return ENOMEM;
+		}
+		find->mem = &((unsigned char *) find)[header_size];
+		find->mem_size = mem_size;
+		find->size_class = size_class;
+	}
+
+	find->size = size;
+	find->pos = packet->pos;
+	find->next = NULL;
+
+	/* keep allocation order, overlapping areas are committed in it */
+	for (tail = (struct ps_fake_dma_s **) &packet->fake_dma; *tail; tail = &(*tail)->next)
+		;
+	*tail = find;
+
+	*fake_dma = find;
+	return 0;
+}
+
+/* return list of areas to arena */
+static void ps_buffer_arena_release(ps_buffer_t *buffer, struct ps_fake_dma_s *fake_dma)
+{
+	struct ps_fake_dma_arena_s *arena = buffer->fake_dma;
+	struct ps_fake_dma_s *next;
+
+	pthread_mutex_lock(&arena->lock);
+	for (; fake_dma; fake_dma = next) {
+		next = fake_dma->next;
+		if (fake_dma->size_class < 0) {
+			arena->bytes -= fake_dma->mem_size;
+			free(fake_dma);
+		} else {
+			fake_dma->next = arena->free[fake_dma->size_class];
+			arena->free[fake_dma->size_class] = fake_dma;
+		}
+	}
+	pthread_mutex_unlock(&arena->lock);
+}
+
+int ps_packet_fakedma_free(ps_packet_t *packet, struct ps_fake_dma_s *fake_dma)
+{
+	struct ps_fake_dma_s **prev = (struct ps_fake_dma_s **) &packet->fake_dma;
+
+	while (*prev != fake_dma)
+		prev = &(*prev)->next;
+	*prev = fake_dma->next;
+
+	fake_dma->next = NULL;
+	ps_buffer_arena_release(packet->buffer, fake_dma);
+	return 0;
+}
+
+int ps_packet_fakedma_commitall(ps_packet_t *packet)
+{
+	ps_buffer_t *buffer = packet->buffer;
+	struct ps_state_s *state = (struct ps_state_s *) buffer->state;
+	struct ps_fake_dma_s *fake_dma;
+	size_t offs, len, part;
+
+	/* copy areas straight to data area, no seek and write per area */
+	for (fake_dma = packet->fake_dma; fake_dma; fake_dma = fake_dma->next) {
+		len = fake_dma->size;
+		offs = (packet->buffer_pos + state->header_size + fake_dma->pos) % state->size;
+		part = len;
+		if ((offs + len > state->size) && !(state->flags & PS_BUFFER_MIRROR))
+			part = state->size - offs;
+
+		memcpy(&buffer->buffer[offs], fake_dma->mem, part);
+		if (part < len)
+			memcpy(buffer->buffer, &((unsigned char *) fake_dma->mem)[part], len - part);
+	}
+
+	return ps_packet_fakedma_freeall(packet);
+}
+
+int ps_packet_fakedma_cut(ps_packet_t *packet, size_t size)
+{
+	struct ps_fake_dma_s *fake_dma = (struct ps_fake_dma_s *) packet->fake_dma, *next;
+
+	while (fake_dma != NULL) {
+		next = fake_dma->next;
+		if (fake_dma->pos > size)
+			ps_packet_fakedma_free(packet, fake_dma);
+		else if (fake_dma->pos + fake_dma->size > size)
+			fake_dma->size = size - fake_dma->pos;
+
+		fake_dma = next;
+	}
+	return 0;
+}
+
+int ps_packet_fakedma_freeall(ps_packet_t *packet)
+{
+	if (packet->fake_dma) {
+		ps_buffer_arena_release(packet->buffer, packet->fake_dma);
+		packet->fake_dma = NULL;
+	}
+
+	return 0;
+}
+
+int ps_buffer_getshmid(ps_buffer_t *buffer, int *shmid)
+{
+	__PS_BUFFER_CHECK(buffer)
+	*shmid = buffer->shmid;
+	return 0;
+}
+
+int ps_buffer_backing(ps_buffer_t *buffer, int *backing)
+{
+	__PS_BUFFER(buffer)
+	*backing = state->backing;
+	return 0;
+}
+
+int ps_buffer_getshmfd(ps_buffer_t *buffer, int *fd)
+{
+	__PS_BUFFER_CHECK(buffer)
+	*fd = buffer->shmfd;
+	return 0;
+}
+
+int ps_buffer_sendfd(ps_buffer_t *buffer, int sock)
+{
+#ifdef __PS_SHMFD
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte = 0;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	__PS_BUFFER_CHECK(buffer)
+
+	if (unlikely(buffer->shmfd == -1))
+		return EINVAL;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &buffer->shmfd, sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+		return errno;
+
+	return 0;
+#else
+	return ENOTSUP;
+#endif
+}
+
+int ps_buffer_recvfd(int sock, int *fd)
+{
+#ifdef __PS_SHMFD
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if ((ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1)
+		return errno;
+	if (!ret)
+		return ECONNRESET;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (unlikely((!cmsg) || (cmsg->cmsg_level != SOL_SOCKET) ||
+		     (cmsg->cmsg_type != SCM_RIGHTS) ||
+		     (cmsg->cmsg_len != CMSG_LEN(sizeof(int)))))
+		return EBADMSG;
+
+	memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return 0;
+#else
+	return ENOTSUP;
+#endif
+}
+
+int ps_buffer_numanode(ps_buffer_t *buffer, int *node)
+{
+	__PS_BUFFER(buffer)
+	*node = state->numa_node;
+	return 0;
+}
+
+/*
+ * PS_BUFFER_ROBUST: every attached process owns a peer slot and records
+ * each packet it has open in one of the slot entries. Death of a process
+ * is then handled in two places:
+ *
+ * - a state mutex it held is returned EOWNERDEAD to the next locker, which
+ *   puts cursors and free_bytes back in order in ps_buffer_repair().
+ * - packets it held open are found by ps_buffer_reap() which closes read
+ *   packets and cancels write packets, so cursors can move past them.
+ *
+ * Entries only change kind under the mutex guarding the cursor they
+ * describe, or by CAS from a reaper, so a dead owner's entry is always
+ * either accurate or left in a kind the repair of that mutex resolves.
+ */
+
+/* pthread_atfork() child handler bumps it, a child needs its own slot */
+static int ps_fork_generation;
+static pthread_once_t ps_fork_once = PTHREAD_ONCE_INIT;
+
+static void ps_fork_child(void)
+{
+	ps_fork_generation++;
+}
+
+static void ps_fork_register(void)
+{
+	pthread_atfork(NULL, NULL, ps_fork_child);
+}
+
+int ps_peer_attach(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	int i, pid, free_pid, retry;
+
+	pthread_once(&ps_fork_once, ps_fork_register);
+
+	pid = getpid();
+	for (retry = 0; retry < 2; retry++) {
+		for (i = 0; i < PS_MAX_PEERS; i++) {
+			free_pid = 0;
+			if (__PS_CAS(&state->peers[i].pid, &free_pid, pid)) {
+				__atomic_store_n(&state->peers[i].heartbeat, ps_buffer_utime(buffer),
+						 __ATOMIC_RELAXED);
+				buffer->peer = i;
+				buffer->peer_generation = ps_fork_generation;
+				return 0;
+			}
+		}
+		/* slots of dead processes are given back by reaper */
+		ps_buffer_reap(buffer);
+	}
+
+	return EAGAIN;
+}
+
+void ps_peer_detach(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_peer_s *peer = &state->peers[buffer->peer];
+	int i;
+
+	buffer->peer = -1;
+
+	/* a forked child doesn't own the slot it inherited */
+	if (buffer->peer_generation != ps_fork_generation)
+		return;
+
+	/* leave packets still open to reaper */
+	for (i = 0; i < PS_PEER_PACKETS; i++) {
+		if (__PS_LOAD_ACQUIRE(&peer->packets[i].kind) != PS_PEER_FREE)
+			return;
+	}
+	__PS_STORE_RELEASE(&peer->pid, 0);
+}
+
+/* take a free entry of this process' slot for packet */
+int ps_peer_claim(ps_packet_t *packet)
+{
+	ps_buffer_t *buffer = packet->buffer;
+	__PS_BUFFER_VARS(buffer)
+	struct ps_peer_s *peer;
+	int ret, i, kind;
+
+	if (unlikely(buffer->peer_generation != ps_fork_generation) || unlikely(buffer->peer < 0)) {
+		if ((ret = ps_peer_attach(buffer)))
+			return ret;
+	}
+
+	peer = &state->peers[buffer->peer];
+	__atomic_store_n(&peer->heartbeat, ps_buffer_utime(buffer), __ATOMIC_RELAXED);
+
+	for (i = 0; i < PS_PEER_PACKETS; i++) {
+		kind = PS_PEER_FREE;
+		if ((peer->packets[i].kind == PS_PEER_FREE) &&
+		    __PS_CAS(&peer->packets[i].kind, &kind, PS_PEER_CLAIMED)) {
+			packet->peer_entry = buffer->peer * PS_PEER_PACKETS + i;
+			return 0;
+		}
+	}
+
+	return EAGAIN;
+}
+
+int ps_peer_dead(int pid)
+{
+#ifdef __PS_ROBUST
+	FILE *procstat;
+	char path[32];
+	char line[256];
+	char *state;
+	int dead = 0;
+
+	if ((kill(pid, 0) == -1) && (errno == ESRCH))
+		return 1;
+
+	/* a zombie keeps its pid until parent waits for it */
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (!(procstat = fopen(path, "r")))
+		return 0;
+	if (fgets(line, sizeof(line), procstat) && (state = strrchr(line, ')')))
+		dead = (state[1] == ' ') && ((state[2] == 'Z') || (state[2] == 'X'));
+	fclose(procstat);
+
+	return dead;
+#else
+	return 0;
+#endif
+}
+
+int ps_packet_open_robust(ps_packet_t *packet, ps_flags_t flags)
+{
+	__PS_BUFFER_VARS(packet->buffer)
+	int ret;
+
+	for (;;) {
+		if (unlikely((ret = ps_peer_claim(packet))))
+			return ret;
+
+		if (flags & PS_PACKET_READ)
+			ret = ps_packet_openread(packet, flags);
+		else
+			ret = ps_packet_openwrite(packet, flags);
+		if (unlikely(ret)) {
+			ps_peer_untrack(packet);
+			return ret;
+		}
+
+		/* skip what a dead producer left behind */
+		if ((flags & PS_PACKET_WRITE) ||
+		    likely(!(ps_header_getflags(state, packet->header) & PS_PACKET_HEADER_CANCELLED)))
+			return 0;
+
+		ps_packet_closeread(packet);
+	}
+}
+
+/* called with mutex held and its previous owner dead */
+void ps_buffer_repair(ps_buffer_t *buffer, pthread_mutex_t *mutex)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
+	size_t pos, used;
+	int entry, kind;
+
+	for (entry = 0; entry < PS_MAX_PEERS * PS_PEER_PACKETS; entry++) {
+		kind = __PS_LOAD_ACQUIRE(&ps_peer_entry(state, entry)->kind);
+		pos = ps_peer_entry(state, entry)->pos;
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+
+		if (mutex == &state->write_mutex) {
+			/* only the owner can be between ps_packet_openwrite() and
+			   ps_packet_setsize(), it got as far as moving write_next */
+			if (kind == PS_PEER_WRITE)
+				ps_peer_set(state, entry, pos, (pos != state->write_next) ?
+					    PS_PEER_SIZED : PS_PEER_FREE);
+		} else if (mutex == &state->read_mutex) {
+			if (kind == PS_PEER_OPENING)
+				ps_peer_set(state, entry, pos, (pos != state->read_next) ?
+					    PS_PEER_READ : PS_PEER_FREE);
+		} else if (mutex == &state->read_close_mutex) {
+			/* owner died closing it */
+			if (((kind == PS_PEER_READ) || (kind == PS_PEER_REAP_READ)) &&
+			    (ps_header_getflags(state, header) & PS_PACKET_HEADER_READ))
+				ps_peer_set(state, entry, pos, PS_PEER_FREE);
+		} else if (mutex == &state->write_close_mutex) {
+			if (((kind == PS_PEER_SIZED) || (kind == PS_PEER_REAP_WRITE)) &&
+			    (ps_header_getflags(state, header) & PS_PACKET_HEADER_WRITTEN))
+				ps_peer_set(state, entry, pos, PS_PEER_FREE);
+		}
+	}
+
+	if (mutex == &state->write_mutex) {
+		/* free_bytes and read_first may be half updated, recount
+		   from cursors and drop any unfinished reservation */
+		if (state->read_first + state->header_size > state->size)
+			state->read_first = state->first_pos;
+		if (state->write_next >= state->read_first)
+			used = state->write_next - state->read_first;
+		else
+			used = state->size - state->read_first + state->write_next;
+		state->free_bytes = state->size - state->header_size - state->first_pos - used;
+		memset(&buffer->buffer[state->write_next], 0, state->header_size);
+	} else if (mutex == &state->read_close_mutex) {
+		/* finish the walk the owner may have been doing */
+		pos = state->read_pos;
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		while ((pos != state->read_next) &&
+		       (ps_header_getflags(state, header) & PS_PACKET_HEADER_READ)) {
+			pos = move_pos(state, pos, ps_header_getsize(state, header));
+			header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		}
+		__PS_STORE_RELEASE(&state->read_pos, pos);
+		ps_buffer_wake(state, &state->write_waiting, &state->write_futex);
+	} else if (mutex == &state->write_close_mutex) {
+		pos = state->write_pos;
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		while ((pos != state->write_next) &&
+		       (ps_header_getflags(state, header) & PS_PACKET_HEADER_WRITTEN)) {
+			pos = move_pos(state, pos, ps_header_getsize(state, header));
+			header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		}
+		__PS_STORE_RELEASE(&state->write_pos, pos);
+		ps_buffer_wake(state, &state->read_waiting, &state->read_futex);
+	}
+}
+
+int ps_buffer_reap(ps_buffer_t *buffer)
+{
+	__PS_BUFFER(buffer)
+
+	if (!(state->flags & PS_BUFFER_ROBUST))
+		return 0;
+
+	/* packets can't be open while data area is replaced */
+	if (__atomic_load_n(&state->resizing, __ATOMIC_SEQ_CST) || ps_buffer_current(buffer))
+		return 0;
+
+	return ps_buffer_reap_peers(buffer);
+}
+
+/* close packets of dead peers, resizer calls it directly while it settles */
+static int ps_buffer_reap_peers(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_peer_s *peer;
+	ps_packet_t packet;
+	uint64_t now;
+	int i, j, pid, kind, pending, res = 0;
+
+	now = ps_buffer_utime(buffer);
+	for (i = 0; i < PS_MAX_PEERS; i++) {
+		peer = &state->peers[i];
+		pid = __PS_LOAD_ACQUIRE(&peer->pid);
+		if (!pid ||
+		    ((int64_t) (now - __atomic_load_n(&peer->heartbeat, __ATOMIC_RELAXED)) <
+		     PS_PEER_TIMEOUT_NSEC) ||
+		    !ps_peer_dead(pid))
+			continue;
+
+		pending = 0;
+		for (j = 0; j < PS_PEER_PACKETS; j++) {
+			kind = __PS_LOAD_ACQUIRE(&peer->packets[j].kind);
+
+			memset(&packet, 0, sizeof(packet));
+			packet.buffer = buffer;
+			packet.peer_entry = i * PS_PEER_PACKETS + j;
+			packet.buffer_pos = peer->packets[j].pos;
+			packet.header = &buffer->buffer[packet.buffer_pos];
+
+			switch (kind) {
+			case PS_PEER_FREE:
+				break;
+			case PS_PEER_CLAIMED:
+				/* died before it got a packet */
+				if (!__PS_CAS(&peer->packets[j].kind, &kind, PS_PEER_FREE))
+					pending = 1;
+				break;
+			case PS_PEER_READ:
+				if (!__PS_CAS(&peer->packets[j].kind, &kind, PS_PEER_REAP_READ)) {
+					pending = 1;
+					break;
+				}
+				packet.flags = PS_PACKET_READ;
+				ps_packet_closeread(&packet);
+				res++;
+				break;
+			case PS_PEER_SIZED:
+				if (!__PS_CAS(&peer->packets[j].kind, &kind, PS_PEER_REAP_WRITE)) {
+					pending = 1;
+					break;
+				}
+				packet.flags = PS_PACKET_WRITE | PS_PACKET_SIZE_SET;
+				ps_packet_closewrite(&packet);
+				res++;
+				break;
+			default:
+				/* left to repair of a mutex it held or to another reaper */
+				pending = 1;
+				break;
+			}
+		}
+
+		if (!pending)
+			__PS_CAS(&peer->pid, &pid, 0);
+	}
+
+	return res;
+}
+
+/*
+ * Sleep until *cursor reaches end, only used while other side is held off.
+ * Packets left open by dead peers would never get there, they are reaped
+ * every time the wait times out. Resizer holds write_mutex and read_mutex,
+ * reaping only needs the close mutexes.
+ */
+static void ps_buffer_settle(ps_buffer_t *buffer, int *waiting, int *futex,
+			     size_t *cursor, size_t end)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct timespec timeout = {0, 1000000};
+	int seq;
+
+	__atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		seq = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(cursor, __ATOMIC_SEQ_CST) == end)
+			break;
+		if ((ps_buffer_futex(state, futex, FUTEX_WAIT, seq, &timeout) == -1) &&
+		    (errno == ETIMEDOUT) && (state->flags & PS_BUFFER_ROBUST))
+			ps_buffer_reap_peers(buffer);
+	}
+	__atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+/* copy unread packets one after another to dest, return bytes used */
+static size_t ps_buffer_copy_live(ps_buffer_t *buffer, unsigned char *dest)
+{
+	__PS_BUFFER_VARS(buffer)
+	struct ps_packet_header_s *header;
+	size_t pos, next, offs, len, part, used = 0;
+
+	for (pos = state->read_pos; pos != state->write_next; pos = next) {
+		header = (struct ps_packet_header_s *) &buffer->buffer[pos];
+		len = ps_header_getsize(state, header);
+		next = move_pos(state, pos, len);
+
+		if (dest) {
+			memcpy(&dest[used], header, state->header_size);
+			offs = (pos + state->header_size) % state->size;
+			part = len;
+			if ((offs + len > state->size) && !(state->flags & PS_BUFFER_MIRROR))
+				part = state->size - offs;
+			memcpy(&dest[used + state->header_size], &buffer->buffer[offs], part);
+			memcpy(&dest[used + state->header_size + part], buffer->buffer, len - part);
+		}
+
+		/* same alignment at any first_pos based position */
+		used += align_pos(state, pos + state->header_size + len) - pos;
+	}
+
+	return used;
+}
+
+int ps_buffer_resize(ps_buffer_t *buffer, size_t size)
+{
+	__PS_BUFFER(buffer)
+	unsigned char *old = buffer->buffer, *live = NULL;
+	size_t old_size = state->size;
+	size_t used, huge_size = 0;
+	int backing = state->backing;
+	int ret;
+
+	if (unlikely(state->flags & (PS_BUFFER_SPSC | PS_BUFFER_MPMC | PS_BUFFER_BROADCAST)))
+		return ENOTSUP;
+	/* a SysV segment can't grow */
+	if (unlikely((state->flags & PS_BUFFER_PSHARED) && !(state->flags & PS_BUFFER_SHMFD)))
+		return ENOTSUP;
+
+#ifdef __PS_HUGEPAGES
+	if (backing != PS_BACKING_PAGES)
+		huge_size = ps_hugepage_size();
+#endif
+#ifdef __PS_MIRROR
+	if (state->flags & PS_BUFFER_MIRROR) {
+		size_t page_size = (backing == PS_BACKING_HUGETLB) ?
+				   huge_size : (size_t) sysconf(_SC_PAGESIZE);
+		size = (size + page_size - 1) & ~(page_size - 1);
+	}
+#endif
+	size &= ~(state->align - 1);
+	if (unlikely(size < state->header_size * 2 + state->align))
+		return EINVAL;
+	if (unlikely((state->flags & PS_BUFFER_COMPACT) && (size > PS_COMPACT_MAX_SIZE)))
+		return EINVAL;
+
+	/* producers first: one waiting for space holds write_mutex until
+	   consumers make room, consumers waiting for packets let go of
+	   read_mutex when they see resizing */
+	if (unlikely((ret = ps_buffer_lock(buffer, &state->write_mutex, 0))))
+		return ret;
+	__atomic_store_n(&state->resizing, 1, __ATOMIC_SEQ_CST);
+	ps_buffer_wake(state, &state->read_waiting, &state->read_futex);
+	if (unlikely((ret = ps_buffer_lock(buffer, &state->read_mutex, 0))))
+		goto out_write;
+
+	/* wait for open packets */
+	ps_buffer_settle(buffer, &state->read_waiting, &state->read_futex,
+			 &state->write_pos, state->write_next);
+	ps_buffer_settle(buffer, &state->write_waiting, &state->write_futex,
+			 &state->read_pos, state->read_next);
+
+	if (unlikely((ret = ps_buffer_lock(buffer, &state->write_close_mutex, 0))))
+		goto out_read;
+	if (unlikely((ret = ps_buffer_lock(buffer, &state->read_close_mutex, 0))))
+		goto out_write_close;
+	if (unlikely((ret = ps_buffer_current(buffer))))
+		goto out;
+	old = buffer->buffer;
+
+	used = ps_buffer_copy_live(buffer, NULL);
+	if (unlikely(state->first_pos + used + state->header_size > size)) {
+		ret = ENOBUFS;
+		goto out;
+	}
+
+#ifdef __PS_SHMFD
+	if (state->flags & PS_BUFFER_SHMFD) {
+		/* data area is replaced in place, keep packets aside */
+		size_t unit = (backing == PS_BACKING_HUGETLB) ? huge_size :
+			      (size_t) sysconf(_SC_PAGESIZE);
+		size_t len;
+
+		if (unit < state->align)
+			unit = state->align;
+		len = (state->data_offset + size + unit - 1) & ~(unit - 1);
+
+		if (unlikely(used && !(live = malloc(used)))) {
+			ret = ENOMEM;
+			goto out;
+		}
+		ps_buffer_copy_live(buffer, live);
+
+		if ((size > old_size) && unlikely(ftruncate(buffer->shmfd, len))) {
+			ret = errno;
+			goto out;
+		}
+		if (unlikely((ret = ps_buffer_map_shmfd_data(buffer, buffer->shmfd, state->data_offset,
+							     size, state->flags & PS_BUFFER_MIRROR,
+							     (backing == PS_BACKING_HUGETLB) ?
+							     huge_size : 0))))
+			goto out;
+#ifdef __PS_NUMA
+		if ((state->numa_request != PS_NUMA_DEFAULT) &&
+		    unlikely((ret = ps_buffer_mbind_shmfd_data(buffer->buffer, size,
+							       state->flags & PS_BUFFER_MIRROR,
+							       backing, state->numa_request)))) {
+			ps_buffer_unmap_shmfd_data(buffer->buffer, size,
+						   state->flags & PS_BUFFER_MIRROR, backing);
+			buffer->buffer = old;
+			buffer->size = old_size;
+			goto out;
+		}
+#endif
+		if (used)
+			memcpy(&buffer->buffer[state->first_pos], live, used);
+
+		ps_buffer_unmap_shmfd_data(old, old_size, state->flags & PS_BUFFER_MIRROR, backing);
+		/* shrinking the file only gives pages back, failure is harmless */
+		if ((size < old_size) && unlikely(ftruncate(buffer->shmfd, len)))
+			ret = 0;
+	} else
+#endif
+	{
+		unsigned char *data;
+
+		if (backing != PS_BACKING_HUGETLB)
+			backing = PS_BACKING_PAGES;
+		if (unlikely((ret = ps_buffer_alloc_data(buffer, state->flags, size, state->align,
+							 huge_size, &backing)))) {
+			buffer->buffer = old;
+			goto out;
+		}
+		data = buffer->buffer;
+		buffer->buffer = old;
+#ifdef __PS_NUMA
+		if ((state->numa_request != PS_NUMA_DEFAULT) &&
+		    unlikely((ret = ps_buffer_mbind(data, size, state->numa_request)))) {
+			ps_buffer_free_data(data, state->flags, size, backing);
+			goto out;
+		}
+#endif
+		ps_buffer_copy_live(buffer, &data[state->first_pos]);
+		ps_buffer_free_data(old, state->flags, old_size, state->backing);
+		buffer->buffer = data;
+		buffer->size = size;
+		state->backing = backing;
+	}
+
+	state->size = size;
+	state->read_first = state->read_pos = state->read_next = state->first_pos;
+	state->write_pos = state->write_next = state->write_pos_cache = state->first_pos + used;
+	state->free_bytes = size - state->header_size - state->first_pos - used;
+	memset(&buffer->buffer[state->write_next], 0, state->header_size);
+
+	__PS_STORE_RELEASE(&state->generation, state->generation + 1);
+	__PS_STORE_RELEASE(&buffer->generation, state->generation);
+
+out:
+	free(live);
+	ps_buffer_unlock(buffer, &state->read_close_mutex);
+out_write_close:
+	ps_buffer_unlock(buffer, &state->write_close_mutex);
+out_read:
+	ps_buffer_unlock(buffer, &state->read_mutex);
+out_write:
+	__atomic_store_n(&state->resizing, 0, __ATOMIC_SEQ_CST);
+	ps_buffer_futex(state, &state->resizing, FUTEX_WAKE, INT_MAX, NULL);
+	ps_buffer_unlock(buffer, &state->write_mutex);
+
+	return ret;
+}
+
+/* replace data area mapping of this process after ps_buffer_resize() */
+int ps_buffer_remap(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	int ret = 0, busy = 0;
+
+#ifdef __PS_SHMFD
+	if (!(state->flags & PS_BUFFER_SHMFD)) {
+#endif
+		/* same buffer object did it */
+		__PS_STORE_RELEASE(&buffer->generation, state->generation);
+		return 0;
+#ifdef __PS_SHMFD
+	}
+
+	/* another thread of this process may be at it */
+	if (!__PS_CAS(&buffer->remapping, &busy, 1)) {
+		while (__PS_LOAD_ACQUIRE(&buffer->remapping))
+			sched_yield();
+		return ps_buffer_current(buffer);
+	}
+
+	if (buffer->generation != state->generation) {
+		unsigned char *old = buffer->buffer;
+		size_t old_size = buffer->size;
+
+		if (!(ret = ps_buffer_map_shmfd_data(buffer, buffer->shmfd, state->data_offset,
+						     state->size, state->flags & PS_BUFFER_MIRROR,
+						     (state->backing == PS_BACKING_HUGETLB) ?
+						     ps_hugepage_size() : 0))) {
+			ps_buffer_unmap_shmfd_data(old, old_size, state->flags & PS_BUFFER_MIRROR,
+						   state->backing);
+			__PS_STORE_RELEASE(&buffer->generation, state->generation);
+		}
+	}
+	__PS_STORE_RELEASE(&buffer->remapping, 0);
+
+	return ret;
+#endif
+}
+
+void ps_buffer_wait_resize(struct ps_state_s *state)
+{
+	int resizing;
+
+	while ((resizing = __atomic_load_n(&state->resizing, __ATOMIC_SEQ_CST)))
+		ps_buffer_futex(state, &state->resizing, FUTEX_WAIT, resizing, NULL);
+}
+
+int ps_buffer_cancel(ps_buffer_t *buffer)
+{
+	__PS_BUFFER(buffer)
+
+	__atomic_or_fetch(&state->flags, PS_BUFFER_CANCELLED, __ATOMIC_SEQ_CST);
+
+	/* waiters check PS_BUFFER_CANCELLED once woken */
+	__atomic_add_fetch(&state->read_futex, 1, __ATOMIC_SEQ_CST);
+	ps_buffer_futex(state, &state->read_futex, FUTEX_WAKE, INT_MAX, NULL);
+	__atomic_add_fetch(&state->write_futex, 1, __ATOMIC_SEQ_CST);
+	ps_buffer_futex(state, &state->write_futex, FUTEX_WAKE, INT_MAX, NULL);
+
+	if (state->flags & (PS_BUFFER_SPSC | PS_BUFFER_MPMC))
+		return 0;
+
+	ps_buffer_unlock(buffer, &state->read_mutex);
+	ps_buffer_unlock(buffer, &state->write_mutex);
+
+	return 0;
+}
+
+int ps_buffer_check(ps_buffer_t *buffer)
+{
+	if (unlikely(buffer == NULL))
+		return EINVAL;
+
+	if (unlikely(!(((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_READY)))
+		return EINVAL;
+
+	if (unlikely(((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_CANCELLED))
+		return EINTR;
+
+	return 0;
+}
+
+int ps_packet_check(ps_packet_t *packet)
+{
+	int ret;
+
+	if (unlikely(packet == NULL))
+		return EINVAL;
+
+	if (unlikely(!((packet->flags & PS_PACKET_READ) || (packet->flags & PS_PACKET_WRITE))))
+		return EINVAL;
+
+	if ((ret = ps_buffer_check(packet->buffer)))
+		return ret;
+
+	return 0;
+}
+
+int ps_bufferattr_init(ps_bufferattr_t *attr)
+{
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	attr->shmid = PS_SHM_CREATE;
+	attr->size = PS_DEFAULT_SIZE;
+	attr->flags = 0;
+	attr->shmmode = 0600;
+	attr->align = PS_DEFAULT_ALIGN;
+	attr->hugepages = 0;
+	attr->numa_node = PS_NUMA_DEFAULT;
+	attr->shmname = NULL;
+	attr->shmfd = -1;
+	attr->fake_dma_limit = 0;
+	attr->groups = 1;
+	attr->sample_interval = PS_DEFAULT_SAMPLE_INTERVAL;
+
+	return 0;
+}
+
+int ps_bufferattr_destroy(ps_bufferattr_t *attr)
+{
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	memset(attr, 0, sizeof(ps_bufferattr_t));
+
+	return 0;
+}
+
+int ps_bufferattr_setsize(ps_bufferattr_t *attr, size_t size)
+{
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	if (unlikely(size < sizeof(struct ps_packet_header_s) * 2))
+		return EINVAL;
+
+	attr->size = size;
+
+	return 0;
+}
+
+int ps_bufferattr_setflags(ps_bufferattr_t *attr, ps_flags_t flags)
+{
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	if (unlikely((flags & PS_BUFFER_READY) || (flags & PS_BUFFER_CANCELLED)))
+		return EINVAL;
+
+#ifndef __PS_SHM
+	if (flags & PS_BUFFER_PSHARED)
+		return ENOTSUP;
+#endif
+
+#ifndef __PS_STATS
+	if (flags & PS_BUFFFER_STATS)
+		return ENOTSUP;
+#endif
+
+#ifndef __PS_MIRROR
+	if (flags & PS_BUFFER_MIRROR)
+		return ENOTSUP;
+#endif
+
+#ifndef __PS_SHMFD
+	if (flags & PS_BUFFER_SHMFD)
+		return ENOTSUP;
+#endif
+
+	if (unlikely((flags & PS_BUFFER_SHMFD) && !(flags & PS_BUFFER_PSHARED)))
+		return EINVAL;
+
+	/* SysV shm segment can't be mapped twice around state and stats */
+	if (unlikely((flags & PS_BUFFER_MIRROR) && (flags & PS_BUFFER_PSHARED) &&
+		     !(flags & PS_BUFFER_SHMFD)))
+		return ENOTSUP;
+
+	/* MPMC header carries a commit word that doesn't fit in 4 bytes */
+	if (unlikely((flags & PS_BUFFER_COMPACT) && (flags & PS_BUFFER_MPMC)))
+		return EINVAL;
+
+	if (unlikely((flags & PS_BUFFER_SPSC) && (flags & PS_BUFFER_MPMC)))
+		return EINVAL;
 
-	if (offs + size <= state->size) {
-		/* real stuff */
-		if ((!(packet->flags & PS_PACKET_SIZE_SET)) && (packet->flags & PS_PACKET_WRITE)) {
-			if ((ret = ps_packet_reserve(packet, packet->pos + size)))
-				return ret;
-		}
-		*mem = &buffer->buffer[offs];
+#ifndef __PS_ROBUST
+	if (flags & PS_BUFFER_ROBUST)
+		return ENOTSUP;
+#endif
 
-		packet->pos += size;
-		if ((!(packet->flags & PS_PACKET_SIZE_SET)) &&
-		    (packet->flags & PS_PACKET_WRITE) && (packet->pos > header->size))
-			header->size = packet->pos;
+	/* peers are only tracked on the mutex based paths, the 4-byte header
+	   has no room for PS_PACKET_HEADER_CANCELLED */
+	if (unlikely((flags & PS_BUFFER_ROBUST) &&
+		     (!(flags & PS_BUFFER_PSHARED) ||
+		      (flags & (PS_BUFFER_SPSC | PS_BUFFER_MPMC | PS_BUFFER_COMPACT)))))
+		return EINVAL;
 
-		return 0;
-	}
+	/* group cursors use read mutexes, group marks don't fit in the
+	   4-byte header and dead peers' packets are not marked per group */
+	if (unlikely((flags & PS_BUFFER_BROADCAST) &&
+		     (flags & (PS_BUFFER_SPSC | PS_BUFFER_MPMC | PS_BUFFER_COMPACT |
+			       PS_BUFFER_ROBUST))))
+		return EINVAL;
 
-	if (!(flags & PS_ACCEPT_FAKE_DMA))
-		return EAGAIN;
+#ifndef __PS_STATS
+	if (flags & (PS_BUFFER_LATENCY | PS_BUFFER_LOCKSTATS | PS_BUFFER_OCCUPANCY))
+		return ENOTSUP;
+#endif
 
-	/* we can't give real so lets fake it */
-	if ((!(packet->flags & PS_PACKET_SIZE_SET)) && (packet->flags & PS_PACKET_WRITE)) {
-		if ((ret = ps_packet_reserve(packet, packet->pos + size)))
-			return ret;
-	}
+	if (unlikely((flags & (PS_BUFFER_LOCKSTATS | PS_BUFFER_OCCUPANCY)) &&
+		     !(flags & PS_BUFFER_STATS)))
+		return EINVAL;
 
-	if ((ret = ps_packet_fakedma_alloc(packet, &fake_dma, size)))
-		return ret;
+	/* time stamp goes after the header, 4-byte headers stay 4 bytes */
+	if (unlikely((flags & PS_BUFFER_LATENCY) &&
+		     (!(flags & PS_BUFFER_STATS) || (flags & PS_BUFFER_COMPACT))))
+		return EINVAL;
 
-	fake_dma->size = size;
-	fake_dma->pos = packet->pos;
+	attr->flags = flags;
 
-	if (packet->flags & PS_PACKET_READ) {
-		if ((ret = ps_packet_read(packet, fake_dma->mem, size))) {
-			ps_packet_fakedma_free(packet, fake_dma);
-			return ret;
-		}
-	}
+	return 0;
+}
 
-	*mem = fake_dma->mem;
+int ps_bufferattr_setshmid(ps_bufferattr_t *attr, int id)
+{
+#ifdef __PS_SHM
+	if (unlikely(attr == NULL))
+		return EINVAL;
 
-	packet->pos += size;
-	if ((!(packet->flags & PS_PACKET_SIZE_SET)) &&
-	    (packet->flags & PS_PACKET_WRITE) && (packet->pos > header->size))
-		header->size = packet->pos;
+	attr->shmid = id;
 
 	return 0;
+#else
+	return ENOTSUP;
+#endif
 }
 
-int ps_packet_tell(ps_packet_t *packet, size_t *pos)
+int ps_bufferattr_setshmmode(ps_bufferattr_t *attr, int mode)
 {
-	__PS_PACKET_CHECK(packet)
-	return packet->pos;
+#ifdef __PS_SHM
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	attr->shmmode = mode;
+
+	return 0;
+#else
+	return ENOTSUP;
+#endif
 }
 
-int ps_packet_seek(ps_packet_t *packet, size_t pos)
+int ps_bufferattr_setalign(ps_bufferattr_t *attr, size_t align)
 {
-	int ret;
-	__PS_PACKET(packet)
+	if (unlikely(attr == NULL))
+		return EINVAL;
 
-	if ((packet->flags & PS_PACKET_SIZE_SET) || (packet->flags & PS_PACKET_READ)) {
-		if (unlikely(pos > header->size))
-			return EINVAL;
-	}
+	if (unlikely((!align) || (align & (align - 1))))
+		return EINVAL;
 
-	if ((!(packet->flags & PS_PACKET_SIZE_SET)) && (packet->flags & PS_PACKET_WRITE)) {
-		if (unlikely(pos + sizeof(struct ps_packet_header_s) > state->size))
-			return EINVAL;
+	attr->align = align;
 
-		if ((ret = ps_packet_reserve(packet, pos)))
-			return ret;
-	}
+	return 0;
+}
 
-	packet->pos = pos;
-	if ((!(packet->flags & PS_PACKET_SIZE_SET)) &&
-	    (packet->flags & PS_PACKET_WRITE) && (packet->pos > header->size))
-		header->size = packet->pos;
+int ps_bufferattr_sethugepages(ps_bufferattr_t *attr, int hugepages)
+{
+#ifdef __PS_HUGEPAGES
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	attr->hugepages = hugepages;
 
 	return 0;
+#else
+	return ENOTSUP;
+#endif
 }
 
-int ps_packet_fakedma_alloc(ps_packet_t *packet, struct ps_fake_dma_s **fake_dma, size_t size)
+int ps_bufferattr_setshmname(ps_bufferattr_t *attr, const char *name)
 {
-	struct ps_fake_dma_s *find = (struct ps_fake_dma_s *) packet->fake_dma;
-	while (find != NULL) {
-		if (find->free)
-			break;
-		find = find->next;
-	}
+#ifdef __PS_SHMFD
+	if (unlikely((attr == NULL) || (name == NULL)))
+		return EINVAL;
 
-	if (!find) {
-		if (unlikely(!(find = (struct ps_fake_dma_s *)calloc(1,sizeof(struct ps_fake_dma_s)))))
-			return ENOMEM;
+	attr->shmname = name;
 
-		find->free = 1;
-		find->next = packet->fake_dma;
-		packet->fake_dma = find;
-	}
+	return 0;
+#else
+	return ENOTSUP;
+#endif
+}
 
-	if (find->mem_size < size) {
-		find->mem_size = size;
-		if (find->mem)
-			find->mem = realloc(find->mem, find->mem_size);
-		else
-			find->mem = malloc(find->mem_size);
-	}
+int ps_bufferattr_setshmfd(ps_bufferattr_t *attr, int fd)
+{
+#ifdef __PS_SHMFD
+	if (unlikely(attr == NULL))
+		return EINVAL;
 
-	if (unlikely(!find->mem))
-		return ENOMEM;
+	attr->shmfd = fd;
 
-	find->free = 0;
-	find->size = size;
-	*fake_dma = find;
 	return 0;
+#else
+	return ENOTSUP;
+#endif
 }
 
-int ps_packet_fakedma_free(ps_packet_t *packet, struct ps_fake_dma_s *fake_dma)
+int ps_bufferattr_setnumanode(ps_bufferattr_t *attr, int node)
 {
-	fake_dma->free = 1;
+#ifdef __PS_NUMA
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	if (unlikely((node < PS_NUMA_INTERLEAVE) || (node >= 1024)))
+		return EINVAL;
+
+	attr->numa_node = node;
+
 	return 0;
+#else
+	return ENOTSUP;
+#endif
 }
 
-int ps_packet_fakedma_commitall(ps_packet_t *packet)
+int ps_bufferattr_setfakedmalimit(ps_bufferattr_t *attr, size_t limit)
 {
-	int ret;
-	struct ps_fake_dma_s *fake_dma, *del;
+	if (unlikely(attr == NULL))
+		return EINVAL;
 
-	fake_dma = (struct ps_fake_dma_s *) packet->fake_dma;
-	while (fake_dma != NULL) {
+	attr->fake_dma_limit = limit;
 
-		del = fake_dma;
-		fake_dma = (struct ps_fake_dma_s *) fake_dma->next;
+	return 0;
+}
 
-		if (!del->free) {
-			if (unlikely((ret = ps_packet_seek(packet, del->pos))))
-				return ret;
-			if (unlikely((ret = ps_packet_write(packet, del->mem, del->size))))
-				return ret;
-			ps_packet_fakedma_free(packet, del);
-		}
-	}
+int ps_bufferattr_setgroups(ps_bufferattr_t *attr, int groups)
+{
+	if (unlikely(attr == NULL))
+		return EINVAL;
+
+	if (unlikely((groups < 1) || (groups > PS_MAX_GROUPS)))
+		return EINVAL;
+
+	attr->groups = groups;
 
 	return 0;
 }
 
-int ps_packet_fakedma_cut(ps_packet_t *packet, size_t size)
+int ps_bufferattr_setsampleinterval(ps_bufferattr_t *attr, uint64_t nsec)
 {
-	struct ps_fake_dma_s *fake_dma = (struct ps_fake_dma_s *) packet->fake_dma;
+	if (unlikely(attr == NULL))
+		return EINVAL;
 
-	while (fake_dma != NULL) {
-		if (fake_dma->pos > size)
-			ps_packet_fakedma_free(packet, fake_dma);
-		else if (fake_dma->pos + fake_dma->size > size)
-			fake_dma->size = size - fake_dma->pos;
+	if (unlikely(!nsec))
+		return EINVAL;
+
+	attr->sample_interval = nsec;
 
-		fake_dma = fake_dma->next;
-	}
 	return 0;
 }
 
-int ps_packet_fakedma_freeall(ps_packet_t *packet)
+uint64_t ps_buffer_utime(ps_buffer_t *buffer)
 {
-	struct ps_fake_dma_s *fake_dma, *del;
+#ifdef __PS_STATS
+	__PS_BUFFER_VARS(buffer)
+	struct timespec ts;
 
-	fake_dma = (struct ps_fake_dma_s *) packet->fake_dma;
-	while (fake_dma != NULL) {
-		del = fake_dma;
-		fake_dma = (struct ps_fake_dma_s *) fake_dma->next;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	ts.tv_sec  -= state->create_time.tv_sec;
+	ts.tv_nsec -= state->create_time.tv_nsec;
 
-		if (!del->free)
-			ps_packet_fakedma_free(packet, del);
+	if (ts.tv_nsec < 0) {
+		ts.tv_sec--;
+		ts.tv_nsec += 1000000000;
 	}
 
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#else
 	return 0;
+#endif
 }
 
-int ps_buffer_getshmid(ps_buffer_t *buffer, int *shmid)
+
+/* bucket of value, see ps_histogram_t */
+static inline int ps_histogram_bucket(uint64_t nsec)
 {
-	__PS_BUFFER_CHECK(buffer)
-	*shmid = buffer->shmid;
-	return 0;
+	int msb;
+
+	if (nsec < PS_HISTOGRAM_SUB_BUCKETS)
+		return (int) nsec;
+
+	msb = 63 - __builtin_clzll(nsec);
+	if (msb >= 40)
+		return PS_HISTOGRAM_BUCKETS - 1;
+
+	/* 16 buckets per power of two, 4 bits below msb pick one */
+	return (msb - 3) * PS_HISTOGRAM_SUB_BUCKETS +
+	       (int) ((nsec >> (msb - 4)) & (PS_HISTOGRAM_SUB_BUCKETS - 1));
 }
 
-int ps_buffer_cancel(ps_buffer_t *buffer)
+/* largest value of bucket */
+static inline uint64_t ps_histogram_bucket_max(int bucket)
 {
-	__PS_BUFFER(buffer)
+	int msb;
 
-	state->flags |= PS_BUFFER_CANCELLED;
+	if (bucket < PS_HISTOGRAM_SUB_BUCKETS)
+		return bucket;
 
-	sem_post(&state->read_packets);
-	sem_post(&state->written_packets);
+	msb = bucket / PS_HISTOGRAM_SUB_BUCKETS + 3;
+	return (((uint64_t) (PS_HISTOGRAM_SUB_BUCKETS + bucket % PS_HISTOGRAM_SUB_BUCKETS + 1))
+		<< (msb - 4)) - 1;
+}
+
+/* histograms are shared by every thread and process */
+void ps_histogram_add(ps_histogram_t *hist, uint64_t nsec)
+{
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
 
-	pthread_mutex_unlock(&state->read_mutex);
-	pthread_mutex_unlock(&state->write_mutex);
+	__atomic_add_fetch(&hist->bucket[ps_histogram_bucket(nsec)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->sum, nsec, __ATOMIC_RELAXED);
 
-	return 0;
+	while ((nsec > max) &&
+	       !__atomic_compare_exchange_n(&hist->max, &max, nsec, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-int ps_buffer_check(ps_buffer_t *buffer)
+void ps_buffer_read_waited(ps_buffer_t *buffer, uint64_t start)
 {
-	if (unlikely(buffer == NULL))
-		return EINVAL;
+	uint64_t nsec = ps_buffer_utime(buffer) - start;
 
-	if (unlikely(!(((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_READY)))
-		return EINVAL;
+	__PS_STATS_ADD(buffer, read_wait_nsec, nsec);
+	if (((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_LATENCY)
+		ps_histogram_add(&__PS_HISTOGRAMS(buffer)->open_wait, nsec);
+}
 
-	if (unlikely(((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_CANCELLED))
-		return EINTR;
+void ps_buffer_write_waited(ps_buffer_t *buffer, uint64_t start)
+{
+	uint64_t nsec = ps_buffer_utime(buffer) - start;
 
-	return 0;
+	__PS_STATS_ADD(buffer, write_wait_nsec, nsec);
+	if (((struct ps_state_s *) buffer->state)->flags & PS_BUFFER_LATENCY)
+		ps_histogram_add(&__PS_HISTOGRAMS(buffer)->reserve_wait, nsec);
 }
 
-int ps_packet_check(ps_packet_t *packet)
+/* profile and hold start of a buffer mutex, group mutexes count as read_mutex */
+static ps_lockstats_t *ps_buffer_lockstats(ps_buffer_t *buffer, pthread_mutex_t *mutex,
+					   uint64_t **since)
 {
-	int ret;
+	__PS_BUFFER_VARS(buffer)
+	struct ps_group_s *group;
 
-	if (unlikely(packet == NULL))
-		return EINVAL;
+	if (mutex == &state->read_mutex) {
+		*since = &state->read_mutex_since;
+		return &buffer->stats->read_mutex;
+	}
+	if (mutex == &state->write_mutex) {
+		*since = &state->write_mutex_since;
+		return &buffer->stats->write_mutex;
+	}
+	if (mutex == &state->read_close_mutex) {
+		*since = &state->read_close_mutex_since;
+		return &buffer->stats->read_close_mutex;
+	}
+	if (mutex == &state->write_close_mutex) {
+		*since = &state->write_close_mutex_since;
+		return &buffer->stats->write_close_mutex;
+	}
+	for (group = state->group; group < &state->group[PS_MAX_GROUPS]; group++) {
+		if (mutex == &group->read_mutex) {
+			*since = &group->read_mutex_since;
+			return &buffer->stats->read_mutex;
+		}
+	}
+	return NULL;
+}
 
-	if (unlikely(!((packet->flags & PS_PACKET_READ) || (packet->flags & PS_PACKET_WRITE))))
-		return EINVAL;
+/* ps_buffer_lock() which tells waits apart from free acquisitions */
+int ps_buffer_lock_profiled(ps_buffer_t *buffer, pthread_mutex_t *mutex, int try)
+{
+	ps_lockstats_t *lockstats;
+	uint64_t *since, wait = 0;
+	int ret, contended = 0;
+
+	ret = pthread_mutex_trylock(mutex);
+	if ((ret == EBUSY) && !try) {
+		contended = 1;
+		wait = ps_buffer_utime(buffer);
+		ret = pthread_mutex_lock(mutex);
+		wait = ps_buffer_utime(buffer) - wait;
+	}
 
-	if ((ret = ps_buffer_check(packet->buffer)))
+#ifdef __PS_ROBUST
+	if (unlikely(ret == EOWNERDEAD)) {
+		ps_buffer_repair(buffer, mutex);
+		pthread_mutex_consistent(mutex);
+		ret = 0;
+	}
+#endif
+	if (ret || !(lockstats = ps_buffer_lockstats(buffer, mutex, &since)))
 		return ret;
 
+	/* holder is alone to write since */
+	*since = ps_buffer_utime(buffer);
+	__atomic_add_fetch(&lockstats->acquisitions, 1, __ATOMIC_RELAXED);
+	if (contended) {
+		__atomic_add_fetch(&lockstats->contended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&lockstats->wait_nsec, wait, __ATOMIC_RELAXED);
+	}
+
 	return 0;
 }
 
-int ps_bufferattr_init(ps_bufferattr_t *attr)
+void ps_buffer_unlock_profiled(ps_buffer_t *buffer, pthread_mutex_t *mutex)
 {
-	if (unlikely(attr == NULL))
-		return EINVAL;
-
-	attr->shmid = PS_SHM_CREATE;
-	attr->size = PS_DEFAULT_SIZE;
-	attr->flags = 0;
-	attr->shmmode = 0600;
+	ps_lockstats_t *lockstats;
+	uint64_t *since, hold, max;
+
+	if ((lockstats = ps_buffer_lockstats(buffer, mutex, &since))) {
+		hold = ps_buffer_utime(buffer) - *since;
+		max = __atomic_load_n(&lockstats->max_hold_nsec, __ATOMIC_RELAXED);
+		while ((hold > max) &&
+		       !__atomic_compare_exchange_n(&lockstats->max_hold_nsec, &max, hold, 1,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
 
-	return 0;
+	pthread_mutex_unlock(mutex);
 }
 
-int ps_bufferattr_destroy(ps_bufferattr_t *attr)
+int ps_histogram_percentile(ps_histogram_t *hist, double percentile, uint64_t *nsec)
 {
-	if (unlikely(attr == NULL))
+	uint64_t total = 0, rank, seen = 0;
+	int i;
+
+	if (unlikely((hist == NULL) || (nsec == NULL) ||
+		     !(percentile >= 0.0) || (percentile > 100.0)))
 		return EINVAL;
 
-	memset(attr, 0, sizeof(ps_bufferattr_t));
+	/* buckets of a live histogram may not add up to count */
+	for (i = 0; i < PS_HISTOGRAM_BUCKETS; i++)
+		total += hist->bucket[i];
+
+	*nsec = 0;
+	if (!total)
+		return 0;
+
+	rank = (uint64_t) (percentile / 100.0 * (double) total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > total)
+		rank = total;
 
+	for (i = 0; i < PS_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	*nsec = ps_histogram_bucket_max(i);
+	if (*nsec > hist->max)
+		*nsec = hist->max;
 	return 0;
 }
 
-int ps_bufferattr_setsize(ps_bufferattr_t *attr, size_t size)
+void ps_histogram_summary(ps_histogram_t *hist, ps_latency_t *latency)
 {
-	if (unlikely(attr == NULL))
-		return EINVAL;
-
-	if (unlikely(size < sizeof(struct ps_packet_header_s) * 2))
-		return EINVAL;
+	latency->count = hist->count;
+	latency->max = hist->max;
+	ps_histogram_percentile(hist, 50.0, &latency->p50);
+	ps_histogram_percentile(hist, 99.0, &latency->p99);
+	ps_histogram_percentile(hist, 99.9, &latency->p999);
+}
 
-	attr->size = size;
+/* bytes between read_pos and write_pos, read_pos first so it is not ahead */
+static size_t ps_buffer_in_flight(struct ps_state_s *state)
+{
+	size_t read_pos = __PS_LOAD_ACQUIRE(&state->read_pos);
+	size_t write_pos = __PS_LOAD_ACQUIRE(&state->write_pos);
 
-	return 0;
+	if (state->flags & PS_BUFFER_MPMC)
+		return write_pos - read_pos;
+	return (write_pos + state->size - read_pos) % state->size;
 }
 
-int ps_bufferattr_setflags(ps_bufferattr_t *attr, ps_flags_t flags)
+/* bytes between read_first and read_pos, nothing to reclaim with MPMC */
+static size_t ps_buffer_pending_free(struct ps_state_s *state)
 {
-	if (unlikely(attr == NULL))
-		return EINVAL;
+	size_t read_first = __PS_LOAD_ACQUIRE(&state->read_first);
+	size_t read_pos = __PS_LOAD_ACQUIRE(&state->read_pos);
 
-	if (unlikely((flags & PS_BUFFER_READY) || (flags & PS_BUFFER_CANCELLED)))
-		return EINVAL;
+	if (state->flags & PS_BUFFER_MPMC)
+		return 0;
+	return (read_pos + state->size - read_first) % state->size;
+}
 
-#ifndef __PS_SHM
-	if (flags & PS_BUFFER_PSHARED)
-		return ENOTSUP;
-#endif
+static inline void ps_stats_max(size_t *max, size_t val)
+{
+	size_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
 
-#ifndef __PS_STATS
-	if (flags & PS_BUFFFER_STATS)
-		return ENOTSUP;
-#endif
+	while ((val > old) &&
+	       !__atomic_compare_exchange_n(max, &old, val, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-	attr->flags = flags;
+static inline double ps_sample_rate(ps_sample_t *last, double rate, size_t delta, double secs)
+{
+	if (last == NULL)
+		return (double) delta / secs;
+	return rate + ((double) delta / secs - rate) / 8.0;
+}
 
-	return 0;
+/* closer which moves next_sample to -1 takes the sample, others go on */
+static void ps_buffer_sample(ps_buffer_t *buffer)
+{
+	__PS_BUFFER_VARS(buffer)
+	ps_occupancy_t *occupancy = __PS_OCCUPANCY(buffer);
+	uint64_t now = ps_buffer_utime(buffer);
+	uint64_t next = __atomic_load_n(&state->next_sample, __ATOMIC_RELAXED);
+	ps_sample_t *sample, *last = NULL;
+	ps_stats_t stats;
+	double secs;
+	long packets;
+
+	if ((now < next) || !__PS_CAS(&state->next_sample, &next, (uint64_t) -1))
+		return;
+
+	ps_stats_collect(buffer, &stats);
+	secs = (double) (now - state->last_sample) / 1000000000.0;
+	if (occupancy->samples)
+		last = &occupancy->sample[(occupancy->samples - 1) % PS_SAMPLES];
+
+	sample = &occupancy->sample[occupancy->samples % PS_SAMPLES];
+	sample->utime = now;
+	packets = __atomic_load_n(&state->packets, __ATOMIC_RELAXED);
+	sample->packets_in_flight = packets > 0 ? packets : 0;
+	sample->bytes_in_flight = ps_buffer_in_flight(state);
+	sample->pending_free_bytes = ps_buffer_pending_free(state);
+	sample->written_packets_rate = ps_sample_rate(last, last ? last->written_packets_rate : 0,
+						      stats.written_packets - state->last_written_packets, secs);
+	sample->written_bytes_rate = ps_sample_rate(last, last ? last->written_bytes_rate : 0,
+						    stats.written_bytes - state->last_written_bytes, secs);
+	sample->read_packets_rate = ps_sample_rate(last, last ? last->read_packets_rate : 0,
+						   stats.read_packets - state->last_read_packets, secs);
+	sample->read_bytes_rate = ps_sample_rate(last, last ? last->read_bytes_rate : 0,
+						 stats.read_bytes - state->last_read_bytes, secs);
+	__atomic_store_n(&occupancy->samples, occupancy->samples + 1, __ATOMIC_RELEASE);
+
+	state->last_sample = now;
+	state->last_written_packets = stats.written_packets;
+	state->last_written_bytes = stats.written_bytes;
+	state->last_read_packets = stats.read_packets;
+	state->last_read_bytes = stats.read_bytes;
+	__atomic_store_n(&state->next_sample, now + state->sample_interval, __ATOMIC_RELEASE);
 }
 
-int ps_bufferattr_setshmid(ps_bufferattr_t *attr, int id)
+void ps_buffer_occupancy_written(ps_buffer_t *buffer, size_t size)
 {
-#ifdef __PS_SHM
-	if (unlikely(attr == NULL))
-		return EINVAL;
+	__PS_BUFFER_VARS(buffer)
+	ps_occupancy_t *occupancy = __PS_OCCUPANCY(buffer);
+	long packets = __atomic_add_fetch(&state->packets, 1, __ATOMIC_RELAXED);
+	int bucket = size ? 63 - __builtin_clzll(size) : 0;
+
+	if (bucket >= PS_SIZE_BUCKETS)
+		bucket = PS_SIZE_BUCKETS - 1;
+	__atomic_add_fetch(&occupancy->sizes[bucket], 1, __ATOMIC_RELAXED);
+
+	/* a reader may have closed it before we counted it */
+	if (packets > 0)
+		ps_stats_max(&buffer->stats->max_packets_in_flight, packets);
+	ps_stats_max(&buffer->stats->max_bytes_in_flight, ps_buffer_in_flight(state));
+	ps_buffer_sample(buffer);
+}
 
-	attr->shmid = id;
+void ps_buffer_occupancy_read(ps_buffer_t *buffer, size_t count)
+{
+	__PS_BUFFER_VARS(buffer)
 
-	return 0;
-#else
-	return ENOTSUP;
-#endif
+	if (count)
+		__atomic_sub_fetch(&state->packets, count, __ATOMIC_RELAXED);
+	ps_stats_max(&buffer->stats->max_pending_free_bytes, ps_buffer_pending_free(state));
+	ps_buffer_sample(buffer);
 }
 
-int ps_bufferattr_setshmmode(ps_bufferattr_t *attr, int mode)
+int ps_buffer_occupancy(ps_buffer_t *buffer, ps_occupancy_t *occupancy)
 {
-#ifdef __PS_SHM
-	if (unlikely(attr == NULL))
+	__PS_BUFFER_CHECK(buffer)
+	__PS_BUFFER_VARS(buffer)
+
+	if (unlikely(occupancy == NULL))
 		return EINVAL;
 
-	attr->shmmode = mode;
+	if (unlikely(!(state->flags & PS_BUFFER_OCCUPANCY)))
+		return ENOTSUP;
+
+	occupancy->samples = __atomic_load_n(&__PS_OCCUPANCY(buffer)->samples, __ATOMIC_ACQUIRE);
+	memcpy(occupancy->sample, __PS_OCCUPANCY(buffer)->sample, sizeof(occupancy->sample));
+	memcpy(occupancy->sizes, __PS_OCCUPANCY(buffer)->sizes, sizeof(occupancy->sizes));
 
 	return 0;
-#else
-	return ENOTSUP;
-#endif
 }
 
-uint64_t ps_buffer_utime(ps_buffer_t *buffer)
+int ps_buffer_histograms(ps_buffer_t *buffer, ps_histograms_t *hist)
 {
-#ifdef __PS_STATS
+	__PS_BUFFER_CHECK(buffer)
 	__PS_BUFFER_VARS(buffer)
-	struct timespec ts;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (unlikely(hist == NULL))
+		return EINVAL;
 
-	ts.tv_sec  -= state->create_time.tv_sec;
-	ts.tv_nsec -= state->create_time.tv_nsec;
+	if (unlikely(!(state->flags & PS_BUFFER_LATENCY)))
+		return ENOTSUP;
 
-	if (ts.tv_nsec < 0) {
-		ts.tv_sec--;
-		ts.tv_nsec += 1000000000;
-	}
+	memcpy(hist, __PS_HISTOGRAMS(buffer), sizeof(ps_histograms_t));
 
-	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
-#else
 	return 0;
-#endif
 }
 
+static void ps_stats_text_latency(const char *name, ps_latency_t *latency, FILE *stream)
+{
+	fprintf(stream, "   %-10s: p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64
+		" ns, max %" PRIu64 " ns (%" PRIu64 ")\n", name, latency->p50, latency->p99,
+		latency->p999, latency->max, latency->count);
+}
+
+static void ps_stats_text_lock(const char *name, ps_lockstats_t *lock, FILE *stream)
+{
+	fprintf(stream, "   %-10s: %" PRIu64 " taken, %" PRIu64 " contended, waited %" PRIu64
+		" ns, max hold %" PRIu64 " ns\n", name, lock->acquisitions, lock->contended,
+		lock->wait_nsec, lock->max_hold_nsec);
+}
 
 void ps_stats_text_hbytes(size_t bytes, FILE *stream)
 {
@@ -1231,13 +5318,808 @@ int ps_stats_text(ps_stats_t *stats, FILE *stream)
 	ps_stats_text_hnum(stats->written_packets, stream);
 	fprintf(stream, "   bytes     : ");
 	ps_stats_text_hbytes(stats->written_bytes, stream);
+	fprintf(stream, "   padding   : ");
+	ps_stats_text_hbytes(stats->padding_bytes, stream);
 	fprintf(stream, "  read\n");
 	fprintf(stream, "   packets   : ");
 	ps_stats_text_hnum(stats->read_packets, stream);
 	fprintf(stream, "   bytes     : ");
 	ps_stats_text_hbytes(stats->read_bytes, stream);
 
+	if (stats->residence.count || stats->open_wait.count || stats->reserve_wait.count) {
+		fprintf(stream, " latency\n");
+		ps_stats_text_latency("residence", &stats->residence, stream);
+		ps_stats_text_latency("read wait", &stats->open_wait, stream);
+		ps_stats_text_latency("write wait", &stats->reserve_wait, stream);
+	}
+
+	if (stats->max_bytes_in_flight || stats->max_packets_in_flight) {
+		fprintf(stream, " occupancy\n");
+		fprintf(stream, "  high-water\n");
+		fprintf(stream, "   bytes     : ");
+		ps_stats_text_hbytes(stats->max_bytes_in_flight, stream);
+		fprintf(stream, "   packets   : ");
+		ps_stats_text_hnum(stats->max_packets_in_flight, stream);
+		fprintf(stream, "   unfreed   : ");
+		ps_stats_text_hbytes(stats->max_pending_free_bytes, stream);
+		fprintf(stream, "  written rate\n");
+		fprintf(stream, "   packets   : ");
+		ps_stats_text_hfloat((float) stats->written_packets_rate, stream);
+		fprintf(stream, "   bytes     : ");
+		ps_stats_text_hbytes((size_t) stats->written_bytes_rate, stream);
+		fprintf(stream, "  read rate\n");
+		fprintf(stream, "   packets   : ");
+		ps_stats_text_hfloat((float) stats->read_packets_rate, stream);
+		fprintf(stream, "   bytes     : ");
+		ps_stats_text_hbytes((size_t) stats->read_bytes_rate, stream);
+	}
+
+	if (stats->read_mutex.acquisitions || stats->write_mutex.acquisitions) {
+		fprintf(stream, " locks\n");
+		ps_stats_text_lock("read", &stats->read_mutex, stream);
+		ps_stats_text_lock("write", &stats->write_mutex, stream);
+		ps_stats_text_lock("read close", &stats->read_close_mutex, stream);
+		ps_stats_text_lock("write close", &stats->write_close_mutex, stream);
+	}
+
+	return 0;
+}
+
+static void ps_stats_json_latency(const char *name, ps_latency_t *latency, FILE *stream)
+{
+	fprintf(stream, ",\"%s\":{\"count\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p99\":%" PRIu64
+		",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}", name, latency->count, latency->p50,
+		latency->p99, latency->p999, latency->max);
+}
+
+static void ps_stats_json_lock(const char *name, ps_lockstats_t *lock, FILE *stream)
+{
+	fprintf(stream, ",\"%s\":{\"acquisitions\":%" PRIu64 ",\"contended\":%" PRIu64
+		",\"wait_nsec\":%" PRIu64 ",\"max_hold_nsec\":%" PRIu64 "}", name,
+		lock->acquisitions, lock->contended, lock->wait_nsec, lock->max_hold_nsec);
+}
+
+int ps_stats_json(ps_stats_t *stats, FILE *stream)
+{
+	if (unlikely((stats == NULL) || (stream == NULL)))
+		return EINVAL;
+
+	fprintf(stream, "{\"read_packets\":%zu,\"written_packets\":%zu"
+		",\"read_bytes\":%zu,\"written_bytes\":%zu", stats->read_packets,
+		stats->written_packets, stats->read_bytes, stats->written_bytes);
+	fprintf(stream, ",\"read_wait_nsec\":%" PRIu64 ",\"write_wait_nsec\":%" PRIu64
+		",\"utime\":%" PRIu64, stats->read_wait_nsec, stats->write_wait_nsec, stats->utime);
+	fprintf(stream, ",\"padding_bytes\":%zu,\"skipped_packets\":%zu", stats->padding_bytes,
+		stats->skipped_packets);
+	fprintf(stream, ",\"fake_dma_bytes\":%zu,\"fake_dma_peak\":%zu,\"fake_dma_allocs\":%zu",
+		stats->fake_dma_bytes, stats->fake_dma_peak, stats->fake_dma_allocs);
+	ps_stats_json_latency("residence", &stats->residence, stream);
+	ps_stats_json_latency("open_wait", &stats->open_wait, stream);
+	ps_stats_json_latency("reserve_wait", &stats->reserve_wait, stream);
+	ps_stats_json_lock("read_mutex", &stats->read_mutex, stream);
+	ps_stats_json_lock("write_mutex", &stats->write_mutex, stream);
+	ps_stats_json_lock("read_close_mutex", &stats->read_close_mutex, stream);
+	ps_stats_json_lock("write_close_mutex", &stats->write_close_mutex, stream);
+	fprintf(stream, ",\"max_bytes_in_flight\":%zu,\"max_packets_in_flight\":%zu"
+		",\"max_pending_free_bytes\":%zu", stats->max_bytes_in_flight,
+		stats->max_packets_in_flight, stats->max_pending_free_bytes);
+	fprintf(stream, ",\"written_packets_rate\":%.17g,\"written_bytes_rate\":%.17g"
+		",\"read_packets_rate\":%.17g,\"read_bytes_rate\":%.17g}\n",
+		stats->written_packets_rate, stats->written_bytes_rate,
+		stats->read_packets_rate, stats->read_bytes_rate);
+
+	return 0;
+}
+
+static void ps_stats_om_family(const char *name, const char *type, const char *unit,
+			       const char *help, FILE *stream)
+{
+	fprintf(stream, "# TYPE packetstream_%s %s\n", name, type);
+	if (unit)
+		fprintf(stream, "# UNIT packetstream_%s %s\n", name, unit);
+	fprintf(stream, "# HELP packetstream_%s %s\n", name, help);
+}
+
+/* buffer labels are joined with a sample label such as quantile="0.5" */
+static void ps_stats_om_labels(const char *labels, const char *label, FILE *stream)
+{
+	if (labels && !*labels)
+		labels = NULL;
+	if (!labels && !label)
+		return;
+	fprintf(stream, "{%s%s%s}", labels ? labels : "", labels && label ? "," : "",
+		label ? label : "");
+}
+
+static void ps_stats_om_count(const char *name, const char *suffix, const char *labels,
+			      const char *label, uint64_t value, FILE *stream)
+{
+	fprintf(stream, "packetstream_%s%s", name, suffix);
+	ps_stats_om_labels(labels, label, stream);
+	fprintf(stream, " %" PRIu64 "\n", value);
+}
+
+static void ps_stats_om_value(const char *name, const char *suffix, const char *labels,
+			      const char *label, double value, FILE *stream)
+{
+	fprintf(stream, "packetstream_%s%s", name, suffix);
+	ps_stats_om_labels(labels, label, stream);
+	fprintf(stream, " %.17g\n", value);
+}
+
+static void ps_stats_om_latency(const char *name, const char *help, ps_latency_t *latency,
+				const char *labels, FILE *stream)
+{
+	char max[64];
+
+	ps_stats_om_family(name, "summary", "seconds", help, stream);
+	ps_stats_om_value(name, "", labels, "quantile=\"0.5\"", latency->p50 / 1e9, stream);
+	ps_stats_om_value(name, "", labels, "quantile=\"0.99\"", latency->p99 / 1e9, stream);
+	ps_stats_om_value(name, "", labels, "quantile=\"0.999\"", latency->p999 / 1e9, stream);
+	ps_stats_om_count(name, "_count", labels, NULL, latency->count, stream);
+
+	/* max_seconds keeps the unit suffix last */
+	snprintf(max, sizeof(max), "%.*s_max_seconds", (int) (strlen(name) - strlen("_seconds")), name);
+	ps_stats_om_family(max, "gauge", "seconds", "largest value of the summary", stream);
+	ps_stats_om_value(max, "", labels, NULL, latency->max / 1e9, stream);
+}
+
+int ps_stats_openmetrics(ps_stats_t *stats, const char *labels, FILE *stream)
+{
+	static const char *mutex_label[4] = {
+		"mutex=\"read\"", "mutex=\"write\"", "mutex=\"read_close\"", "mutex=\"write_close\""
+	};
+	ps_lockstats_t *locks[4];
+	int i;
+
+	if (unlikely((stats == NULL) || (stream == NULL)))
+		return EINVAL;
+
+	locks[0] = &stats->read_mutex;
+	locks[1] = &stats->write_mutex;
+	locks[2] = &stats->read_close_mutex;
+	locks[3] = &stats->write_close_mutex;
+
+	ps_stats_om_family("read_packets", "counter", NULL, "packets read", stream);
+	ps_stats_om_count("read_packets", "_total", labels, NULL, stats->read_packets, stream);
+	ps_stats_om_family("written_packets", "counter", NULL, "packets written", stream);
+	ps_stats_om_count("written_packets", "_total", labels, NULL, stats->written_packets, stream);
+	ps_stats_om_family("read_bytes", "counter", "bytes", "payload bytes read", stream);
+	ps_stats_om_count("read_bytes", "_total", labels, NULL, stats->read_bytes, stream);
+	ps_stats_om_family("written_bytes", "counter", "bytes", "payload bytes written", stream);
+	ps_stats_om_count("written_bytes", "_total", labels, NULL, stats->written_bytes, stream);
+	ps_stats_om_family("read_wait_seconds", "counter", "seconds",
+			   "time consumers waited for a packet", stream);
+	ps_stats_om_value("read_wait_seconds", "_total", labels, NULL,
+			  stats->read_wait_nsec / 1e9, stream);
+	ps_stats_om_family("write_wait_seconds", "counter", "seconds",
+			   "time producers waited for free space", stream);
+	ps_stats_om_value("write_wait_seconds", "_total", labels, NULL,
+			  stats->write_wait_nsec / 1e9, stream);
+	ps_stats_om_family("uptime_seconds", "gauge", "seconds", "time since buffer creation", stream);
+	ps_stats_om_value("uptime_seconds", "", labels, NULL, stats->utime / 1e9, stream);
+	ps_stats_om_family("padding_bytes", "counter", "bytes",
+			   "buffer bytes skipped for alignment or at wrap", stream);
+	ps_stats_om_count("padding_bytes", "_total", labels, NULL, stats->padding_bytes, stream);
+	ps_stats_om_family("skipped_packets", "counter", NULL,
+			   "packets closed unread because of type mask", stream);
+	ps_stats_om_count("skipped_packets", "_total", labels, NULL, stats->skipped_packets, stream);
+	ps_stats_om_family("fake_dma_bytes", "gauge", "bytes",
+			   "memory held by fake dma areas in this process", stream);
+	ps_stats_om_count("fake_dma_bytes", "", labels, NULL, stats->fake_dma_bytes, stream);
+	ps_stats_om_family("fake_dma_peak_bytes", "gauge", "bytes", "highest fake_dma_bytes", stream);
+	ps_stats_om_count("fake_dma_peak_bytes", "", labels, NULL, stats->fake_dma_peak, stream);
+	ps_stats_om_family("fake_dma_allocs", "counter", NULL,
+			   "fake dma areas allocated from heap", stream);
+	ps_stats_om_count("fake_dma_allocs", "_total", labels, NULL, stats->fake_dma_allocs, stream);
+
+	ps_stats_om_latency("residence_seconds", "time packets spent in buffer",
+			    &stats->residence, labels, stream);
+	ps_stats_om_latency("open_wait_seconds", "time readers blocked waiting for a packet",
+			    &stats->open_wait, labels, stream);
+	ps_stats_om_latency("reserve_wait_seconds", "time writers blocked waiting for free space",
+			    &stats->reserve_wait, labels, stream);
+
+	ps_stats_om_family("lock_acquisitions", "counter", NULL, "buffer mutex acquisitions", stream);
+	for (i = 0; i < 4; i++)
+		ps_stats_om_count("lock_acquisitions", "_total", labels, mutex_label[i],
+				  locks[i]->acquisitions, stream);
+	ps_stats_om_family("lock_contended", "counter", NULL,
+			   "buffer mutex acquisitions which waited", stream);
+	for (i = 0; i < 4; i++)
+		ps_stats_om_count("lock_contended", "_total", labels, mutex_label[i],
+				  locks[i]->contended, stream);
+	ps_stats_om_family("lock_wait_seconds", "counter", "seconds",
+			   "time spent waiting for buffer mutex", stream);
+	for (i = 0; i < 4; i++)
+		ps_stats_om_value("lock_wait_seconds", "_total", labels, mutex_label[i],
+				  locks[i]->wait_nsec / 1e9, stream);
+	ps_stats_om_family("lock_max_hold_seconds", "gauge", "seconds",
+			   "longest time buffer mutex was held", stream);
+	for (i = 0; i < 4; i++)
+		ps_stats_om_value("lock_max_hold_seconds", "", labels, mutex_label[i],
+				  locks[i]->max_hold_nsec / 1e9, stream);
+
+	ps_stats_om_family("max_in_flight_bytes", "gauge", "bytes",
+			   "highest bytes written and not yet released", stream);
+	ps_stats_om_count("max_in_flight_bytes", "", labels, NULL, stats->max_bytes_in_flight, stream);
+	ps_stats_om_family("max_in_flight_packets", "gauge", NULL,
+			   "highest packets written and not yet released", stream);
+	ps_stats_om_count("max_in_flight_packets", "", labels, NULL,
+			  stats->max_packets_in_flight, stream);
+	ps_stats_om_family("max_pending_free_bytes", "gauge", "bytes",
+			   "highest bytes released and not yet reclaimed", stream);
+	ps_stats_om_count("max_pending_free_bytes", "", labels, NULL,
+			  stats->max_pending_free_bytes, stream);
+	ps_stats_om_family("written_packets_rate", "gauge", NULL,
+			   "moving average of packets written per second", stream);
+	ps_stats_om_value("written_packets_rate", "", labels, NULL,
+			  stats->written_packets_rate, stream);
+	ps_stats_om_family("written_bytes_rate", "gauge", NULL,
+			   "moving average of bytes written per second", stream);
+	ps_stats_om_value("written_bytes_rate", "", labels, NULL, stats->written_bytes_rate, stream);
+	ps_stats_om_family("read_packets_rate", "gauge", NULL,
+			   "moving average of packets read per second", stream);
+	ps_stats_om_value("read_packets_rate", "", labels, NULL, stats->read_packets_rate, stream);
+	ps_stats_om_family("read_bytes_rate", "gauge", NULL,
+			   "moving average of bytes read per second", stream);
+	ps_stats_om_value("read_bytes_rate", "", labels, NULL, stats->read_bytes_rate, stream);
+
+	fprintf(stream, "# EOF\n");
+
+	return 0;
+}
+
+/**  \} */
+
+#ifdef __PS_SINK
+/**
+ * \addtogroup sink
+ *  \{
+ */
+
+/** O_DIRECT block size, file offsets and I/O sizes are multiples of it */
+#define PS_SINK_BLOCK_SIZE 4096
+/** packets claimed from buffer at once */
+#define PS_SINK_BATCH      64
+
+/**
+ * \brief sink I/O slot
+ */
+struct ps_sink_io_s {
+	/** staging memory, io_size bytes */
+	unsigned char *mem;
+	/** bytes staged */
+	size_t len;
+	/** bytes submitted, len rounded up to blocks by O_DIRECT flush */
+	size_t submit_len;
+	/** file offset of mem */
+	uint64_t offset;
+	/** packets with their last byte in this slot */
+	ps_packet_t *packets;
+	/** end of each packet in mem */
+	size_t *ends;
+	/** number of packets */
+	size_t count;
+	/** capacity of packets and ends */
+	size_t alloc;
+	/** single segment of IORING_OP_WRITEV */
+	struct iovec iov;
+	/** I/O is completed */
+	int done;
+	/** bytes written or negative error code */
+	int res;
+};
+
+/**
+ * \brief sink state
+ */
+struct ps_sink_state_s {
+	/** io_uring file descriptor, -1 to write synchronously */
+	int ring_fd;
+	/** submission queue ring mapping */
+	void *sq_ring;
+	/** submission queue ring mapping size */
+	size_t sq_ring_size;
+	/** completion queue ring mapping, may be sq_ring */
+	void *cq_ring;
+	/** completion queue ring mapping size */
+	size_t cq_ring_size;
+	/** submission queue entries */
+	struct io_uring_sqe *sqes;
+	/** submission queue entries mapping size */
+	size_t sqes_size;
+	/** submission queue tail */
+	unsigned *sq_tail;
+	/** submission queue index mask */
+	unsigned *sq_mask;
+	/** submission queue index array */
+	unsigned *sq_array;
+	/** completion queue head */
+	unsigned *cq_head;
+	/** completion queue tail */
+	unsigned *cq_tail;
+	/** completion queue index mask */
+	unsigned *cq_mask;
+	/** completion queue entries */
+	struct io_uring_cqe *cqes;
+
+	/** fd was opened with O_DIRECT */
+	int direct;
+	/** staging size of each slot */
+	size_t io_size;
+	/** number of slots */
+	int depth;
+	/** I/O slots, used round robin */
+	struct ps_sink_io_s *io;
+	/** oldest submitted slot */
+	int head;
+	/** slots submitted and not retired, slot after them is being filled */
+	int inflight;
+	/** first I/O error */
+	int error;
+	/** packets claimed from buffer and not staged yet */
+	ps_packet_t pending[PS_SINK_BATCH];
+};
+
+static int ps_sink_ring_init(struct ps_sink_state_s *sink, int depth)
+{
+	struct io_uring_params params;
+	unsigned char *sq, *cq;
+
+	memset(&params, 0, sizeof(params));
+	if ((sink->ring_fd = syscall(__NR_io_uring_setup, depth, &params)) < 0)
+		return errno;
+
+	sink->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	sink->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (sink->cq_ring_size > sink->sq_ring_size)
+			sink->sq_ring_size = sink->cq_ring_size;
+		sink->cq_ring_size = 0;
+	}
+
+	sink->sq_ring = mmap(NULL, sink->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_SQ_RING);
+	if (sink->sq_ring == MAP_FAILED)
+		goto err;
+	sink->cq_ring = sink->sq_ring;
+	if (sink->cq_ring_size) {
+		sink->cq_ring = mmap(NULL, sink->cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_CQ_RING);
+		if (sink->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+	sink->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sink->sqes = mmap(NULL, sink->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_SQES);
+	if (sink->sqes == MAP_FAILED)
+		goto err_cq;
+
+	sq = (unsigned char *) sink->sq_ring;
+	cq = (unsigned char *) sink->cq_ring;
+	sink->sq_tail = (unsigned *) &sq[params.sq_off.tail];
+	sink->sq_mask = (unsigned *) &sq[params.sq_off.ring_mask];
+	sink->sq_array = (unsigned *) &sq[params.sq_off.array];
+	sink->cq_head = (unsigned *) &cq[params.cq_off.head];
+	sink->cq_tail = (unsigned *) &cq[params.cq_off.tail];
+	sink->cq_mask = (unsigned *) &cq[params.cq_off.ring_mask];
+	sink->cqes = (struct io_uring_cqe *) &cq[params.cq_off.cqes];
+
+	return 0;
+
+err_cq:
+	if (sink->cq_ring_size)
+		munmap(sink->cq_ring, sink->cq_ring_size);
+err_sq:
+	munmap(sink->sq_ring, sink->sq_ring_size);
+err:
+	close(sink->ring_fd);
+	sink->ring_fd = -1;
+	return ENOMEM;
+}
+
+static void ps_sink_ring_destroy(struct ps_sink_state_s *sink)
+{
+	if (sink->ring_fd < 0)
+		return;
+
+	munmap(sink->sqes, sink->sqes_size);
+	if (sink->cq_ring_size)
+		munmap(sink->cq_ring, sink->cq_ring_size);
+	munmap(sink->sq_ring, sink->sq_ring_size);
+	close(sink->ring_fd);
+}
+
+static int ps_sink_pwrite(int fd, unsigned char *mem, size_t len, uint64_t offset)
+{
+	ssize_t res;
+
+	while (len) {
+		if (unlikely((res = pwrite(fd, mem, len, offset)) < 0)) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		mem += res;
+		len -= res;
+		offset += res;
+	}
+
+	return 0;
+}
+
+/* make room for n more packets in slot */
+static int ps_sink_io_grow(ps_buffer_t *buffer, struct ps_sink_io_s *io, size_t n)
+{
+	ps_packet_t *packets;
+	size_t *ends, alloc, i;
+
+	if (io->count + n <= io->alloc)
+		return 0;
+
+	alloc = io->alloc ? io->alloc : PS_SINK_BATCH;
+	while (alloc < io->count + n)
+		alloc *= 2;
+
+	/* slot is left untouched unless both arrays grow */
+	packets = malloc(alloc * sizeof(ps_packet_t));
+	ends = malloc(alloc * sizeof(size_t));
+	if (unlikely(!packets || !ends)) {
+		free(packets);
+		free(ends);
+		return ENOMEM;
+	}
+
+	if (io->alloc) {
+		memcpy(packets, io->packets, io->alloc * sizeof(ps_packet_t));
+		memcpy(ends, io->ends, io->count * sizeof(size_t));
+	}
+	for (i = io->alloc; i < alloc; i++)
+		ps_packet_init(&packets[i], buffer);
+
+	free(io->packets);
+	free(io->ends);
+	io->packets = packets;
+	io->ends = ends;
+	io->alloc = alloc;
+
+	return 0;
+}
+
+int ps_sink_init(ps_sink_t *sink, ps_buffer_t *buffer, int fd, size_t io_size, int depth)
+{
+	struct ps_sink_state_s *state;
+	off_t offset;
+	int fl, i, ret;
+
+	if (unlikely((sink == NULL) || (fd < 0)))
+		return EINVAL;
+	__PS_BUFFER_CHECK(buffer)
+
+	if (!io_size)
+		io_size = PS_SINK_DEFAULT_IO_SIZE;
+	if (!depth)
+		depth = PS_SINK_DEFAULT_DEPTH;
+	/* a slot is filled while the others are in flight */
+	if (unlikely(depth < 2))
+		return EINVAL;
+
+	if (unlikely((fl = fcntl(fd, F_GETFL)) == -1))
+		return errno;
+	if (unlikely((offset = lseek(fd, 0, SEEK_CUR)) == (off_t) -1))
+		return errno;
+
+	/* whole blocks also keep staged data page aligned without O_DIRECT */
+	io_size = (io_size + PS_SINK_BLOCK_SIZE - 1) & ~((size_t) PS_SINK_BLOCK_SIZE - 1);
+	if (unlikely((fl & O_DIRECT) && (offset & (PS_SINK_BLOCK_SIZE - 1))))
+		return EINVAL;
+
+	if (unlikely(!(state = calloc(1, sizeof(struct ps_sink_state_s)))))
+		return ENOMEM;
+	if (unlikely(!(state->io = calloc(depth, sizeof(struct ps_sink_io_s))))) {
+		free(state);
+		return ENOMEM;
+	}
+	state->ring_fd = -1;
+
+	state->direct = (fl & O_DIRECT) != 0;
+	state->io_size = io_size;
+	state->depth = depth;
+	for (i = 0; i < PS_SINK_BATCH; i++)
+		ps_packet_init(&state->pending[i], buffer);
+
+	sink->buffer = buffer;
+	sink->fd = fd;
+	sink->offset = offset;
+	sink->state = state;
+
+	for (i = 0; i < depth; i++) {
+		if (unlikely(posix_memalign((void **) &state->io[i].mem, PS_SINK_BLOCK_SIZE, io_size))) {
+			ret = ENOMEM;
+			goto err;
+		}
+		if (unlikely((ret = ps_sink_io_grow(buffer, &state->io[i], PS_SINK_BATCH))))
+			goto err;
+	}
+	state->io[0].offset = offset;
+
+	/* fall back to synchronous writes without io_uring */
+	ret = ps_sink_ring_init(state, depth);
+	if (unlikely(ret && (ret != ENOSYS) && (ret != EPERM)))
+		goto err;
+
+	return 0;
+
+err:
+	ps_sink_destroy(sink);
+	return ret;
+}
+
+static void ps_sink_start(ps_sink_t *sink, struct ps_sink_io_s *io)
+{
+	struct ps_sink_state_s *state = (struct ps_sink_state_s *) sink->state;
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+	int ret;
+
+	io->done = 0;
+	if (state->ring_fd >= 0) {
+		io->iov.iov_base = io->mem;
+		io->iov.iov_len = io->submit_len;
+
+		tail = *state->sq_tail;
+		index = tail & *state->sq_mask;
+		sqe = &state->sqes[index];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = sink->fd;
+		sqe->addr = (uint64_t) (uintptr_t) &io->iov;
+		sqe->len = 1;
+		sqe->off = io->offset;
+		sqe->user_data = io - state->io;
+		state->sq_array[index] = index;
+		__PS_STORE_RELEASE(state->sq_tail, tail + 1);
+
+		do
+			ret = syscall(__NR_io_uring_enter, state->ring_fd, 1, 0, 0, NULL, 0);
+		while ((ret < 0) && (errno == EINTR));
+		if (likely(ret == 1))
+			return;
+		/* not consumed by kernel, take it back and write synchronously */
+		__PS_STORE_RELEASE(state->sq_tail, tail);
+	}
+
+	io->res = -ps_sink_pwrite(sink->fd, io->mem, io->submit_len, io->offset);
+	if (!io->res)
+		io->res = io->submit_len;
+	io->done = 1;
+}
+
+/* collect completions and close packets of finished slots, in order */
+static void ps_sink_retire(ps_sink_t *sink, int wait)
+{
+	struct ps_sink_state_s *state = (struct ps_sink_state_s *) sink->state;
+	struct ps_sink_io_s *io;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int ret;
+
+	if (state->ring_fd >= 0) {
+		if (wait && state->inflight && !state->io[state->head].done) {
+			do
+				ret = syscall(__NR_io_uring_enter, state->ring_fd, 0, 1,
+					      IORING_ENTER_GETEVENTS, NULL, 0);
+			while ((ret < 0) && (errno == EINTR));
+		}
+
+		head = *state->cq_head;
+		tail = __PS_LOAD_ACQUIRE(state->cq_tail);
+		while (head != tail) {
+			cqe = &state->cqes[head & *state->cq_mask];
+			io = &state->io[cqe->user_data];
+			io->res = cqe->res;
+			io->done = 1;
+			head++;
+		}
+		__PS_STORE_RELEASE(state->cq_head, head);
+	}
+
+	while (state->inflight && state->io[state->head].done) {
+		io = &state->io[state->head];
+
+		if (io->res < 0) {
+			if (!state->error)
+				state->error = -io->res;
+		} else if ((size_t) io->res < io->submit_len) {
+			/* rare short write, finish it here */
+			if ((ret = ps_sink_pwrite(sink->fd, &io->mem[io->res], io->submit_len - io->res,
+						  io->offset + io->res)) && !state->error)
+				state->error = ret;
+		}
+
+		if (io->count)
+			ps_packet_close_batch(io->packets, io->count);
+		sink->offset = io->offset + io->len;
+
+		io->count = 0;
+		io->len = 0;
+		io->done = 0;
+		state->head = (state->head + 1) % state->depth;
+		state->inflight--;
+	}
+}
+
+/*
+ * Submit slot being filled and start filling next one. With O_DIRECT
+ * only whole blocks are written, the partial last block is carried to
+ * next slot with packets ending in it. Flush pads it with zeroes
+ * instead so its packets are complete, and next slot writes the block
+ * again, only after this slot is retired so the writes can't race.
+ */
+static void ps_sink_submit(ps_sink_t *sink, int flush)
+{
+	struct ps_sink_state_s *state = (struct ps_sink_state_s *) sink->state;
+	struct ps_sink_io_s *io, *next;
+	size_t aligned, i, j;
+	int sync = 0;
+
+	io = &state->io[(state->head + state->inflight) % state->depth];
+	aligned = io->len;
+	if (state->direct)
+		aligned &= ~((size_t) PS_SINK_BLOCK_SIZE - 1);
+	if (!io->len || (!aligned && !flush))
+		return;
+
+	/* slot after this one is filled next, it must be retired first */
+	while (state->inflight >= state->depth - 1)
+		ps_sink_retire(sink, 1);
+	next = &state->io[(state->head + state->inflight + 1) % state->depth];
+	next->offset = io->offset + aligned;
+
+	/* packets ending in carried block are closed with next slot */
+	for (i = io->count; (i > 0) && (io->ends[i - 1] > aligned); i--)
+		;
+	if (!flush && unlikely(ps_sink_io_grow(sink->buffer, next, io->count - i)))
+		flush = sync = 1;
+
+	io->submit_len = aligned;
+	if (aligned < io->len) {
+		next->len = io->len - aligned;
+		memcpy(next->mem, &io->mem[aligned], next->len);
+		if (flush) {
+			io->submit_len = (io->len + PS_SINK_BLOCK_SIZE - 1) &
+					 ~((size_t) PS_SINK_BLOCK_SIZE - 1);
+			memset(&io->mem[io->len], 0, io->submit_len - io->len);
+		} else {
+			for (j = i; j < io->count; j++) {
+				next->packets[next->count] = io->packets[j];
+				next->ends[next->count++] = io->ends[j] - aligned;
+			}
+			io->count = i;
+			io->len = aligned;
+		}
+	}
+
+	ps_sink_start(sink, io);
+	state->inflight++;
+
+	/* ps_sink_flush() waits itself, otherwise padded block is still in flight */
+	if (sync && (aligned < io->len)) {
+		while (state->inflight)
+			ps_sink_retire(sink, 1);
+	}
+}
+
+/* stage packet data, submitting slots as they fill up */
+static int ps_sink_stage(ps_sink_t *sink, ps_packet_t *packet)
+{
+	struct ps_sink_state_s *state = (struct ps_sink_state_s *) sink->state;
+	struct ps_sink_io_s *io;
+	size_t size, n;
+	int ret;
+
+	ps_packet_getsize(packet, &size);
+	for (;;) {
+		io = &state->io[(state->head + state->inflight) % state->depth];
+		n = state->io_size - io->len;
+		if (n > size - packet->pos)
+			n = size - packet->pos;
+		if (n) {
+			ps_packet_read(packet, &io->mem[io->len], n);
+			io->len += n;
+		}
+		if (packet->pos == size)
+			break;
+		ps_sink_submit(sink, 0);
+	}
+
+	if (unlikely((ret = ps_sink_io_grow(sink->buffer, io, 1))))
+		return ret;
+	io->packets[io->count] = *packet;
+	io->ends[io->count++] = io->len;
+	if (io->len == state->io_size)
+		ps_sink_submit(sink, 0);
+
 	return 0;
 }
 
+int ps_sink_poll(ps_sink_t *sink, ps_flags_t flags)
+{
+	struct ps_sink_state_s *state = (struct ps_sink_state_s *) sink->state;
+	size_t got, i;
+	int ret;
+
+	ps_sink_retire(sink, 0);
+	if (unlikely(state->error))
+		return state->error;
+
+	ret = ps_packet_open_batch(state->pending, PS_SINK_BATCH, &got,
+				   PS_PACKET_READ | PS_PACKET_TRY);
+	if (ret == EBUSY) {
+		/* nothing ready, push out what is staged and wait for device */
+		ps_sink_submit(sink, 0);
+		if (state->inflight) {
+			ps_sink_retire(sink, 1);
+			return state->error;
+		}
+		if (flags & PS_PACKET_TRY)
+			return EBUSY;
+		ret = ps_packet_open_batch(state->pending, PS_SINK_BATCH, &got, PS_PACKET_READ);
+	}
+	if (unlikely(ret))
+		return ret;
+
+	for (i = 0; i < got; i++) {
+		if (unlikely((ret = ps_sink_stage(sink, &state->pending[i])))) {
+			/* give unstaged packets back, their data is lost */
+			ps_packet_close_batch(&state->pending[i], got - i);
+			return ret;
+		}
+	}
+
+	return state->error;
+}
+
+int ps_sink_flush(ps_sink_t *sink)
+{
+	struct ps_sink_state_s *state = (struct ps_sink_state_s *) sink->state;
+
+	ps_sink_submit(sink, 1);
+	while (state->inflight)
+		ps_sink_retire(sink, 1);
+
+	/* cut O_DIRECT padding past data */
+	if (state->direct && (sink->offset & (PS_SINK_BLOCK_SIZE - 1)) &&
+	    ftruncate(sink->fd, sink->offset) && !state->error)
+		state->error = errno;
+
+	return state->error;
+}
+
+int ps_sink_destroy(ps_sink_t *sink)
+{
+	struct ps_sink_state_s *state = (struct ps_sink_state_s *) sink->state;
+	int i, ret = 0;
+
+	if (unlikely(state == NULL))
+		return EINVAL;
+
+	if (state->io[state->depth - 1].packets)
+		ret = ps_sink_flush(sink);
+
+	ps_sink_ring_destroy(state);
+	for (i = 0; i < state->depth; i++) {
+		free(state->io[i].mem);
+		free(state->io[i].packets);
+		free(state->io[i].ends);
+	}
+	free(state->io);
+	free(state);
+	sink->state = NULL;
+
+	return ret;
+}
+
 /**  \} */
+#endif
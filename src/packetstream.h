@@ -47,11 +47,6 @@
   Pyry Haulos <pyry.haulos@gmail.com>
 */
 
-/*
- TODO
-  dynamic buffer size
-*/
-
 #ifndef _PACKETSTREAM_H
 #define _PACKETSTREAM_H
 
@@ -69,8 +64,16 @@
 # define IPC_PRIVATE 0
 #else
 # include <sys/ipc.h>
+# include <sys/uio.h>
 # define __PS_SHM
 # define __PS_STATS
+# define __PS_MIRROR
+# define __PS_IOVEC
+# define __PS_HUGEPAGES
+# define __PS_NUMA
+# define __PS_SHMFD
+# define __PS_ROBUST
+# define __PS_SINK
 #endif
 
 #ifdef __cplusplus
@@ -80,12 +83,13 @@ extern "C" {
 /**
  *  \defgroup packetstream packetstream
  *  packetstream is basically a solution to the Producer-Consumer problem with a fixed
- *  size ring buffer and variable item (=packet) size. This implementation follows classic
- *  solution using semaphores with a few exceptions:
+ *  size ring buffer and variable item (=packet) size. Instead of counting items with
+ *  semaphores, both sides compare ring cursors and sleep on a futex only when there
+ *  is nothing to do. Wakers enter the kernel only if someone is actually sleeping
+ *  and one wake covers a whole batch of packets. Other notable points:
  *
- *  1. Since the maximum amount of items the buffer can hold is not known, semaphore
- *     "empty" (=read_packets) is only decreased when producer needs to remove
- *     a consumed item to have space for a new one.
+ *  1. Since the maximum amount of items the buffer can hold is not known, consumed
+ *     items are only freed when producer needs space for a new one.
  *
  *  2. Multiple producers 1..n can simultaneously write to the buffer providing that
  *     there is enough free space and all producers 1..n-1 have set a size for
@@ -93,6 +97,17 @@ extern "C" {
  *
  *  3. Multiple consumers 1..n can simultaneously read from the buffer if there is
  *     1..n ready items.
+ *
+ *  If the buffer is created with PS_BUFFER_SPSC, exactly one producer and one
+ *  consumer thread may use it. Mutexes are then skipped entirely and both sides
+ *  only exchange their cursors. The consumer may hold several packets open and
+ *  close them in any order; space is given back once every older packet is
+ *  closed too.
+ *
+ *  If the buffer is created with PS_BUFFER_MPMC, any number of producers and
+ *  consumers may use it. Producers claim space with a CAS once packet size is
+ *  known (data written before ps_packet_setsize() is staged in packet) and
+ *  consumers claim packets with a CAS, so no mutex is ever held.
  *  \{
  */
 
@@ -120,6 +135,13 @@ extern "C" {
  *  \defgroup stats statistics
  */
 
+/**
+ *  \defgroup sink file sink
+ *  Sink consumes packets of a buffer and appends their data to a file,
+ *  staged into large I/Os of which several are in flight through
+ *  io_uring. Packets are closed only once their data is written.
+ */
+
 /**
  * \addtogroup buffer
  *  \{
@@ -132,6 +154,33 @@ extern "C" {
 #define PS_BUFFER_STATS          4
 /** buffer is in cancelled state */
 #define PS_BUFFER_CANCELLED      8
+/** one producer and one consumer thread (lock-free), reads may close out of order */
+#define PS_BUFFER_SPSC          16
+/** producers and consumers claim space and packets lock-free */
+#define PS_BUFFER_MPMC          32
+/** data area is mapped twice back-to-back, packets are never split */
+#define PS_BUFFER_MIRROR        64
+/** packets use a 4-byte header, packets and buffer are limited to 1 GiB */
+#define PS_BUFFER_COMPACT      128
+/** PS_BUFFER_PSHARED memory is a memfd or POSIX shm object instead of SysV shm */
+#define PS_BUFFER_SHMFD        256
+/** PS_BUFFER_PSHARED buffer survives death of attached processes */
+#define PS_BUFFER_ROBUST       512
+/** every consumer group sees every packet, see ps_bufferattr_setgroups() */
+#define PS_BUFFER_BROADCAST   1024
+/** packets are time stamped and latency histograms kept, see ps_buffer_histograms() */
+#define PS_BUFFER_LATENCY     2048
+/** buffer mutexes are profiled, see ps_lockstats_t */
+#define PS_BUFFER_LOCKSTATS   4096
+/** occupancy is sampled and packet sizes counted, see ps_buffer_occupancy() */
+#define PS_BUFFER_OCCUPANCY   8192
+
+/** data area is backed by regular pages */
+#define PS_BACKING_PAGES         0
+/** data area is backed by hugetlbfs huge pages */
+#define PS_BACKING_HUGETLB       1
+/** data area is eligible for transparent huge pages */
+#define PS_BACKING_THP           2
 
 /**  \} */
 
@@ -152,6 +201,13 @@ extern "C" {
 /** accept fake dma */
 #define PS_ACCEPT_FAKE_DMA       1
 
+/** number of packet types, see ps_packet_settype() */
+#define PS_PACKET_TYPES         32
+/** type mask bit of packet type */
+#define PS_TYPE_MASK(type)       (1U << (type))
+/** type mask matching every packet type */
+#define PS_TYPE_ALL              0xffffffffU
+
 /**  \} */
 
 /**
@@ -162,13 +218,147 @@ extern "C" {
 /** default buffer size */
 #define PS_DEFAULT_SIZE    1048576
 
+/** default packet payload alignment (none) */
+#define PS_DEFAULT_ALIGN   1
+
+/** leave numa placement to first touch */
+#define PS_NUMA_DEFAULT   -1
+/** interleave pages over every allowed numa node */
+#define PS_NUMA_INTERLEAVE -2
+
 /** special shmid which forces buffer to create new shm area */
 #define PS_SHM_CREATE  IPC_PRIVATE
 
+/** maximum number of consumer groups with PS_BUFFER_BROADCAST */
+#define PS_MAX_GROUPS  8
+
+/** default interval between PS_BUFFER_OCCUPANCY samples in nanoseconds */
+#define PS_DEFAULT_SAMPLE_INTERVAL 100000000
+
 /**  \} */
 
 typedef int ps_flags_t;
 
+/**
+ * \addtogroup stats
+ *  \{
+ */
+
+/** histogram sub-buckets per power of two */
+#define PS_HISTOGRAM_SUB_BUCKETS 16
+/** histogram buckets, values from 2^40 ns (about 18 minutes) share the last */
+#define PS_HISTOGRAM_BUCKETS     592
+
+/** occupancy samples kept by a PS_BUFFER_OCCUPANCY buffer */
+#define PS_SAMPLES               64
+/** packet size buckets, one per power of two, 2^31 bytes and up share the last */
+#define PS_SIZE_BUCKETS          32
+
+/**  \} */
+
+/**
+ * \ingroup stats
+ * \brief log-linear histogram of durations in nanoseconds
+ *
+ * Values below PS_HISTOGRAM_SUB_BUCKETS have a bucket each, every
+ * power of two above is split in PS_HISTOGRAM_SUB_BUCKETS buckets, so
+ * a bucket is at most 1/16th of the values it holds wide.
+ */
+typedef struct {
+	/** number of values */
+	uint64_t count;
+	/** sum of values */
+	uint64_t sum;
+	/** largest value */
+	uint64_t max;
+	/** number of values by bucket */
+	uint64_t bucket[PS_HISTOGRAM_BUCKETS];
+} ps_histogram_t;
+
+/**
+ * \ingroup stats
+ * \brief PS_BUFFER_LATENCY histograms
+ */
+typedef struct {
+	/** time packets spent in buffer from write close to read open */
+	ps_histogram_t residence;
+	/** time readers blocked waiting for a packet */
+	ps_histogram_t open_wait;
+	/** time writers blocked waiting for free space */
+	ps_histogram_t reserve_wait;
+} ps_histograms_t;
+
+/**
+ * \ingroup stats
+ * \brief latency summary of a histogram in nanoseconds
+ */
+typedef struct {
+	/** number of values */
+	uint64_t count;
+	/** median */
+	uint64_t p50;
+	/** 99th percentile */
+	uint64_t p99;
+	/** 99.9th percentile */
+	uint64_t p999;
+	/** largest value */
+	uint64_t max;
+} ps_latency_t;
+
+/**
+ * \ingroup stats
+ * \brief PS_BUFFER_OCCUPANCY sample
+ *
+ * Rates are exponentially weighted moving averages, each sample weighs
+ * 1/8th.
+ */
+typedef struct {
+	/** ps_buffer_utime() when sample was taken */
+	uint64_t utime;
+	/** bytes written and not yet released by readers */
+	size_t bytes_in_flight;
+	/** packets written and not yet released by readers */
+	size_t packets_in_flight;
+	/** bytes released by readers and not yet reclaimed by writers */
+	size_t pending_free_bytes;
+	/** packets written per second */
+	double written_packets_rate;
+	/** bytes written per second */
+	double written_bytes_rate;
+	/** packets read per second */
+	double read_packets_rate;
+	/** bytes read per second */
+	double read_bytes_rate;
+} ps_sample_t;
+
+/**
+ * \ingroup stats
+ * \brief PS_BUFFER_OCCUPANCY samples and packet sizes
+ */
+typedef struct {
+	/** samples taken since buffer creation */
+	uint64_t samples;
+	/** ring of last samples, latest is sample[(samples - 1) % PS_SAMPLES] */
+	ps_sample_t sample[PS_SAMPLES];
+	/** written packets by size, bucket n holds sizes 2^n to 2^(n+1) - 1 */
+	uint64_t sizes[PS_SIZE_BUCKETS];
+} ps_occupancy_t;
+
+/**
+ * \ingroup stats
+ * \brief PS_BUFFER_LOCKSTATS profile of a buffer mutex
+ */
+typedef struct {
+	/** number of times mutex was taken */
+	uint64_t acquisitions;
+	/** acquisitions which had to wait for another holder */
+	uint64_t contended;
+	/** time in nanoseconds spent waiting for mutex */
+	uint64_t wait_nsec;
+	/** longest time in nanoseconds mutex was held */
+	uint64_t max_hold_nsec;
+} ps_lockstats_t;
+
 /**
  * \ingroup stats
  * \brief buffer statistics
@@ -188,6 +378,44 @@ typedef struct {
 	uint64_t write_wait_nsec;
 	/** time in nanoseconds since buffer was created */
 	uint64_t utime;
+	/** buffer bytes skipped to align payloads or at buffer wrap */
+	size_t padding_bytes;
+	/** packets closed unread because their type was not in type mask */
+	size_t skipped_packets;
+	/** memory held by fake dma areas in this process */
+	size_t fake_dma_bytes;
+	/** highest fake_dma_bytes */
+	size_t fake_dma_peak;
+	/** fake dma areas allocated from heap */
+	size_t fake_dma_allocs;
+	/** packet residence time with PS_BUFFER_LATENCY */
+	ps_latency_t residence;
+	/** reader wait time with PS_BUFFER_LATENCY */
+	ps_latency_t open_wait;
+	/** writer wait time with PS_BUFFER_LATENCY */
+	ps_latency_t reserve_wait;
+	/** read_mutex (and consumer group mutexes) with PS_BUFFER_LOCKSTATS */
+	ps_lockstats_t read_mutex;
+	/** write_mutex with PS_BUFFER_LOCKSTATS */
+	ps_lockstats_t write_mutex;
+	/** read_close_mutex with PS_BUFFER_LOCKSTATS */
+	ps_lockstats_t read_close_mutex;
+	/** write_close_mutex with PS_BUFFER_LOCKSTATS */
+	ps_lockstats_t write_close_mutex;
+	/** highest ps_sample_t bytes_in_flight with PS_BUFFER_OCCUPANCY */
+	size_t max_bytes_in_flight;
+	/** highest ps_sample_t packets_in_flight with PS_BUFFER_OCCUPANCY */
+	size_t max_packets_in_flight;
+	/** highest ps_sample_t pending_free_bytes with PS_BUFFER_OCCUPANCY */
+	size_t max_pending_free_bytes;
+	/** latest written packets per second with PS_BUFFER_OCCUPANCY */
+	double written_packets_rate;
+	/** latest written bytes per second with PS_BUFFER_OCCUPANCY */
+	double written_bytes_rate;
+	/** latest read packets per second with PS_BUFFER_OCCUPANCY */
+	double read_packets_rate;
+	/** latest read bytes per second with PS_BUFFER_OCCUPANCY */
+	double read_bytes_rate;
 } ps_stats_t;
 
 /**
@@ -203,6 +431,22 @@ typedef struct {
 	int shmid;
 	/** shared memory permission mask */
 	int shmmode;
+	/** packet payload alignment */
+	size_t align;
+	/** back data area with huge pages when possible */
+	int hugepages;
+	/** numa node, PS_NUMA_DEFAULT or PS_NUMA_INTERLEAVE */
+	int numa_node;
+	/** POSIX shm object name with PS_BUFFER_SHMFD, NULL for a memfd */
+	const char *shmname;
+	/** file descriptor of buffer to attach to with PS_BUFFER_SHMFD, or -1 */
+	int shmfd;
+	/** memory cap of fake dma areas in bytes, 0 for none */
+	size_t fake_dma_limit;
+	/** number of consumer groups with PS_BUFFER_BROADCAST */
+	int groups;
+	/** nanoseconds between samples with PS_BUFFER_OCCUPANCY */
+	uint64_t sample_interval;
 } ps_bufferattr_t;
 
 /**
@@ -218,10 +462,24 @@ typedef struct {
 	ps_stats_t *stats;
 	/** shared memory id */
 	int shmid;
-	/** time in nanoseconds when consumer entered waiting mode last time */
-	uint64_t read_wait_start;
-	/** time in nanoseconds when producer entered waiting mode last time */
-	uint64_t write_wait_start;
+	/** shared memory file descriptor with PS_BUFFER_SHMFD, -1 otherwise */
+	int shmfd;
+	/** POSIX shm object name if this process created it */
+	char *shmname;
+	/** peer slot of this process with PS_BUFFER_ROBUST, -1 otherwise */
+	int peer;
+	/** fork generation peer slot was taken in */
+	int peer_generation;
+	/** size of data area as mapped by this process */
+	size_t size;
+	/** resize generation of data area mapping */
+	int generation;
+	/** set while a thread of this process maps a resized data area */
+	int remapping;
+	/** fake dma arena (ps_fake_dma_arena_s) of this process */
+	void *fake_dma;
+	/** last ps_buffer_stats_delta() snapshot of this process */
+	void *stats_prev;
 } ps_buffer_t;
 
 /**
@@ -243,8 +501,41 @@ typedef struct {
 	void *header;
 	/** fake dma object linked list */
 	void *fake_dma;
+	/** peer slot entry tracking this packet with PS_BUFFER_ROBUST, -1 otherwise */
+	int peer_entry;
+	/** consumer group of packet with PS_BUFFER_BROADCAST */
+	int group;
+	/** type given to packet opened in write mode */
+	int type;
+	/** types of packets opened in read mode */
+	uint32_t type_mask;
 } ps_packet_t;
 
+/**
+ * \ingroup packet
+ * \brief packet handler called by ps_dispatch()
+ *
+ * Returns 0 to go on with next packet, anything else stops ps_dispatch().
+ */
+typedef int (*ps_handler_t)(ps_packet_t *packet, void *arg);
+
+#ifdef __PS_SINK
+/**
+ * \ingroup sink
+ * \brief file sink
+ */
+typedef struct {
+	/** buffer packets are consumed from */
+	ps_buffer_t *buffer;
+	/** file descriptor data is written to */
+	int fd;
+	/** file offset after last byte written and completed */
+	uint64_t offset;
+	/** pointer to internal sink state (ps_sink_state_s) */
+	void *state;
+} ps_sink_t;
+#endif
+
 /**
  * \addtogroup bufferattr
  *  \{
@@ -272,7 +563,18 @@ __PS_PUBLIC int ps_bufferattr_setsize(ps_bufferattr_t *attr, size_t size);
 /**
  * \brief set buffer flags
  * \param attr buffer attribute object
- * \param flags valid flags are PS_BUFFER_PSHARED and PS_BUFFER_STATS
+ * \param flags valid flags are PS_BUFFER_PSHARED, PS_BUFFER_STATS,
+ *              PS_BUFFER_SPSC and PS_BUFFER_MPMC (not both) and
+ *              PS_BUFFER_MIRROR (PS_BUFFER_PSHARED only with
+ *              PS_BUFFER_SHMFD), PS_BUFFER_COMPACT (not with
+ *              PS_BUFFER_MPMC), PS_BUFFER_SHMFD (with PS_BUFFER_PSHARED)
+ *              PS_BUFFER_ROBUST (with PS_BUFFER_PSHARED, not with
+ *              PS_BUFFER_SPSC, PS_BUFFER_MPMC or PS_BUFFER_COMPACT)
+ *              PS_BUFFER_BROADCAST (not with PS_BUFFER_SPSC,
+ *              PS_BUFFER_MPMC, PS_BUFFER_COMPACT or PS_BUFFER_ROBUST)
+ *              PS_BUFFER_LATENCY (with PS_BUFFER_STATS, not with
+ *              PS_BUFFER_COMPACT), PS_BUFFER_LOCKSTATS and
+ *              PS_BUFFER_OCCUPANCY (with PS_BUFFER_STATS)
  * \return 0 on success or EINVAL if attr is NULL or flags are not valid
  */
 __PS_PUBLIC int ps_bufferattr_setflags(ps_bufferattr_t *attr, ps_flags_t flags);
@@ -290,6 +592,103 @@ __PS_PUBLIC int ps_bufferattr_setshmid(ps_bufferattr_t *attr, int id);
  * \return 0 on success or EINVAL if attr is NULL or mode is not valid
  */
 __PS_PUBLIC int ps_bufferattr_setshmmode(ps_bufferattr_t *attr, int mode);
+/**
+ * \brief set POSIX shm object name of a PS_BUFFER_SHMFD buffer
+ *
+ * Buffer is created if no object has this name yet, otherwise
+ * ps_buffer_init() attaches to it and takes flags and size from its
+ * creator. Creator unlinks the name in ps_buffer_destroy(). Without a
+ * name, an anonymous memfd is created.
+ * \param attr buffer attribute object
+ * \param name object name as for shm_open(), kept until ps_buffer_init()
+ * \return 0 on success, EINVAL if attr or name is NULL or ENOTSUP
+ *         if not supported
+ */
+__PS_PUBLIC int ps_bufferattr_setshmname(ps_bufferattr_t *attr, const char *name);
+/**
+ * \brief attach a PS_BUFFER_SHMFD buffer from its file descriptor
+ *
+ * fd is typically received with ps_buffer_recvfd(). It is duplicated,
+ * so caller still owns it. Flags and size come from buffer creator.
+ * \param attr buffer attribute object
+ * \param fd file descriptor or -1 to create a buffer
+ * \return 0 on success, EINVAL if attr is NULL or ENOTSUP if not supported
+ */
+__PS_PUBLIC int ps_bufferattr_setshmfd(ps_bufferattr_t *attr, int fd);
+/**
+ * \brief set packet payload alignment
+ *
+ * Every packet payload starts on an align boundary, which also keeps
+ * packets of different producers off each other's cache lines with
+ * align of 64. Buffer size is rounded down to a multiple of align.
+ * Processes attaching to a PS_BUFFER_PSHARED buffer must use the same
+ * alignment as its creator.
+ * \param attr buffer attribute object
+ * \param align power of two, PS_DEFAULT_ALIGN for no alignment
+ * \return 0 on success or EINVAL if attr is NULL or align is not valid
+ */
+__PS_PUBLIC int ps_bufferattr_setalign(ps_bufferattr_t *attr, size_t align);
+/**
+ * \brief back buffer data area with huge pages
+ *
+ * hugetlbfs pages are tried first (SHM_HUGETLB with PS_BUFFER_PSHARED,
+ * MAP_HUGETLB otherwise), then transparent huge pages for private
+ * buffers, then regular pages. Mapping size is rounded up to a huge page
+ * and so is buffer size with PS_BUFFER_MIRROR. ps_buffer_backing()
+ * tells what was obtained.
+ * \param attr buffer attribute object
+ * \param hugepages 1 to ask for huge pages, 0 for regular pages
+ * \return 0 on success, EINVAL if attr is NULL or ENOTSUP if not supported
+ */
+__PS_PUBLIC int ps_bufferattr_sethugepages(ps_bufferattr_t *attr, int hugepages);
+/**
+ * \brief set numa placement of buffer memory
+ *
+ * Data area, state and stats pages prefer node, or are interleaved over
+ * all allowed nodes with PS_NUMA_INTERLEAVE. Placement is applied by the
+ * buffer creator before memory is first touched. ps_buffer_numanode()
+ * tells where data area ended up.
+ * \param attr buffer attribute object
+ * \param node numa node, PS_NUMA_DEFAULT or PS_NUMA_INTERLEAVE
+ * \return 0 on success, EINVAL if attr is NULL or node is not valid or
+ *         ENOTSUP if not supported
+ */
+__PS_PUBLIC int ps_bufferattr_setnumanode(ps_bufferattr_t *attr, int node);
+/**
+ * \brief cap memory used for fake dma areas
+ *
+ * Fake dma areas handed out by ps_packet_dma() come from a per-buffer
+ * arena of power of two size classes which is reused without going
+ * back to the heap. Once limit bytes are held, cached areas are freed
+ * to make room and ps_packet_dma() fails with ENOMEM if that is not
+ * enough. Usage is reported in ps_stats_t.
+ * \param attr buffer attribute object
+ * \param limit bytes per process, 0 for no limit (default)
+ * \return 0 on success, EINVAL if attr is NULL
+ */
+__PS_PUBLIC int ps_bufferattr_setfakedmalimit(ps_bufferattr_t *attr, size_t limit);
+/**
+ * \brief set number of consumer groups
+ *
+ * With PS_BUFFER_BROADCAST each group reads every packet once, packets
+ * are shared by readers of the same group. Space is released when the
+ * slowest group has closed a packet. Number of groups is fixed for the
+ * lifetime of the buffer.
+ * \param attr buffer attribute object
+ * \param groups 1 (default) to PS_MAX_GROUPS
+ * \return 0 on success, EINVAL if attr is NULL or groups is out of range
+ */
+__PS_PUBLIC int ps_bufferattr_setgroups(ps_bufferattr_t *attr, int groups);
+/**
+ * \brief set interval between occupancy samples
+ *
+ * With PS_BUFFER_OCCUPANCY the first packet closed once interval has
+ * elapsed since last sample takes a new one.
+ * \param attr buffer attribute object
+ * \param nsec interval in nanoseconds, default is PS_DEFAULT_SAMPLE_INTERVAL
+ * \return 0 on success, EINVAL if attr is NULL or nsec is 0
+ */
+__PS_PUBLIC int ps_bufferattr_setsampleinterval(ps_bufferattr_t *attr, uint64_t nsec);
 
 /**  \} */
 
@@ -326,13 +725,53 @@ __PS_PUBLIC int ps_buffer_cancel(ps_buffer_t *buffer);
  * \brief acquire a copy of buffer statistics
  *
  * If PS_BUFFER_STATS was not defined when creating buffer, this call
- * always returns ENOTSUP. Thread-safe, but no synchronization is performed,
- * so returned statistics are not always correct.
+ * always returns ENOTSUP. Thread-safe. Counters are kept in shards updated
+ * with atomics by the threads using them and summed without blocking
+ * updaters; packet and byte counts of a snapshot always match.
  * \param buffer buffer
  * \param stats returned statisticts
  * \return 0 on success otherwise an error code
  */
 __PS_PUBLIC int ps_buffer_stats(ps_buffer_t *buffer, ps_stats_t *stats);
+/**
+ * \brief acquire change of buffer statistics since last call
+ *
+ * Counters, including utime and lock counters, are returned as the
+ * difference with the snapshot taken by the previous call in this
+ * process, or since buffer creation on first call. Fake dma usage, high-
+ * water marks, longest hold times, latency summaries and rates are
+ * returned as is. Thread-safe.
+ * \param buffer buffer
+ * \param delta returned statistics
+ * \return 0 on success otherwise an error code, ENOTSUP without
+ *         PS_BUFFER_STATS
+ */
+__PS_PUBLIC int ps_buffer_stats_delta(ps_buffer_t *buffer, ps_stats_t *delta);
+/**
+ * \brief acquire a copy of buffer latency histograms
+ *
+ * With PS_BUFFER_LATENCY every packet header carries the time its
+ * producer closed it and opening it records time spent in buffer.
+ * Each time a reader or writer blocks, time waited is recorded too.
+ * Same synchronization as ps_buffer_stats().
+ * \param buffer buffer
+ * \param hist returned histograms
+ * \return 0 on success, ENOTSUP if PS_BUFFER_LATENCY is not set
+ */
+__PS_PUBLIC int ps_buffer_histograms(ps_buffer_t *buffer, ps_histograms_t *hist);
+/**
+ * \brief acquire a copy of buffer occupancy samples and packet sizes
+ *
+ * With PS_BUFFER_OCCUPANCY, high-water marks of ps_stats_t are kept on
+ * every packet close and a sample is taken every sample interval, see
+ * ps_bufferattr_setsampleinterval(). A sample being overwritten while
+ * copied may be torn, which only happens if copying takes PS_SAMPLES
+ * intervals.
+ * \param buffer buffer
+ * \param occupancy returned samples and packet sizes
+ * \return 0 on success, ENOTSUP if PS_BUFFER_OCCUPANCY is not set
+ */
+__PS_PUBLIC int ps_buffer_occupancy(ps_buffer_t *buffer, ps_occupancy_t *occupancy);
 
 __PS_PUBLIC int ps_buffer_state_text(ps_buffer_t *buffer, FILE *stream);
 /**
@@ -344,6 +783,72 @@ __PS_PUBLIC int ps_buffer_state_text(ps_buffer_t *buffer, FILE *stream);
  * \return 0 on success otherwise an error code
  */
 __PS_PUBLIC int ps_buffer_getshmid(ps_buffer_t *buffer, int *shmid);
+/**
+ * \brief get buffer shared memory file descriptor
+ * \param buffer buffer
+ * \param fd returned file descriptor, -1 without PS_BUFFER_SHMFD
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_buffer_getshmfd(ps_buffer_t *buffer, int *fd);
+/**
+ * \brief pass buffer file descriptor over a UNIX domain socket
+ * \param buffer PS_BUFFER_SHMFD buffer
+ * \param sock connected AF_UNIX socket
+ * \return 0 on success, EINVAL if buffer has no file descriptor,
+ *         otherwise an error code
+ */
+__PS_PUBLIC int ps_buffer_sendfd(ps_buffer_t *buffer, int sock);
+/**
+ * \brief receive a buffer file descriptor sent with ps_buffer_sendfd()
+ * \param sock connected AF_UNIX socket
+ * \param fd returned file descriptor, pass it to ps_bufferattr_setshmfd()
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_buffer_recvfd(int sock, int *fd);
+/**
+ * \brief get memory backing of buffer data area
+ * \param buffer buffer
+ * \param backing returned PS_BACKING_PAGES, PS_BACKING_HUGETLB or
+ *                PS_BACKING_THP
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_buffer_backing(ps_buffer_t *buffer, int *backing);
+/**
+ * \brief get numa node of buffer data area
+ * \param buffer buffer
+ * \param node returned node holding first data area page, -1 if unknown
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_buffer_numanode(ps_buffer_t *buffer, int *node);
+/**
+ * \brief reclaim packets held by dead processes
+ *
+ * Packets opened for reading by a process which died are closed and
+ * packets it was writing are cancelled, so consumers skip them. Waiting
+ * calls on a PS_BUFFER_ROBUST buffer do this on their own every few
+ * milliseconds, so calling it is only needed to reclaim eagerly.
+ * This is thread-safe function.
+ * \param buffer PS_BUFFER_ROBUST buffer
+ * \return number of packets reclaimed, 0 without PS_BUFFER_ROBUST
+ */
+__PS_PUBLIC int ps_buffer_reap(ps_buffer_t *buffer);
+/**
+ * \brief grow or shrink buffer data area
+ *
+ * New producers and consumers are held off, open packets are waited for
+ * and unread packets are moved to a data area of the new size. Threads
+ * must not wait for a new packet while holding an open one, or this
+ * never returns. Packets left open by dead peers of a PS_BUFFER_ROBUST
+ * buffer are reaped meanwhile. Other processes attached to a
+ * PS_BUFFER_SHMFD buffer map the new data area when they next open a packet.
+ * This is thread-safe function.
+ * \param buffer buffer, not PS_BUFFER_SPSC, PS_BUFFER_MPMC,
+ *               PS_BUFFER_BROADCAST or a SysV PS_BUFFER_PSHARED buffer
+ * \param size new size, rounded like ps_buffer_init() does
+ * \return 0 on success, ENOBUFS if unread packets don't fit in size,
+ *         ENOTSUP for unsupported buffers, otherwise an error code
+ */
+__PS_PUBLIC int ps_buffer_resize(ps_buffer_t *buffer, size_t size);
 
 __PS_PUBLIC int ps_buffer_drain(ps_buffer_t *buffer);
 
@@ -369,6 +874,17 @@ __PS_PUBLIC int ps_packet_init(ps_packet_t *packet, ps_buffer_t *buffer);
  * \return 0 on success otherwise an error code
  */
 __PS_PUBLIC int ps_packet_destroy(ps_packet_t *packet);
+/**
+ * \brief set consumer group of packet
+ *
+ * Packets opened for reading on a PS_BUFFER_BROADCAST buffer consume
+ * from this group, group 0 after ps_packet_init().
+ * \param packet packet, not open
+ * \param group 0 to number of groups - 1
+ * \return 0 on success, EBUSY if packet is open or EINVAL if group
+ *         is out of range
+ */
+__PS_PUBLIC int ps_packet_setgroup(ps_packet_t *packet, int group);
 /**
  * \brief open packet
  *
@@ -376,6 +892,9 @@ __PS_PUBLIC int ps_packet_destroy(ps_packet_t *packet);
  * PS_PACKET_WRITE opens packet in write mode and PS_PACKET_READ in
  * read mode. If PS_PACKET_TRY is specified, all calls return EBUSY
  * instead of blocking if waiting for other threads is necessary.
+ * With PS_BUFFER_ROBUST a process can have 16 packets open at once,
+ * EAGAIN is returned beyond, and packets cancelled by a dead producer
+ * are skipped.
  * \param packet packet
  * \param flags PS_PACKET_WRITE or PS_PACKET_READ, possibly PS_PACKET_TRY
  * \return 0 on success otherwise an error code
@@ -387,6 +906,82 @@ __PS_PUBLIC int ps_packet_open(ps_packet_t *packet, ps_flags_t flags);
  * \return 0 on success otherwise an error code
  */
 __PS_PUBLIC int ps_packet_close(ps_packet_t *packet);
+/**
+ * \brief open a batch of packets for reading
+ *
+ * Claims up to max consecutive ready packets at once, blocking until
+ * at least one is ready unless PS_PACKET_TRY is given. All packets
+ * must be initialized, bound to the same buffer and have the same type
+ * mask (ps_packet_settypemask()). On success packets[0..*got) are open
+ * in read mode, in buffer order, and can be used like packets opened
+ * with ps_packet_open().
+ * \param packets packets to open
+ * \param max number of packets in packets array
+ * \param got returned number of opened packets
+ * \param flags PS_PACKET_READ, possibly PS_PACKET_TRY
+ * \return 0 on success, EINVAL if type masks differ, otherwise an error
+ *         code
+ */
+__PS_PUBLIC int ps_packet_open_batch(ps_packet_t *packets, size_t max, size_t *got, ps_flags_t flags);
+/**
+ * \brief close a batch of packets opened for reading
+ *
+ * Space of all packets is given back in a single step.
+ * \param packets packets opened with ps_packet_open_batch()
+ * \param count number of packets to close
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_packet_close_batch(ps_packet_t *packets, size_t count);
+/**
+ * \brief set packet type
+ *
+ * Type is kept in packet header, so consumers can pick packets by type
+ * without touching packet data. Type of a packet opened in write mode
+ * is 0 until set. PS_BUFFER_COMPACT headers have no room for a type.
+ * \param packet packet open in write mode
+ * \param type 0 to PS_PACKET_TYPES - 1
+ * \return 0 on success, EINVAL if packet is not open in write mode or
+ *         type is out of range, ENOTSUP for a type other than 0 with
+ *         PS_BUFFER_COMPACT
+ */
+__PS_PUBLIC int ps_packet_settype(ps_packet_t *packet, int type);
+/**
+ * \brief get packet type
+ * \param packet open packet
+ * \param type returned type
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_packet_gettype(ps_packet_t *packet, int *type);
+/**
+ * \brief set types of packets opened in read mode
+ *
+ * ps_packet_open() and ps_packet_open_batch() close packets of other
+ * types unread and go on with next one, these are counted as skipped
+ * in stats. Mask is PS_TYPE_ALL after ps_packet_init().
+ * \param packet packet, not open
+ * \param mask PS_TYPE_MASK() bits of types to read
+ * \return 0 on success, EBUSY if packet is open or EINVAL if mask is 0
+ */
+__PS_PUBLIC int ps_packet_settypemask(ps_packet_t *packet, uint32_t mask);
+/**
+ * \brief read packets and hand them to handlers by type
+ *
+ * Opens packets with ps_packet_open() and calls handlers[type] of each
+ * before closing it. Packets of types without a handler are skipped,
+ * as are types outside of packet type mask. Handlers must not close
+ * the packet.
+ * \param packet packet used to read, not open
+ * \param handlers handler table indexed by packet type, NULL entries
+ *        for types not handled
+ * \param count number of entries in handlers, up to PS_PACKET_TYPES
+ * \param arg passed to handlers
+ * \param flags 0 or PS_PACKET_TRY
+ * \return first non-zero handler return value, EBUSY with PS_PACKET_TRY
+ *         once no packet is ready, EINTR if buffer was cancelled or
+ *         another error code
+ */
+__PS_PUBLIC int ps_dispatch(ps_packet_t *packet, ps_handler_t *handlers, int count,
+			    void *arg, ps_flags_t flags);
 /**
  * \brief cancel packet
  *
@@ -458,6 +1053,70 @@ __PS_PUBLIC int ps_packet_read(ps_packet_t *packet, void *dest, size_t size);
  * \return 0 on success otherwise an error code
  */
 __PS_PUBLIC int ps_packet_write(ps_packet_t *packet, void *src, size_t size);
+#ifdef __PS_IOVEC
+/**
+ * \brief read data from packet into several memory areas
+ *
+ * Same as ps_packet_read() with iovcnt destination areas filled
+ * in order, but packet bounds are checked only once.
+ * \param packet packet
+ * \param iov destination memory areas
+ * \param iovcnt number of areas in iov
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_packet_readv(ps_packet_t *packet, const struct iovec *iov, int iovcnt);
+/**
+ * \brief write data from several memory areas to packet
+ *
+ * Same as ps_packet_write() called for each area in order, but space
+ * for all of them is reserved at once.
+ * \param packet packet
+ * \param iov source memory areas
+ * \param iovcnt number of areas in iov
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_packet_writev(ps_packet_t *packet, const struct iovec *iov, int iovcnt);
+/**
+ * \brief direct memory access to rest of packet without copying
+ *
+ * Returns packet data from current position to end of packet as one
+ * or two areas of buffer data area, two when packet wraps around
+ * buffer end, and moves current position to end of packet. Unlike
+ * ps_packet_dma() nothing is ever copied to a fake dma area.
+ * \param packet packet opened for reading or with size set
+ * \param iov returned memory areas
+ * \param cnt returned number of areas in iov, 0 at end of packet
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_packet_view(ps_packet_t *packet, struct iovec iov[2], int *cnt);
+/**
+ * \brief write rest of packet to a file descriptor
+ *
+ * Data is written with writev() right from buffer data area, a packet
+ * wrapping around buffer end costs no copy. Short writes are retried
+ * until whole packet is written. Current position moves by bytes
+ * written, also when an error is returned.
+ * \param packet packet opened for reading or with size set
+ * \param fd file descriptor
+ * \param written returned number of bytes written
+ * \return 0 on success otherwise an error code from writev()
+ */
+__PS_PUBLIC int ps_packet_write_to_fd(ps_packet_t *packet, int fd, size_t *written);
+/**
+ * \brief read data from a file descriptor into packet
+ *
+ * Reserves size bytes at current position like ps_packet_write() and
+ * fills them with a single readv() straight into buffer data area.
+ * Current position moves by bytes read, which may be less than size,
+ * 0 at end of file.
+ * \param packet packet opened for writing
+ * \param fd file descriptor
+ * \param size bytes to read at most
+ * \param got returned number of bytes read
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_packet_fill_from_fd(ps_packet_t *packet, int fd, size_t size, size_t *got);
+#endif
 /**
  * \brief acquire direct memory access to packet
  *
@@ -465,7 +1124,8 @@ __PS_PUBLIC int ps_packet_write(ps_packet_t *packet, void *src, size_t size);
  * contiguous data and moves current read/write position by size bytes.
  *
  * Since buffer is circular, packet data area may span over buffer boundary
- * so this function is not guaranteed to succeed. However if PS_ACCEPT_FAKE_DMA
+ * so this function is not guaranteed to succeed unless buffer was created
+ * with PS_BUFFER_MIRROR. However if PS_ACCEPT_FAKE_DMA
  * flag is given, this function returns fake dma address, which behaves
  * like normal direct memory access area with exception that data is actually
  * written to buffer when packet is closed.
@@ -479,6 +1139,69 @@ __PS_PUBLIC int ps_packet_dma(ps_packet_t *packet, void **mem, size_t size, ps_f
 
 /**  \} */
 
+#ifdef __PS_SINK
+/**
+ * \addtogroup sink
+ *  \{
+ */
+
+/** default sink I/O size */
+#define PS_SINK_DEFAULT_IO_SIZE (1024 * 1024)
+/** default number of sink I/Os in flight */
+#define PS_SINK_DEFAULT_DEPTH   8
+
+/**
+ * \brief initialize file sink
+ *
+ * Data is appended at current file offset of fd. If fd was opened with
+ * O_DIRECT, offset must be a multiple of 4096 and I/Os are issued in
+ * whole 4096 byte blocks; ps_sink_flush() pads last block and truncates
+ * file back to data length. Without io_uring support, or when the system
+ * disables it, I/Os are written synchronously. Buffer should hold several times io_size * depth bytes
+ * since packets stay open until their I/O completes.
+ * \param sink sink to initialize
+ * \param buffer buffer to consume packets from
+ * \param fd file descriptor opened for writing
+ * \param io_size bytes per I/O, 0 for PS_SINK_DEFAULT_IO_SIZE
+ * \param depth I/Os in flight, at least 2, 0 for PS_SINK_DEFAULT_DEPTH
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_sink_init(ps_sink_t *sink, ps_buffer_t *buffer, int fd,
+			     size_t io_size, int depth);
+/**
+ * \brief move ready packets to file
+ *
+ * Stages ready packets, submits full I/Os and retires completed ones,
+ * closing their packets. When no packet is ready, staged data is
+ * submitted and one I/O in flight is waited for. With nothing in
+ * flight either, blocks until a packet is ready unless PS_PACKET_TRY
+ * is given. Call in a loop from a single thread.
+ * \param sink sink
+ * \param flags 0 or PS_PACKET_TRY
+ * \return 0 on success, EBUSY with PS_PACKET_TRY if there was nothing
+ *         to do, EINTR if buffer was cancelled, otherwise an error code
+ */
+__PS_PUBLIC int ps_sink_poll(ps_sink_t *sink, ps_flags_t flags);
+/**
+ * \brief write all staged data and wait for I/Os in flight
+ *
+ * All packets taken by sink are closed when this returns.
+ * \param sink sink
+ * \return 0 on success otherwise first I/O error
+ */
+__PS_PUBLIC int ps_sink_flush(ps_sink_t *sink);
+/**
+ * \brief flush and destroy file sink
+ *
+ * File descriptor is left open.
+ * \param sink sink to destroy
+ * \return 0 on success otherwise an error code from ps_sink_flush()
+ */
+__PS_PUBLIC int ps_sink_destroy(ps_sink_t *sink);
+
+/**  \} */
+#endif
+
 /**
  * \ingroup stats
  * \brief write nicely formatted statistics to given stream
@@ -488,6 +1211,44 @@ __PS_PUBLIC int ps_packet_dma(ps_packet_t *packet, void **mem, size_t size, ps_f
  */
 __PS_PUBLIC int ps_stats_text(ps_stats_t *stats, FILE *stream);
 
+/**
+ * \ingroup stats
+ * \brief write statistics to given stream as one JSON object
+ *
+ * Every ps_stats_t field is written under its own name, ps_latency_t and
+ * ps_lockstats_t fields as nested objects. Times are in nanoseconds.
+ * \param stats statistics
+ * \param stream stream
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_stats_json(ps_stats_t *stats, FILE *stream);
+
+/**
+ * \ingroup stats
+ * \brief write statistics to given stream in OpenMetrics text format
+ *
+ * Metrics are prefixed with packetstream_, times are in seconds and the
+ * exposition is terminated with # EOF.
+ * \param stats statistics
+ * \param labels labels added to every sample, e.g. buffer="rx", or NULL
+ * \param stream stream
+ * \return 0 on success otherwise an error code
+ */
+__PS_PUBLIC int ps_stats_openmetrics(ps_stats_t *stats, const char *labels, FILE *stream);
+
+/**
+ * \ingroup stats
+ * \brief get percentile of a histogram
+ *
+ * Returned value is the upper bound of the bucket the percentile falls
+ * in, but never above largest value.
+ * \param hist histogram
+ * \param percentile 0 to 100
+ * \param nsec returned value, 0 if histogram is empty
+ * \return 0 on success, EINVAL if percentile is out of range
+ */
+__PS_PUBLIC int ps_histogram_percentile(ps_histogram_t *hist, double percentile, uint64_t *nsec);
+
 /**  \} */
 
 #ifdef __cplusplus